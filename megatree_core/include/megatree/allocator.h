@@ -2,80 +2,268 @@
 #define MEGATREE_ALLOCATOR_H
 
 #include <vector>
+#include <string>
+#include <new>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread/mutex.hpp>
-#include <cstdio>
+#include <boost/thread/tss.hpp>
+#include <cassert>
 
 namespace megatree
 {
 
+// How the chunks of the allocators are backed.  With huge pages the
+// chunks are rounded up to whole huge pages.  Explicit huge pages come
+// from the reserved pool (vm.nr_hugepages); when the pool is empty, the
+// chunks fall back to transparent huge pages, and to plain heap memory
+// when those can't be mapped either.
+enum HugePageMode
+{
+  NO_HUGE_PAGES,
+  TRANSPARENT_HUGE_PAGES,
+  EXPLICIT_HUGE_PAGES
+};
+
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+// Applies to chunks allocated after the call, so set it before the
+// caches fill up.
+void setHugePageMode(HugePageMode mode);
+HugePageMode getHugePageMode();
+HugePageMode parseHugePageMode(const std::string& name);
+std::string hugePageModeName(HugePageMode mode);
+
+// Allocates at least "bytes" bytes of memory for a chunk, following the
+// huge page mode, and sets "bytes" to the size of the chunk.
+void* allocateChunk(size_t& bytes, bool& mapped);
+void freeChunk(void* chunk, size_t bytes, bool mapped);
 
-template <class T>
+
+// Slab allocator for objects of one type.
+//
+// The objects are carved out of chunks of "chunk_size" objects (or more,
+// when the chunks are rounded up to huge pages), and a
+// new chunk is only allocated when all objects handed out so far are in
+// use, so the allocator never runs dry.  Freed objects are not
+// destructed: they are recycled as they are, and only get destructed
+// when the allocator goes away.
+//
+// Each thread keeps two magazines of free objects, and only goes to the
+// shared depot (and its mutex) to exchange a whole magazine of objects
+// once both of its magazines are empty or full.  When a thread exits, it
+// returns its magazines to the depot.  Objects may be freed by another
+// thread than the one that allocated them.
+template <class T, unsigned MAGAZINE_SIZE = 64>
 class Allocator
 {
-public:
-  Allocator(unsigned size=0)
-    : objects(NULL), overflow(0)
+  struct Magazine
   {
-    objects = new T[size];
-    obj_stack.reserve(size);
-    assert(objects);
-    for (unsigned i=0; i<size; i++)
-      obj_stack.push_back(&objects[i]);
+    Magazine(): count(0) {}
 
-    printf("Allocator for %d objects takes %d bytes\n", (int)size, (int)(size*sizeof(T)));
-  }
+    T* objects[MAGAZINE_SIZE];
+    unsigned count;
+  };
+
+  struct Chunk
+  {
+    T* objects;
+    size_t size;  // in objects
+    size_t bytes;
+    bool mapped;
+  };
+
+  // The state shared by all threads.  It outlives the allocator for as
+  // long as threads still hold magazines.
+  struct Depot
+  {
+    Depot(size_t _chunk_size)
+      : chunk_size(_chunk_size), carved(0), num_objects(0), num_bytes(0)
+    {}
+
+    ~Depot()
+    {
+      for (size_t i = 0; i < chunks.size(); i++)
+      {
+        size_t n = (i + 1 == chunks.size()) ? carved : chunks[i].size;
+        for (size_t j = 0; j < n; j++)
+          chunks[i].objects[j].~T();
+        freeChunk(chunks[i].objects, chunks[i].bytes, chunks[i].mapped);
+      }
+      for (size_t i = 0; i < full.size(); i++)
+        delete full[i];
+      for (size_t i = 0; i < empty.size(); i++)
+        delete empty[i];
+    }
+
+    void addChunk()
+    {
+      Chunk chunk;
+      chunk.bytes = chunk_size * sizeof(T);
+      chunk.objects = static_cast<T*>(allocateChunk(chunk.bytes, chunk.mapped));
+      chunk.size = chunk.bytes / sizeof(T);
+      chunks.push_back(chunk);
+      carved = 0;
+      num_bytes += chunk.bytes;
+    }
+
+    // Swaps an empty magazine for one with free objects.  Must be
+    // called with the mutex locked.
+    Magazine* exchangeEmpty(Magazine* magazine)
+    {
+      if (!full.empty())
+      {
+        empty.push_back(magazine);
+        magazine = full.back();
+        full.pop_back();
+        return magazine;
+      }
+
+      // Carves a magazine worth of new objects
+      for (; magazine->count < MAGAZINE_SIZE; magazine->count++)
+      {
+        if (chunks.empty() || carved == chunks.back().size)
+          addChunk();
+        magazine->objects[magazine->count] = new (&chunks.back().objects[carved++]) T;
+        num_objects++;
+      }
+      return magazine;
+    }
+
+    // Swaps a full magazine for an empty one.  Must be called with the
+    // mutex locked.
+    Magazine* exchangeFull(Magazine* magazine)
+    {
+      full.push_back(magazine);
+      if (empty.empty())
+        return new Magazine;
+      magazine = empty.back();
+      empty.pop_back();
+      return magazine;
+    }
+
+    boost::mutex mutex;
+    size_t chunk_size;
+    size_t carved;  // number of objects constructed in the last chunk
+    size_t num_objects;
+    size_t num_bytes;
+    std::vector<Chunk> chunks;
+    std::vector<Magazine*> full;  // magazines with at least one free object
+    std::vector<Magazine*> empty;
+  };
+
+  struct ThreadCache
+  {
+    ThreadCache(const boost::shared_ptr<Depot>& _depot)
+      : depot(_depot), loaded(new Magazine), previous(new Magazine)
+    {}
 
-  ~Allocator()
+    ~ThreadCache()
+    {
+      boost::mutex::scoped_lock lock(depot->mutex);
+      (loaded->count ? depot->full : depot->empty).push_back(loaded);
+      (previous->count ? depot->full : depot->empty).push_back(previous);
+    }
+
+    boost::shared_ptr<Depot> depot;
+    Magazine* loaded;
+    Magazine* previous;
+  };
+
+public:
+  Allocator(size_t chunk_size=1024)
+    : depot(new Depot(chunk_size)), thread_cache(&releaseCache)
   {
-    boost::mutex::scoped_lock lock(mutex);
-    delete [] objects;
+    assert(chunk_size >= 1);
   }
 
   T* allocate()
   {
-    boost::mutex::scoped_lock lock(mutex);
-    assert(!obj_stack.empty());
-    T* obj = obj_stack.back();
-    obj_stack.pop_back();
-    return obj;
+    ThreadCache* cache = threadCache();
+    if (cache->loaded->count == 0)
+    {
+      std::swap(cache->loaded, cache->previous);
+      if (cache->loaded->count == 0)
+      {
+        boost::mutex::scoped_lock lock(depot->mutex);
+        cache->loaded = depot->exchangeEmpty(cache->loaded);
+      }
+    }
+    return cache->loaded->objects[--cache->loaded->count];
   }
 
   void allocateMany(size_t howmany, std::vector<T*> &vec)
   {
-    boost::mutex::scoped_lock lock(mutex);
-    assert(obj_stack.size() >= howmany);
-
-    typename std::vector<T*>::iterator begin = obj_stack.end() - howmany;
-
-    // Moves begin..obj_stack.end() from obj_stack to vec
     vec.clear();
     vec.reserve(howmany);
-    vec.insert(vec.begin(), begin, obj_stack.end());
-    obj_stack.erase(begin, obj_stack.end());
+    for (size_t i = 0; i < howmany; i++)
+      vec.push_back(allocate());
   }
 
-
   void deAllocate(T* obj)
   {
-    boost::mutex::scoped_lock lock(mutex);
-    obj_stack.push_back(obj);
+    ThreadCache* cache = threadCache();
+    if (cache->loaded->count == MAGAZINE_SIZE)
+    {
+      std::swap(cache->loaded, cache->previous);
+      if (cache->loaded->count == MAGAZINE_SIZE)
+      {
+        boost::mutex::scoped_lock lock(depot->mutex);
+        cache->loaded = depot->exchangeFull(cache->loaded);
+      }
+    }
+    cache->loaded->objects[cache->loaded->count++] = obj;
   }
 
   void deallocateMany(std::vector<T*> &vec)
   {
-    boost::mutex::scoped_lock lock(mutex);
-    obj_stack.insert(obj_stack.end(), vec.begin(), vec.end());
+    for (size_t i = 0; i < vec.size(); i++)
+      deAllocate(vec[i]);
     vec.clear();
   }
 
+  // The number of bytes taken by the chunks.
+  size_t footprint()
+  {
+    boost::mutex::scoped_lock lock(depot->mutex);
+    return depot->num_bytes;
+  }
+
+  // The number of objects that were ever constructed, in use or free.
+  size_t capacity()
+  {
+    boost::mutex::scoped_lock lock(depot->mutex);
+    return depot->num_objects;
+  }
+
 
 private:
-  boost::mutex mutex;
-  T* objects;
-  std::vector<T*> obj_stack;
-  unsigned overflow;
+  Allocator(const Allocator&);
+  Allocator& operator=(const Allocator&);
+
+  ThreadCache* threadCache()
+  {
+    ThreadCache* cache = thread_cache.get();
+
+    // A cache left behind by an allocator that lived at the same address
+    if (cache && cache->depot != depot)
+      cache = NULL;
+
+    if (!cache)
+    {
+      cache = new ThreadCache(depot);
+      thread_cache.reset(cache);
+    }
+    return cache;
+  }
+
+  static void releaseCache(ThreadCache* cache)
+  {
+    delete cache;
+  }
 
+  // The thread caches are released before the depot
+  boost::shared_ptr<Depot> depot;
+  boost::thread_specific_ptr<ThreadCache> thread_cache;
 };
 
 }
@@ -2,13 +2,37 @@
 #define MEGATREE_CACHE_H
 
 #include <boost/shared_ptr.hpp>
+#include <algorithm>
+#include <cassert>
 #include <list>
+#include <string>
 #include <tr1/unordered_map>
 #include <megatree/list.h>
 
 namespace megatree
 {
 
+// Which objects a cache gives up first.
+//
+// LRU evicts the least recently used object.  CLOCK approximates LRU
+// without reordering the cache on every hit: hits only mark the object,
+// and eviction gives marked objects a second chance.  2Q keeps new
+// objects in a FIFO queue of their own, and only promotes objects that
+// are used again well after they were loaded, or that come back after
+// they were evicted from it.  The uses of an object right after it is
+// loaded don't count, so a single scan over many objects doesn't push
+// out the objects that are used over and over.
+enum CachePolicy
+{
+  LRU_CACHE_POLICY,
+  CLOCK_CACHE_POLICY,
+  TWO_QUEUE_CACHE_POLICY
+};
+
+// Converts between policies and their names ("lru", "clock", "2q")
+CachePolicy parseCachePolicy(const std::string& name);
+std::string cachePolicyName(CachePolicy policy);
+
 template <class K, class T>
 class CacheIterator;
 
@@ -24,12 +48,15 @@ public:
   class Storage
   {
     public:
-      Storage(const K& _id, T* _object):
-        id(_id), object(_object)
+      Storage(const K& _id, T* _object, bool _probation=false, size_t _inserted=0):
+        id(_id), object(_object), referenced(false), probation(_probation), inserted(_inserted)
       {}
 
       K id;
       T* object;
+      bool referenced;  // CLOCK: used since eviction last passed by
+      bool probation;  // 2Q: in the queue of new objects
+      size_t inserted;  // 2Q: number of objects added to the new queue before this one
   };
 
   typedef List<Storage > ObjList;
@@ -39,6 +66,98 @@ public:
 
   typedef CacheIterator<K, T> iterator;
 
+  Cache(CachePolicy _policy=LRU_CACHE_POLICY)
+    : policy(_policy), probation_size(0), num_inserted(0)
+  {}
+
+  // Only while the cache is empty
+  void setPolicy(CachePolicy _policy)
+  {
+    assert(hash_.empty());
+    policy = _policy;
+    ghost_list.clear();
+    ghost_hash.clear();
+  }
+
+  CachePolicy getPolicy() const
+  {
+    return policy;
+  }
+
+
+  // Adds a new object, where the policy wants it.
+  void insert(const K& id, T* object)
+  {
+    if (policy == TWO_QUEUE_CACHE_POLICY)
+    {
+      // Objects that were evicted from the new queue not too long ago
+      // are used more than once, and go straight to the main queue.
+      typename GhostMap::iterator ghost_it = ghost_hash.find(id);
+      if (ghost_it == ghost_hash.end())
+      {
+        probation_list.push_front(Storage(id, object, true, num_inserted++));
+        hash_.insert(typename std::pair<K, ObjListIterator>(id, probation_list.frontIterator()));
+        probation_size++;
+        return;
+      }
+      ghost_list.erase(ghost_it->second.getNode());
+      ghost_hash.erase(ghost_it);
+    }
+    push_front(id, object);
+  }
+
+  // Tells the policy that an object in the cache is used.
+  void touch(iterator &it)
+  {
+    switch (policy)
+    {
+    case LRU_CACHE_POLICY:
+      list_.moveToFront(it.getNode());
+      break;
+    case CLOCK_CACHE_POLICY:
+      it.getNode()->object.referenced = true;
+      break;
+    case TWO_QUEUE_CACHE_POLICY:
+      if (!it.getNode()->object.probation)
+        list_.moveToFront(it.getNode());
+
+      // The new queue is FIFO, and only uses after an object made it
+      // halfway through the queue promote it.
+      else if ((num_inserted - it.getNode()->object.inserted) * 2 > probation_size)
+      {
+        it.getNode()->object.probation = false;
+        list_.spliceToFront(probation_list, it.getNode());
+        probation_size--;
+      }
+      break;
+    }
+  }
+
+  // Iterates over the objects in the order they should be evicted, with
+  // previous().  The policy may pass over objects with spare().
+  iterator iterateVictims()
+  {
+    // 2Q evicts from the new queue while it holds more than its share
+    if (policy == TWO_QUEUE_CACHE_POLICY && probation_size * PROBATION_SHARE > hash_.size())
+      return CacheIterator<K, T>(this, probation_list.backIterator(), list_.backIterator());
+    return CacheIterator<K, T>(this, list_.backIterator(), probation_list.backIterator());
+  }
+
+  // Gives the object of a victim iterator a second chance, if the policy
+  // wants to.  Moves the iterator on to the next victim and returns true
+  // if it does.
+  bool spare(iterator &it)
+  {
+    if (policy != CLOCK_CACHE_POLICY || !it.getNode()->object.referenced)
+      return false;
+
+    ListNode<Storage>* node = it.getNode();
+    it.previous();
+    node->object.referenced = false;
+    list_.moveToFront(node);
+    return true;
+  }
+
 
   bool exists(const K& id)
   {
@@ -50,9 +169,10 @@ public:
     return false;
   }
 
+  // Iterates over all objects, with next()
   iterator iterate()
   {
-    return CacheIterator<K, T>(this, list_.frontIterator());
+    return CacheIterator<K, T>(this, list_.frontIterator(), probation_list.frontIterator());
   }
   iterator iterateBack()
   {
@@ -101,7 +221,22 @@ public:
   void erase(iterator &it)
   {
     hash_.erase(it.id());
-    list_.erase(it.getNode());
+    if (!it.getNode()->object.probation)
+    {
+      list_.erase(it.getNode());
+      return;
+    }
+
+    // Remembers the objects evicted from the new queue, for a while
+    ghost_list.push_front(it.id());
+    ghost_hash.insert(typename std::pair<K, ListIterator<K> >(it.id(), ghost_list.frontIterator()));
+    while (ghost_hash.size() > std::max(hash_.size() / GHOST_SHARE, MIN_GHOSTS))
+    {
+      ghost_hash.erase(ghost_list.back());
+      ghost_list.pop_back();
+    }
+    probation_list.erase(it.getNode());
+    probation_size--;
   }
 
 #if 0
@@ -126,7 +261,11 @@ public:
   void clear()
   {
     list_.clear();
+    probation_list.clear();
     hash_.clear();
+    ghost_list.clear();
+    ghost_hash.clear();
+    probation_size = 0;
   }
 
 
@@ -165,13 +304,32 @@ public:
   }
 
 
+  // The main queue.  The LRU and CLOCK policies keep all objects here.
   ObjList list_;
   ObjMap hash_;
 
 
 private:
+  typedef std::tr1::unordered_map<K, ListIterator<K> > GhostMap;
+
+  // 2Q: the new queue holds up to a quarter of the objects before it
+  // gets evicted first, and half as many ids of evicted objects are
+  // remembered as there are objects.
+  static const size_t PROBATION_SHARE = 4;
+  static const size_t GHOST_SHARE = 2;
+  static const size_t MIN_GHOSTS = 64;
+
+  CachePolicy policy;
+  ObjList probation_list;
+  size_t probation_size, num_inserted;
+  List<K> ghost_list;  // front is most recently evicted
+  GhostMap ghost_hash;
 };
 
+template <class K, class T> const size_t Cache<K, T>::PROBATION_SHARE;
+template <class K, class T> const size_t Cache<K, T>::GHOST_SHARE;
+template <class K, class T> const size_t Cache<K, T>::MIN_GHOSTS;
+
 
 
 
@@ -190,23 +348,40 @@ public:
     b(_b),
     it(_it){};
 
+  // Continues with "_then" once "_it" runs off the end of its list
+  CacheIterator(Cache<K, T>* _b, typename Cache<K, T>::ObjListIterator _it,
+                typename Cache<K, T>::ObjListIterator _then):
+    b(_b),
+    it(_it),
+    then(_then)
+  {
+    if (it.finished())
+      continueWithThen();
+  }
+
   CacheIterator(const CacheIterator<K, T> & ci): 
     b(ci.b),
-    it(ci.it){};
+    it(ci.it),
+    then(ci.then){};
 
   void operator =(const CacheIterator<K, T> & ci)
   {
     b = ci.b;
     it = ci.it;
+    then = ci.then;
   }
 
   void next()
   {
     it.next();
+    if (it.finished())
+      continueWithThen();
   }
   void previous()
   {
     it.previous();
+    if (it.finished())
+      continueWithThen();
   }
 
   T* get()
@@ -235,8 +410,14 @@ public:
   }
   
 private:
+  void continueWithThen()
+  {
+    it = then;
+    then = typename Cache<K, T>::ObjListIterator();
+  }
+
   Cache<K, T>* b;
-  typename Cache<K, T>::ObjListIterator it;
+  typename Cache<K, T>::ObjListIterator it, then;
 };
 
 
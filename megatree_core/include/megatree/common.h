@@ -4,11 +4,12 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <boost/date_time/posix_time/posix_time_types.hpp>
 
 namespace megatree {
 
-int parseNumberSuffixed(const char* s);
+int64_t parseNumberSuffixed(const char* s);
 
   class Tictoc
   {
@@ -241,6 +241,32 @@ namespace megatree
       list_back = node;
     }
 
+    // Moves a node of another list to the front of this list.  The node
+    // stays the same, so iterators to it remain valid.
+    void spliceToFront(List& from, ListNode<T>* node)
+    {
+      assert(node);
+
+      //first, we want to remove the node from the other list
+      if (node->previous)
+        node->previous->next = node->next;
+      else
+        from.list_front = node->next;
+      if (node->next)
+        node->next->previous = node->previous;
+      else
+        from.list_back = node->previous;
+
+      //next, we want to put the node on the front of this list
+      node->previous = NULL;
+      node->next = list_front;
+      if (list_front)
+        list_front->previous = node;
+      list_front = node;
+      if (!list_back)
+        list_back = node;
+    }
+
     void spliceToBack(List& splice_list)
     {
       //make sure the back of the list points to the spliced list as its next
@@ -266,6 +292,12 @@ namespace megatree
       return list_front == NULL && list_back == NULL;
     }
 
+    void clear()
+    {
+      while (list_front)
+        pop_front();
+    }
+
 
   private:
     ListNode<T>* list_front;
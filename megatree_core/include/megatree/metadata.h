@@ -1,6 +1,7 @@
 #ifndef MEGATREE_METADATA_H
 #define MEGATREE_METADATA_H
 
+#include <string>
 #include <megatree/tree_common.h>
 
 namespace megatree
@@ -9,11 +10,12 @@ namespace megatree
 class MetaData
 {
 public:
-  MetaData() {};
+  MetaData() : compression("none"), node_layout("compact") {};
   MetaData(unsigned _version, unsigned _subtree_width, unsigned _subfolder_depth,
            double _min_cell_size, double _root_size, const std::vector<double>& _root_center)
     : version(_version), subtree_width(_subtree_width), subfolder_depth(_subfolder_depth),
-      min_cell_size(_min_cell_size), root_size(_root_size), root_center(_root_center) 
+      min_cell_size(_min_cell_size), root_size(_root_size), root_center(_root_center),
+      compression("none"), node_layout("compact")
   {}
 
   void deserialize(const ByteVec& data);
@@ -24,6 +26,14 @@ public:
   double min_cell_size, root_size;
   std::vector<double> root_center;
 
+  // Codec the node files are compressed with, "none" if they are not.
+  // Optional in metadata.ini, and only written if it's not "none".
+  std::string compression;
+
+  // Layout of the node files, "compact" or "indexed" (see
+  // node_file_format.h).  Optional, and only written if it's not "compact".
+  std::string node_layout;
+
 }; // class
 } // namespace
 
@@ -0,0 +1,173 @@
+#ifndef MEGATREE_NODE_FILE_FORMAT_H
+#define MEGATREE_NODE_FILE_FORMAT_H
+
+#include <vector>
+#include <string>
+#include <megatree/tree_common.h>
+
+namespace megatree
+{
+
+// Layout of the serialized node files.
+//
+// Version 11:  [child files]  followed by fixed size records of
+//   point (6) | color (3) | count (8) | children (1) | short id (4)
+//
+// Version 12:  [child files] [trie depth] [flags] [trie masks]  followed by
+//   point (6) | color (3) | children (1) | count (varint)
+//
+// In version 12 the short ids are not stored with the nodes.  The set
+// of short ids is written as a trie over their octal digits instead:
+// one byte for every trie position above the deepest level, listing
+// which of its 8 children exist, in breadth first order.  The records
+// follow in the same breadth first order, which is the order of their
+// short ids.
+//
+// In a regular node file all nodes are at the same depth, so only the
+// positions at the deepest level of the trie are records.  In the root
+// node file the short ids carry a marker bit and the nodes span several
+// levels: every position in the trie is a record there, starting with
+// the root node (short id 1).
+//
+// With NODE_FILE_RESIDUALS, the points and colors are written before
+// the records instead of in them, as residuals against a prediction
+// from the parent trie position:
+//   [residuals of every trie position] [children (1) | count (varint)]...
+// A child's point is predicted to be its parent's point, moved into the
+// child's cell, and its color to be the parent's color.  The trie
+// positions above the nodes of a regular node file hold the count
+// weighted average of the nodes below them, like the nodes in the tree
+// would.  Every residual is a zigzag encoded varint.  The encoder only
+// uses residuals when that comes out smaller.
+//
+// With NODE_FILE_INDEXED, any node can be found straight from the
+// buffer, without decoding the file.  The header and the records are
+// fixed size, and a rank directory follows the trie masks:
+//   [child files] [trie depth] [flags] [count size] [number of masks (4)]
+//   [trie masks] [rank directory] followed by
+//   point (6) | color (3) | children (1) | count (count size)
+// The rank directory holds the number of set bits before every 64th bit
+// of the masks, as 4 byte integers.  The children of the trie position
+// at breadth first index j then start at index 1 + rank(8 j), so looking
+// up a node takes one rank computation per level of the trie.
+
+const static int V12_HEADER_SIZE = 3;  // child files, trie depth, flags
+const static int V12_FIXED_RECORD_SIZE = POINT_SIZE + COLOR_SIZE + CHILDREN_SIZE;
+const static int MAX_VARINT_SIZE = 10;  // 64 bits, 7 bits per byte
+const static int INDEXED_HEADER_SIZE = 8;  // child files, trie depth, flags, count size, number of masks
+
+// Flags in the header of a version 12 node file
+enum NodeFileFlags
+{
+  NODE_FILE_ROOT = 0x01,      // every trie position is a record
+  NODE_FILE_RESIDUALS = 0x02,  // points and colors are parent predicted residuals
+  NODE_FILE_INDEXED = 0x04     // fixed size records with a rank directory
+};
+
+
+// How the node files of a tree are laid out.  The compact layout is the
+// smallest, the indexed layout lets lazily loaded files find single
+// nodes without decoding the whole file.
+enum NodeLayout
+{
+  COMPACT_NODE_LAYOUT = 0,
+  INDEXED_NODE_LAYOUT = 1
+};
+
+// Converts between layouts and their names in metadata.ini
+NodeLayout parseNodeLayout(const std::string& name);
+std::string nodeLayoutName(NodeLayout layout);
+
+
+// The contents of a node, as it gets serialized
+struct NodeRecord
+{
+  Point point[3];
+  Color color[3];
+  uint8_t children;
+  Count count;
+};
+
+
+// Encodes a version 12 node file.  The short ids must be sorted, and
+// the records are in the same order.  "depth" is the number of octal
+// digits in the short ids of a regular node file, and is ignored for
+// the root file.
+void encodeNodeFile(uint8_t child_files, unsigned depth, bool root_file,
+                    const std::vector<ShortId>& short_ids, const std::vector<NodeRecord>& records,
+                    ByteVec& buffer, NodeLayout layout = COMPACT_NODE_LAYOUT);
+
+// Decodes a version 12 node file in either layout.  Returns false if
+// the file is corrupt.
+bool decodeNodeFile(const uint8_t* data, size_t size, uint8_t& child_files,
+                    std::vector<ShortId>& short_ids, std::vector<NodeRecord>& records);
+
+
+// Writes the header (except the child files byte) and the trie of a
+// version 12 node file, for a file without residuals.
+void encodeShortIds(const std::vector<ShortId>& short_ids, unsigned depth, bool root_file, ByteVec& buffer);
+
+// Reads the short ids of a version 12 node file from its trie, in the
+// order of the records.  Returns the offset after the trie, or 0 if the
+// file is corrupt.
+size_t decodeShortIds(const uint8_t* data, size_t size, std::vector<ShortId>& short_ids);
+
+
+// Finds single nodes in an indexed node file, without decoding it.  The
+// reader points into the buffer, which has to outlive it.
+class IndexedNodeFileReader
+{
+public:
+  IndexedNodeFileReader();
+
+  // Returns false if the buffer is not an indexed node file.
+  bool open(const uint8_t* data, size_t size);
+
+  size_t numRecords() const { return num_records; }
+
+  // Finds the index of the record with the given short id.  Returns false
+  // if the node is not in the file.
+  bool find(ShortId short_id, size_t& index) const;
+
+  void read(size_t index, NodeRecord& record) const;
+
+private:
+  // Number of set mask bits before the given bit.
+  uint32_t rank(size_t bit) const;
+
+  const uint8_t* masks;
+  const uint8_t* directory;
+  const uint8_t* records;
+  size_t num_masks, num_records, record_size;
+  unsigned depth, count_size;
+  bool root_file;
+};
+
+
+inline void writeVarint(uint64_t value, uint8_t* data, size_t& offset)
+{
+  while (value >= 0x80)
+  {
+    data[offset++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  data[offset++] = value;
+}
+
+// Stops at "size" if the varint is cut off.
+inline uint64_t readVarint(const uint8_t* data, size_t size, size_t& offset)
+{
+  uint64_t value = 0;
+  for (unsigned shift = 0; offset < size; shift += 7)
+  {
+    uint8_t byte = data[offset++];
+    value |= uint64_t(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      break;
+  }
+  return value;
+}
+
+}
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef MEGATREE_SHORT_ID_H
+#define MEGATREE_SHORT_ID_H
+
+#include <megatree/tree_common.h>
+
+namespace megatree
+{
+
+// A short id holds the path from the top of its node file down to the
+// node, as one octal digit per level, with the first step in the most
+// significant digit.  Each digit has a bit for every axis:
+//
+// ID:  0123456789abcdefgh  (0 is high bit)
+//  x:  0  3  6  9  c  f
+//  y:   1  4  7  a  d  g
+//  z:    2  5  8  b  e  h
+
+
+// Collects the bits of one axis (X_BIT, Y_BIT or Z_BIT) from all octal
+// digits of a short id, in the same order.  Works for any subtree
+// width up to 10, without looping over the digits.
+inline uint32_t shortIdAxis(ShortId short_id, int axis_bit)
+{
+  uint32_t bits = (short_id >> axis_bit) & 0x09249249;
+  bits = (bits ^ (bits >> 2)) & 0x030c30c3;
+  bits = (bits ^ (bits >> 4)) & 0x0300f00f;
+  bits = (bits ^ (bits >> 8)) & 0xff0000ff;
+  bits = (bits ^ (bits >> 16)) & 0x000003ff;
+  return bits;
+}
+
+
+// The number of octal digits in a short id of the root node file, which
+// is marked with a 1 bit in front of its digits.
+inline unsigned rootFileDepth(ShortId short_id)
+{
+  unsigned bits = 0;
+  for (ShortId id = short_id; id; id >>= 1)
+    bits++;
+  return (bits - 1) / 3;
+}
+
+
+// The short id in the parent file, of the node that has the given node
+// (in the "child"th child file) as child.  "subtree_width" is the number
+// of digits in the short ids of both files.
+inline ShortId parentFileShortId(ShortId short_id, uint8_t child, unsigned subtree_width)
+{
+  return (ShortId(child) << (3 * (subtree_width - 1))) | (short_id >> 3);
+}
+
+}
+
+#endif
@@ -0,0 +1,237 @@
+#ifndef MEGATREE_SHORT_ID_TABLE_H
+#define MEGATREE_SHORT_ID_TABLE_H
+
+#include <vector>
+#include <algorithm>
+#include <assert.h>
+#include <megatree/tree_common.h>
+#include <megatree/allocator.h>
+
+namespace megatree
+{
+
+// Lookup table keyed on ShortId that keeps its objects in contiguous
+// blocks instead of allocating each one separately.
+//
+// The objects live in fixed size blocks, filled in insertion order.
+// An open-addressing hash table (linear probing) maps each ShortId to
+// the index of its object.  Objects never move once they have been
+// inserted, so pointers returned by find() and insert() stay valid
+// until the table is cleared or destroyed.  Individual entries can not
+// be erased.  The blocks of all tables with the same object type come
+// from one slab allocator, so filling and clearing tables (as node files
+// get loaded and evicted) recycles blocks instead of going to the heap.
+template <class T, unsigned BLOCK_SIZE = 16>
+class ShortIdTable
+{
+  struct Block
+  {
+    T objects[BLOCK_SIZE];
+    ShortId ids[BLOCK_SIZE];
+  };
+
+  struct Slot
+  {
+    ShortId id;
+    uint32_t index;
+  };
+
+  static const uint32_t EMPTY_SLOT = 0xffffffff;
+  static const unsigned MIN_SLOTS = 8;
+  static const unsigned BLOCKS_PER_CHUNK = 256;
+
+public:
+  typedef std::pair<ShortId, T*> Entry;
+
+  class Iterator
+  {
+  public:
+    Iterator(const ShortIdTable<T, BLOCK_SIZE>* _table)
+      : table(_table), index(0) {}
+
+    void next() { index++; }
+    bool finished() const { return index >= table->num_objects; }
+    ShortId id() const { return table->blocks[index / BLOCK_SIZE]->ids[index % BLOCK_SIZE]; }
+    T* get() const { return &table->blocks[index / BLOCK_SIZE]->objects[index % BLOCK_SIZE]; }
+
+  private:
+    const ShortIdTable<T, BLOCK_SIZE>* table;
+    size_t index;
+  };
+  friend class Iterator;
+
+
+  ShortIdTable()
+    : num_objects(0), slot_bits(0)
+  {}
+
+  ~ShortIdTable()
+  {
+    clear();
+  }
+
+  // Returns the object with the given id, or NULL if it is not in the table.
+  T* find(ShortId id) const
+  {
+    if (slots.empty())
+      return NULL;
+
+    for (size_t s = hash(id); ; s = (s + 1) & (slots.size() - 1))
+    {
+      const Slot& slot = slots[s];
+      if (slot.index == EMPTY_SLOT)
+        return NULL;
+      if (slot.id == id)
+        return object(slot.index);
+    }
+  }
+
+  // Returns the object with the given id, adding a default constructed
+  // object to the table if the id was not in the table yet.
+  T* insert(ShortId id)
+  {
+    if ((num_objects + 1) * 10 > slots.size() * 7)
+      rehash(std::max<size_t>(MIN_SLOTS, slots.size() * 2));
+
+    size_t s = hash(id);
+    for (; slots[s].index != EMPTY_SLOT; s = (s + 1) & (slots.size() - 1))
+    {
+      if (slots[s].id == id)
+        return object(slots[s].index);
+    }
+
+    // Grabs the next free spot in the blocks
+    if (num_objects == blocks.size() * BLOCK_SIZE)
+      blocks.push_back(blockAllocator().allocate());
+    Block* block = blocks[num_objects / BLOCK_SIZE];
+    T* obj = &block->objects[num_objects % BLOCK_SIZE];
+    *obj = T();
+    block->ids[num_objects % BLOCK_SIZE] = id;
+
+    slots[s].id = id;
+    slots[s].index = num_objects;
+    num_objects++;
+    return obj;
+  }
+
+  // Prepares the table for holding n objects without growing.
+  void reserve(size_t n)
+  {
+    size_t num_slots = MIN_SLOTS;
+    while (n * 10 > num_slots * 7)
+      num_slots *= 2;
+    if (num_slots > slots.size())
+      rehash(num_slots);
+
+    blocks.reserve((n + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    while (blocks.size() * BLOCK_SIZE < n)
+      blocks.push_back(blockAllocator().allocate());
+  }
+
+  // Frees all the blocks at once
+  void clear()
+  {
+    blockAllocator().deallocateMany(blocks);
+    slots.clear();
+    num_objects = 0;
+    slot_bits = 0;
+  }
+
+  size_t size() const
+  {
+    return num_objects;
+  }
+
+  bool empty() const
+  {
+    return num_objects == 0;
+  }
+
+  // The number of bytes taken by the blocks and the hash table of this table.
+  size_t memoryUsage() const
+  {
+    return blocks.size() * sizeof(Block) + blocks.capacity() * sizeof(Block*) + slots.capacity() * sizeof(Slot);
+  }
+
+  // The number of bytes taken by the blocks of all tables of this type.
+  static size_t blockFootprint()
+  {
+    return blockAllocator().footprint();
+  }
+
+  // Iterates over the objects in insertion order, which walks the blocks front to back.
+  Iterator iterate() const
+  {
+    return Iterator(this);
+  }
+
+  // Fills "entries" with all objects, sorted on their ShortId.
+  void getSorted(std::vector<Entry>& entries) const
+  {
+    entries.clear();
+    entries.reserve(num_objects);
+    for (Iterator it = iterate(); !it.finished(); it.next())
+      entries.push_back(Entry(it.id(), it.get()));
+    std::sort(entries.begin(), entries.end(), compareEntries);
+  }
+
+private:
+  // Not copyable: the blocks are owned by the table.
+  ShortIdTable(const ShortIdTable&);
+  ShortIdTable& operator=(const ShortIdTable&);
+
+  // Never destructed, as tables may still be cleared during static destruction.
+  static Allocator<Block>& blockAllocator()
+  {
+    static Allocator<Block>* allocator = new Allocator<Block>(BLOCKS_PER_CHUNK);
+    return *allocator;
+  }
+
+  static bool compareEntries(const Entry& a, const Entry& b)
+  {
+    return a.first < b.first;
+  }
+
+  // Fibonacci hashing onto a power of two number of slots.
+  size_t hash(ShortId id) const
+  {
+    return (uint32_t)(id * 2654435769u) >> (32 - slot_bits);
+  }
+
+  T* object(uint32_t index) const
+  {
+    return &blocks[index / BLOCK_SIZE]->objects[index % BLOCK_SIZE];
+  }
+
+  void rehash(size_t num_slots)
+  {
+    slot_bits = 0;
+    while ((size_t(1) << slot_bits) < num_slots)
+      slot_bits++;
+
+    Slot empty_slot;
+    empty_slot.id = 0;
+    empty_slot.index = EMPTY_SLOT;
+    slots.assign(size_t(1) << slot_bits, empty_slot);
+
+    // The blocks hold the ids as well, so the slots are rebuilt from them.
+    for (uint32_t i = 0; i < num_objects; i++)
+    {
+      ShortId id = blocks[i / BLOCK_SIZE]->ids[i % BLOCK_SIZE];
+      size_t s = hash(id);
+      while (slots[s].index != EMPTY_SLOT)
+        s = (s + 1) & (slots.size() - 1);
+      slots[s].id = id;
+      slots[s].index = i;
+    }
+  }
+
+  std::vector<Block*> blocks;
+  std::vector<Slot> slots;
+  size_t num_objects;
+  unsigned slot_bits;
+};
+
+}
+
+#endif
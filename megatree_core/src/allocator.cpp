@@ -0,0 +1,121 @@
+#include <megatree/allocator.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <stdint.h>
+#include <sys/mman.h>
+
+namespace megatree
+{
+
+static HugePageMode huge_page_mode = NO_HUGE_PAGES;
+static bool warned_explicit = false;
+
+
+void setHugePageMode(HugePageMode mode)
+{
+  huge_page_mode = mode;
+}
+
+
+HugePageMode getHugePageMode()
+{
+  return huge_page_mode;
+}
+
+
+HugePageMode parseHugePageMode(const std::string& name)
+{
+  if (name == "off")
+    return NO_HUGE_PAGES;
+  if (name == "transparent")
+    return TRANSPARENT_HUGE_PAGES;
+  if (name == "explicit")
+    return EXPLICIT_HUGE_PAGES;
+  fprintf(stderr, "Unknown huge page mode '%s'\n", name.c_str());
+  abort();
+}
+
+
+std::string hugePageModeName(HugePageMode mode)
+{
+  switch (mode)
+  {
+  case NO_HUGE_PAGES: return "off";
+  case TRANSPARENT_HUGE_PAGES: return "transparent";
+  case EXPLICIT_HUGE_PAGES: return "explicit";
+  }
+  fprintf(stderr, "Unknown huge page mode %d\n", (int)mode);
+  abort();
+}
+
+
+// Maps "bytes" bytes starting on a huge page boundary, and asks for
+// transparent huge pages.  mmap only aligns to normal pages, so this maps
+// an extra huge page and unmaps what sticks out on both sides.
+static void* mapTransparentHugePages(size_t bytes)
+{
+  void* mem = mmap(NULL, bytes + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    return NULL;
+
+  uintptr_t start = (uintptr_t)mem;
+  uintptr_t aligned = (start + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+  if (aligned > start)
+    munmap(mem, aligned - start);
+  if (start + HUGE_PAGE_SIZE > aligned)
+    munmap((void*)(aligned + bytes), start + HUGE_PAGE_SIZE - aligned);
+
+#ifdef MADV_HUGEPAGE
+  // Without transparent huge page support this fails, and the chunk
+  // simply uses normal pages.
+  madvise((void*)aligned, bytes, MADV_HUGEPAGE);
+#endif
+  return (void*)aligned;
+}
+
+
+void* allocateChunk(size_t& bytes, bool& mapped)
+{
+  HugePageMode mode = huge_page_mode;
+  if (mode != NO_HUGE_PAGES)
+  {
+    size_t huge_bytes = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    void* mem = NULL;
+    if (mode == EXPLICIT_HUGE_PAGES)
+    {
+#ifdef MAP_HUGETLB
+      mem = mmap(NULL, huge_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (mem == MAP_FAILED)
+        mem = NULL;
+#endif
+      if (!mem && !warned_explicit)
+      {
+        warned_explicit = true;
+        fprintf(stderr, "No explicit huge pages available, falling back to transparent huge pages\n");
+      }
+    }
+    if (!mem)
+      mem = mapTransparentHugePages(huge_bytes);
+    if (mem)
+    {
+      bytes = huge_bytes;
+      mapped = true;
+      return mem;
+    }
+  }
+
+  mapped = false;
+  return operator new(bytes);
+}
+
+
+void freeChunk(void* chunk, size_t bytes, bool mapped)
+{
+  if (mapped)
+    munmap(chunk, bytes);
+  else
+    operator delete(chunk);
+}
+
+}
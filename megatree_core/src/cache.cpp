@@ -0,0 +1,34 @@
+#include <megatree/cache.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+namespace megatree
+{
+
+CachePolicy parseCachePolicy(const std::string& name)
+{
+  if (name == "lru")
+    return LRU_CACHE_POLICY;
+  if (name == "clock")
+    return CLOCK_CACHE_POLICY;
+  if (name == "2q")
+    return TWO_QUEUE_CACHE_POLICY;
+  fprintf(stderr, "Unknown cache policy '%s'\n", name.c_str());
+  abort();
+}
+
+
+std::string cachePolicyName(CachePolicy policy)
+{
+  switch (policy)
+  {
+  case LRU_CACHE_POLICY: return "lru";
+  case CLOCK_CACHE_POLICY: return "clock";
+  case TWO_QUEUE_CACHE_POLICY: return "2q";
+  }
+  fprintf(stderr, "Unknown cache policy %d\n", (int)policy);
+  abort();
+}
+
+}
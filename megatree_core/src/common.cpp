@@ -2,31 +2,31 @@
 
 namespace megatree {
 
-int parseNumberSuffixed(const char* s)
+int64_t parseNumberSuffixed(const char* s)
 {
   char *end;
-  float f = strtod(s, &end);
+  double f = strtod(s, &end);
   switch (end[0]) {
   case '\0':
     break;
   case 'k':
   case 'K':
-    f *= 1e3f;
+    f *= 1e3;
   break;
   case 'm':
   case 'M':
-    f *= 1e6f;
+    f *= 1e6;
   break;
   case 'g':
   case 'G':
-    f *= 1e9f;
+    f *= 1e9;
   break;
   default:
     fprintf(stderr, "Weird suffix (%s) on number: %s\n", end, s);
     break;
   }
 
-  return (int)f;
+  return (int64_t)f;
 }
 
 }
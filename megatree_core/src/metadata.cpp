@@ -28,6 +28,8 @@ namespace megatree
       ("tree_center_y", boost::program_options::value<double>(), "The center of the tree, y-coordinate")
       ("tree_center_z", boost::program_options::value<double>(), "The center of the tree, z-coordinate")
       ("tree_size",     boost::program_options::value<double>(), "The size of the tree")
+      ("compression",   boost::program_options::value<std::string>(), "The codec the node files are compressed with")
+      ("node_layout",   boost::program_options::value<std::string>(), "The layout of the node files")
       ("default_camera_center_x",     boost::program_options::value<double>(), "The camera center, x-coordinate")
       ("default_camera_center_y",     boost::program_options::value<double>(), "The camera center, y-coordinate")
       ("default_camera_center_z",     boost::program_options::value<double>(), "The camera center, z-coordinate")
@@ -57,6 +59,8 @@ namespace megatree
     root_center[2] = vm["tree_center_z"].as<double>();
     subtree_width = vm["subtree_width"].as<unsigned>();
     subfolder_depth = vm["subfolder_depth"].as<unsigned>();
+    compression = vm.count("compression") ? vm["compression"].as<std::string>() : std::string("none");
+    node_layout = vm.count("node_layout") ? vm["node_layout"].as<std::string>() : std::string("compact");
   }
 
 
@@ -71,6 +75,10 @@ namespace megatree
     output << "tree_center_y = " << root_center[1] << std::endl;
     output << "tree_center_z = " << root_center[2] << std::endl;
     output << "tree_size = " << root_size << std::endl;
+    if (compression != "none")
+      output << "compression = " << compression << std::endl;
+    if (node_layout != "compact")
+      output << "node_layout = " << node_layout << std::endl;
 
     data.resize(output.str().size());
     memcpy(&data[0], &output.str()[0], data.size());
@@ -0,0 +1,629 @@
+#include <megatree/node_file_format.h>
+#include <megatree/short_id.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+
+namespace megatree
+{
+
+// The trie positions of a node file, level by level.  Every level is sorted.
+typedef std::vector<std::vector<ShortId> > TrieLevels;
+
+// Point and color of a trie position, in the fixed point frame of its cell
+struct TrieValue
+{
+  int32_t v[6];  // x, y, z, r, g, b
+  double weight;
+};
+
+static const int32_t POINT_MAX = 65535;
+
+
+static void buildTrieLevels(const std::vector<ShortId>& short_ids, unsigned depth, bool root_file, TrieLevels& levels)
+{
+  levels.clear();
+  if (root_file)
+  {
+    assert(!short_ids.empty() && short_ids[0] == 1);
+    for (size_t i = 0; i < short_ids.size(); i++)
+    {
+      unsigned d = rootFileDepth(short_ids[i]);
+      if (d >= levels.size())
+        levels.resize(d + 1);
+      levels[d].push_back(short_ids[i]);
+    }
+  }
+  else
+  {
+    assert(depth > 0 && depth < 11);
+    levels.resize(depth + 1);
+    levels[depth] = short_ids;
+    for (int d = depth - 1; d >= 0; d--)
+    {
+      for (size_t i = 0; i < levels[d + 1].size(); i++)
+      {
+        ShortId parent = levels[d + 1][i] >> 3;
+        if (levels[d].empty() || parent != levels[d].back())
+          levels[d].push_back(parent);
+      }
+    }
+
+    // The top of the trie is always there, even for an empty file.
+    if (levels[0].empty())
+      levels[0].push_back(0);
+    assert(levels[0].size() == 1 && levels[0][0] == 0);
+  }
+}
+
+
+// Writes the trie masks of the positions in "parents", given the
+// positions one level deeper.  Both lists must be sorted.  Returns false
+// if a child position has no parent.
+static bool encodeMasks(const std::vector<ShortId>& parents, const std::vector<ShortId>& children, ByteVec& buffer)
+{
+  size_t j = 0;
+  for (size_t i = 0; i < parents.size(); i++)
+  {
+    uint8_t mask = 0;
+    for (; j < children.size() && (children[j] >> 3) == parents[i]; j++)
+      mask |= 1 << (children[j] & 7);
+    buffer.push_back(mask);
+  }
+  return j == children.size();
+}
+
+
+static void encodeTrieMasks(const TrieLevels& levels, ByteVec& buffer)
+{
+  for (size_t d = 0; d + 1 < levels.size(); d++)
+  {
+    if (!encodeMasks(levels[d], levels[d + 1], buffer))
+    {
+      fprintf(stderr, "Node file has nodes at depth %zu without a parent\n", d + 1);
+      abort();
+    }
+  }
+}
+
+
+static void encodeTrie(const TrieLevels& levels, uint8_t flags, ByteVec& buffer)
+{
+  buffer.push_back(levels.size() - 1);
+  buffer.push_back(flags);
+  encodeTrieMasks(levels, buffer);
+}
+
+
+// Returns the offset after the trie, or 0 if the trie is cut off.
+static size_t decodeTrie(const uint8_t* data, size_t size, TrieLevels& levels)
+{
+  if (size < (size_t)V12_HEADER_SIZE)
+    return 0;
+  unsigned depth = data[1];
+  bool root_file = data[2] & NODE_FILE_ROOT;
+  size_t offset = (data[2] & NODE_FILE_INDEXED) ? INDEXED_HEADER_SIZE : V12_HEADER_SIZE;
+
+  levels.resize(depth + 1);
+  levels[0].assign(1, root_file ? 1 : 0);
+  for (unsigned d = 0; d < depth; d++)
+  {
+    levels[d + 1].clear();
+    for (size_t i = 0; i < levels[d].size(); i++)
+    {
+      if (offset >= size)
+        return 0;
+      uint8_t mask = data[offset++];
+      for (unsigned c = 0; c < 8; c++)
+        if (mask & (1 << c))
+          levels[d + 1].push_back((levels[d][i] << 3) | c);
+    }
+  }
+  return offset;
+}
+
+
+// Number of records in a trie, and their short ids
+static void trieRecords(const TrieLevels& levels, bool root_file, std::vector<ShortId>& short_ids)
+{
+  if (root_file)
+  {
+    short_ids.clear();
+    for (size_t d = 0; d < levels.size(); d++)
+      short_ids.insert(short_ids.end(), levels[d].begin(), levels[d].end());
+  }
+  else
+    short_ids = levels.back();
+}
+
+
+// Which children a trie position has, given the index of its first child
+static uint8_t siblingMask(const std::vector<ShortId>& level, size_t first)
+{
+  uint8_t mask = 0;
+  for (size_t i = first; i < level.size() && (level[i] >> 3) == (level[first] >> 3); i++)
+    mask |= 1 << (level[i] & 7);
+  return mask;
+}
+
+
+// Predicts the values of a trie position from its parent.  Along an
+// axis where the parent only has children on one side, the parent's
+// point is moved into the child's cell, like Node::copyToChildNode.
+// Along an axis with children on both sides, the parent's point is
+// somewhere in between them, and tells little about the child.
+static void predict(const TrieValue* parent, uint8_t siblings, ShortId short_id, int32_t prediction[6])
+{
+  if (!parent)
+  {
+    prediction[0] = prediction[1] = prediction[2] = (POINT_MAX + 1) / 2;
+    prediction[3] = prediction[4] = prediction[5] = 128;
+    return;
+  }
+
+  unsigned child = short_id & 7;
+  const unsigned axis_bits[3] = {X_BIT, Y_BIT, Z_BIT};
+  for (unsigned i = 0; i < 3; i++)
+  {
+    // the children with the same bit as this child along the axis
+    uint8_t same_side = 0;
+    for (unsigned c = 0; c < 8; c++)
+      if (((c >> axis_bits[i]) & 1) == ((child >> axis_bits[i]) & 1))
+        same_side |= 1 << c;
+
+    if (siblings & ~same_side)
+      prediction[i] = (POINT_MAX + 1) / 2;
+    else
+    {
+      int32_t p = 2 * parent->v[i] - ((child >> axis_bits[i]) & 1) * (POINT_MAX + 1);
+      prediction[i] = p < 0 ? 0 : (p > POINT_MAX ? POINT_MAX : p);
+    }
+  }
+  for (unsigned i = 3; i < 6; i++)
+    prediction[i] = parent->v[i];
+}
+
+
+static void recordToValue(const NodeRecord& record, TrieValue& value)
+{
+  for (unsigned i = 0; i < 3; i++)
+  {
+    value.v[i] = record.point[i];
+    value.v[3 + i] = record.color[i];
+  }
+  value.weight = record.count;
+}
+
+
+static void valueToRecord(const TrieValue& value, NodeRecord& record)
+{
+  for (unsigned i = 0; i < 3; i++)
+  {
+    record.point[i] = value.v[i];
+    record.color[i] = value.v[3 + i];
+  }
+}
+
+
+// Averages the children of each position in "parents", like Node::copyFromChildNodes.
+static void averageChildren(const std::vector<ShortId>& parents, const std::vector<ShortId>& children,
+                            const std::vector<TrieValue>& child_values, std::vector<TrieValue>& values)
+{
+  values.resize(parents.size());
+  size_t j = 0;
+  for (size_t i = 0; i < parents.size(); i++)
+  {
+    double sum[6] = {0, 0, 0, 0, 0, 0};
+    double weight = 0;
+    for (; j < children.size() && (children[j] >> 3) == parents[i]; j++)
+    {
+      const TrieValue& child = child_values[j];
+      unsigned c = children[j] & 7;
+      int bits[3] = {int((c >> X_BIT) & 1), int((c >> Y_BIT) & 1), int((c >> Z_BIT) & 1)};
+      double w = child.weight > 0 ? child.weight : 1;
+      for (unsigned k = 0; k < 3; k++)
+        sum[k] += w * (child.v[k] + bits[k] * (POINT_MAX + 1)) / 2.0;
+      for (unsigned k = 3; k < 6; k++)
+        sum[k] += w * child.v[k];
+      weight += w;
+    }
+    TrieValue& value = values[i];
+    for (unsigned k = 0; k < 6; k++)
+      value.v[k] = weight > 0 ? (int32_t)(sum[k] / weight) : 0;
+    value.weight = weight;
+  }
+}
+
+
+// Writes the residuals of all trie positions.
+static void encodeResiduals(const TrieLevels& levels, const std::vector<std::vector<TrieValue> >& values, ByteVec& buffer)
+{
+  size_t num_positions = 0;
+  for (size_t d = 0; d < levels.size(); d++)
+    num_positions += levels[d].size();
+  size_t offset = buffer.size();
+  buffer.resize(offset + num_positions * 6 * 3);
+
+  for (size_t d = 0; d < levels.size(); d++)
+  {
+    size_t p = 0;
+    uint8_t siblings = 0;
+    for (size_t i = 0; i < levels[d].size(); i++)
+    {
+      const TrieValue* parent = NULL;
+      if (d > 0)
+      {
+        if (i == 0 || (levels[d][i] >> 3) != (levels[d][i - 1] >> 3))
+        {
+          while (levels[d - 1][p] != (levels[d][i] >> 3))
+            p++;
+          siblings = siblingMask(levels[d], i);
+        }
+        parent = &values[d - 1][p];
+      }
+
+      int32_t prediction[6];
+      predict(parent, siblings, levels[d][i], prediction);
+      for (unsigned k = 0; k < 6; k++)
+      {
+        int32_t residual = values[d][i].v[k] - prediction[k];
+        writeVarint(((uint32_t)residual << 1) ^ (uint32_t)(residual >> 31), &buffer[0], offset);
+      }
+    }
+  }
+  buffer.resize(offset);
+}
+
+
+// Reads the residuals of all trie positions, and fills in the points and
+// colors of the records.  Returns false if the data is cut off.
+static bool decodeResiduals(const uint8_t* data, size_t size, size_t& offset, const TrieLevels& levels,
+                            bool root_file, std::vector<NodeRecord>& records)
+{
+  std::vector<TrieValue> values, parent_values;
+  size_t r = 0;
+  for (size_t d = 0; d < levels.size(); d++)
+  {
+    values.resize(levels[d].size());
+    size_t p = 0;
+    uint8_t siblings = 0;
+    for (size_t i = 0; i < levels[d].size(); i++)
+    {
+      const TrieValue* parent = NULL;
+      if (d > 0)
+      {
+        if (i == 0 || (levels[d][i] >> 3) != (levels[d][i - 1] >> 3))
+        {
+          while (levels[d - 1][p] != (levels[d][i] >> 3))
+            p++;
+          siblings = siblingMask(levels[d], i);
+        }
+        parent = &parent_values[p];
+      }
+
+      int32_t prediction[6];
+      predict(parent, siblings, levels[d][i], prediction);
+      for (unsigned k = 0; k < 6; k++)
+      {
+        if (offset >= size)
+          return false;
+        uint32_t zigzag = readVarint(data, size, offset);
+        int32_t residual = (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+        values[i].v[k] = prediction[k] + residual;
+      }
+
+      if (root_file || d + 1 == levels.size())
+        valueToRecord(values[i], records[r++]);
+    }
+    parent_values.swap(values);
+  }
+  assert(r == records.size());
+  return true;
+}
+
+
+// The number of bytes needed for the largest count
+static unsigned countSize(const std::vector<NodeRecord>& records)
+{
+  Count max_count = 0;
+  for (size_t i = 0; i < records.size(); i++)
+    max_count = std::max(max_count, records[i].count);
+
+  unsigned count_size = 1;
+  while (count_size < COUNT_SIZE && (max_count >> (8 * count_size)))
+    count_size *= 2;
+  return count_size;
+}
+
+
+static void encodeIndexedNodeFile(uint8_t child_files, bool root_file, const TrieLevels& levels,
+                                  const std::vector<NodeRecord>& records, ByteVec& buffer)
+{
+  uint32_t num_masks = 0;
+  for (size_t d = 0; d + 1 < levels.size(); d++)
+    num_masks += levels[d].size();
+  unsigned count_size = countSize(records);
+
+  buffer.clear();
+  buffer.push_back(child_files);
+  buffer.push_back(levels.size() - 1);
+  buffer.push_back(NODE_FILE_INDEXED | (root_file ? NODE_FILE_ROOT : 0));
+  buffer.push_back(count_size);
+  buffer.resize(INDEXED_HEADER_SIZE);
+  memcpy(&buffer[4], &num_masks, 4);
+  encodeTrieMasks(levels, buffer);
+  assert(buffer.size() == INDEXED_HEADER_SIZE + num_masks);
+
+  // The number of set bits before every 8 masks
+  size_t offset = buffer.size();
+  buffer.resize(offset + (num_masks / 8 + 1) * 4 + records.size() * (V12_FIXED_RECORD_SIZE + count_size));
+  uint32_t rank = 0;
+  for (size_t m = 0; m <= num_masks; m++)
+  {
+    if (m % 8 == 0)
+    {
+      memcpy(&buffer[offset], &rank, 4);
+      offset += 4;
+    }
+    if (m < num_masks)
+      rank += __builtin_popcount(buffer[INDEXED_HEADER_SIZE + m]);
+  }
+
+  for (size_t i = 0; i < records.size(); i++)
+  {
+    memcpy(&buffer[offset], (char *)records[i].point, POINT_SIZE);
+    offset += POINT_SIZE;
+    memcpy(&buffer[offset], (char *)records[i].color, COLOR_SIZE);
+    offset += COLOR_SIZE;
+    buffer[offset++] = records[i].children;
+    memcpy(&buffer[offset], (char *)&records[i].count, count_size);
+    offset += count_size;
+  }
+  assert(offset == buffer.size());
+}
+
+
+void encodeNodeFile(uint8_t child_files, unsigned depth, bool root_file,
+                    const std::vector<ShortId>& short_ids, const std::vector<NodeRecord>& records,
+                    ByteVec& buffer, NodeLayout layout)
+{
+  assert(short_ids.size() == records.size());
+  TrieLevels levels;
+  buildTrieLevels(short_ids, depth, root_file, levels);
+  if (layout == INDEXED_NODE_LAYOUT)
+  {
+    encodeIndexedNodeFile(child_files, root_file, levels, records, buffer);
+    return;
+  }
+
+  // Determines the values of all trie positions.  In the root file all
+  // positions are records, elsewhere only the deepest ones are.
+  std::vector<std::vector<TrieValue> > values(levels.size());
+  size_t r = 0;
+  for (size_t d = 0; d < levels.size(); d++)
+  {
+    if (!root_file && d + 1 < levels.size())
+      continue;
+    values[d].resize(levels[d].size());
+    for (size_t i = 0; i < levels[d].size(); i++, r++)
+      recordToValue(records[r], values[d][i]);
+  }
+  assert(r == records.size());
+  if (!root_file)
+    for (int d = levels.size() - 2; d >= 0; d--)
+      averageChildren(levels[d], levels[d + 1], values[d + 1], values[d]);
+
+  // Residuals are only used if they're smaller than the points and colors themselves.
+  ByteVec residuals;
+  encodeResiduals(levels, values, residuals);
+  bool use_residuals = residuals.size() < records.size() * (POINT_SIZE + COLOR_SIZE);
+
+  buffer.clear();
+  buffer.push_back(child_files);
+  encodeTrie(levels, (root_file ? NODE_FILE_ROOT : 0) | (use_residuals ? NODE_FILE_RESIDUALS : 0), buffer);
+  if (use_residuals)
+    buffer.insert(buffer.end(), residuals.begin(), residuals.end());
+
+  size_t offset = buffer.size();
+  buffer.resize(offset + records.size() * (V12_FIXED_RECORD_SIZE + MAX_VARINT_SIZE));
+  for (size_t i = 0; i < records.size(); i++)
+  {
+    const NodeRecord& record = records[i];
+    if (!use_residuals)
+    {
+      memcpy(&buffer[offset], (char *)record.point, POINT_SIZE);
+      offset += POINT_SIZE;
+      memcpy(&buffer[offset], (char *)record.color, COLOR_SIZE);
+      offset += COLOR_SIZE;
+    }
+    buffer[offset++] = record.children;
+    writeVarint(record.count, &buffer[0], offset);
+  }
+  buffer.resize(offset);
+}
+
+
+bool decodeNodeFile(const uint8_t* data, size_t size, uint8_t& child_files,
+                    std::vector<ShortId>& short_ids, std::vector<NodeRecord>& records)
+{
+  TrieLevels levels;
+  size_t offset = decodeTrie(data, size, levels);
+  if (offset == 0)
+    return false;
+  child_files = data[0];
+  bool root_file = data[2] & NODE_FILE_ROOT;
+  bool use_residuals = data[2] & NODE_FILE_RESIDUALS;
+
+  trieRecords(levels, root_file, short_ids);
+  records.resize(short_ids.size());
+  if (data[2] & NODE_FILE_INDEXED)
+  {
+    IndexedNodeFileReader reader;
+    if (!reader.open(data, size) || reader.numRecords() != records.size())
+      return false;
+    for (size_t i = 0; i < records.size(); i++)
+      reader.read(i, records[i]);
+    return true;
+  }
+  if (use_residuals && !decodeResiduals(data, size, offset, levels, root_file, records))
+    return false;
+
+  for (size_t i = 0; i < records.size(); i++)
+  {
+    NodeRecord& record = records[i];
+    if (!use_residuals)
+    {
+      if (offset + POINT_SIZE + COLOR_SIZE > size)
+        return false;
+      memcpy((char *)record.point, &data[offset], POINT_SIZE);
+      offset += POINT_SIZE;
+      memcpy((char *)record.color, &data[offset], COLOR_SIZE);
+      offset += COLOR_SIZE;
+    }
+    if (offset + CHILDREN_SIZE >= size)
+      return false;
+    record.children = data[offset++];
+    record.count = readVarint(data, size, offset);
+  }
+  return offset == size;
+}
+
+
+void encodeShortIds(const std::vector<ShortId>& short_ids, unsigned depth, bool root_file, ByteVec& buffer)
+{
+  TrieLevels levels;
+  buildTrieLevels(short_ids, depth, root_file, levels);
+  encodeTrie(levels, root_file ? NODE_FILE_ROOT : 0, buffer);
+}
+
+
+size_t decodeShortIds(const uint8_t* data, size_t size, std::vector<ShortId>& short_ids)
+{
+  TrieLevels levels;
+  size_t offset = decodeTrie(data, size, levels);
+  if (offset == 0)
+    return 0;
+  trieRecords(levels, data[2] & NODE_FILE_ROOT, short_ids);
+  return offset;
+}
+
+
+
+NodeLayout parseNodeLayout(const std::string& name)
+{
+  if (name == "compact")
+    return COMPACT_NODE_LAYOUT;
+  if (name == "indexed")
+    return INDEXED_NODE_LAYOUT;
+  fprintf(stderr, "Unknown node layout '%s'\n", name.c_str());
+  abort();
+}
+
+
+std::string nodeLayoutName(NodeLayout layout)
+{
+  switch (layout)
+  {
+  case COMPACT_NODE_LAYOUT: return "compact";
+  case INDEXED_NODE_LAYOUT: return "indexed";
+  }
+  fprintf(stderr, "Unknown node layout %d\n", (int)layout);
+  abort();
+}
+
+
+IndexedNodeFileReader::IndexedNodeFileReader()
+  : masks(NULL), directory(NULL), records(NULL),
+    num_masks(0), num_records(0), record_size(0), depth(0), count_size(0), root_file(false)
+{}
+
+
+bool IndexedNodeFileReader::open(const uint8_t* data, size_t size)
+{
+  if (size < (size_t)INDEXED_HEADER_SIZE || !(data[2] & NODE_FILE_INDEXED))
+    return false;
+  depth = data[1];
+  root_file = data[2] & NODE_FILE_ROOT;
+  count_size = data[3];
+  uint32_t n;
+  memcpy(&n, &data[4], 4);
+  num_masks = n;
+  if (count_size < 1 || count_size > COUNT_SIZE)
+    return false;
+
+  masks = &data[INDEXED_HEADER_SIZE];
+  directory = masks + num_masks;
+  records = directory + (num_masks / 8 + 1) * 4;
+  record_size = V12_FIXED_RECORD_SIZE + count_size;
+  if (records > data + size)
+    return false;
+
+  // The file holds a position for every set bit, plus the top of the trie.
+  size_t num_positions = 1 + rank(8 * num_masks);
+  if (root_file)
+    num_records = num_positions;
+  else if (num_positions >= num_masks)
+    num_records = num_positions - num_masks;
+  else
+    return false;
+  return records + num_records * record_size == data + size;
+}
+
+
+uint32_t IndexedNodeFileReader::rank(size_t bit) const
+{
+  size_t block = bit / 64;
+  uint32_t res;
+  memcpy(&res, &directory[block * 4], 4);
+
+  // counts the whole masks in this block, and the bits before "bit" in the last one
+  size_t mask = bit / 8;
+  for (size_t m = block * 8; m < mask; m++)
+    res += __builtin_popcount(masks[m]);
+  if (bit % 8)
+    res += __builtin_popcount(masks[mask] & ((1 << (bit % 8)) - 1));
+  return res;
+}
+
+
+bool IndexedNodeFileReader::find(ShortId short_id, size_t& index) const
+{
+  unsigned levels = depth;
+  if (root_file)
+  {
+    levels = rootFileDepth(short_id);
+    if (levels > depth)
+      return false;
+  }
+  else if (short_id >> (3 * depth))
+    return false;
+
+  // Walks down the trie, one octal digit at a time.
+  size_t j = 0;
+  for (int level = levels - 1; level >= 0; level--)
+  {
+    unsigned c = (short_id >> (3 * level)) & 7;
+    if (j >= num_masks || !(masks[j] & (1 << c)))
+      return false;
+    j = 1 + rank(8 * j + c);
+  }
+
+  index = root_file ? j : j - num_masks;
+  return index < num_records;
+}
+
+
+void IndexedNodeFileReader::read(size_t index, NodeRecord& record) const
+{
+  assert(index < num_records);
+  const uint8_t* data = records + index * record_size;
+  memcpy((char *)record.point, data, POINT_SIZE);
+  memcpy((char *)record.color, data + POINT_SIZE, COLOR_SIZE);
+  record.children = data[POINT_SIZE + COLOR_SIZE];
+  record.count = 0;
+  memcpy((char *)&record.count, data + V12_FIXED_RECORD_SIZE, count_size);
+}
+
+}
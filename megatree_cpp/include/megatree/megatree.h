@@ -11,6 +11,8 @@
 #include <boost/filesystem.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/condition.hpp>
 
 #include "megatree/allocator.h"
 #include "megatree/node_handle.h"
@@ -18,27 +20,72 @@
 #include "megatree/list.h"
 #include "megatree/function_caller.h"
 #include <megatree/storage.h>
+#include <megatree/shared_cache.h>
 #include <fstream>
+#include <tr1/unordered_map>
 #include <tr1/unordered_set>
 #include <megatree/blocking_queue.h>
 #include <megatree/std_singleton_allocator.h>
 
 namespace megatree
 {
-  const unsigned version = 11;
-  const unsigned int CACHE_SIZE = 1000000;
+  // Version of newly created trees.  Trees of OLDEST_READABLE_VERSION
+  // and newer can still be read and written, in their own version.
+  const unsigned version = 12;
+  const unsigned OLDEST_READABLE_VERSION = 11;
+  const uint64_t CACHE_SIZE = 256 * 1024 * 1024;  // Memory budget of the cache, in bytes
+  const unsigned FILE_CACHE_SHARDS = 16;  // Independently locked partitions of the file cache
+  const unsigned CHECKPOINT_WRITES = 16;  // Files a checkpoint writes at the same time
+  const unsigned WORKING_SET_BATCH = 64;  // Node files a warm restart loads at a time
+  const unsigned PINNED_LEVELS = 2;  // Levels of node files that never get evicted: the root file and its children
+  // Fractions of the cache budget.  The eviction thread starts above the
+  // high watermark and evicts down to the low one.  Threads that add
+  // files only wait for it above the budget itself.
+  const float EVICTION_HIGH_WATERMARK = 0.95;
+  const float EVICTION_LOW_WATERMARK = 0.85;
   const float MIN_CELL_SIZE = 0.001; // 1 mm default accuray
 
+  // Memory used by the cache of a tree, in bytes.
+  struct CacheStats
+  {
+    uint64_t node_bytes;  // Node files: their node tables, and the buffers of lazily loaded files
+    uint64_t entry_bytes;  // Bookkeeping of the node files in the cache
+    uint64_t write_bytes;  // Serialized node files that are being written to storage
+    uint64_t evicting_bytes;  // Node files that get freed once they are written
+    uint64_t budget;
+    unsigned num_files, num_nodes;
+    unsigned num_pinned_files;  // Files on the pinned levels, included in num_files
+
+    uint64_t total() const { return node_bytes + entry_bytes + write_bytes; }
+  };
+
   // Tree
   class MegaTree
   {
   public:
-    // Loads the tree from disk, grabbing parameters from the metadata
-    MegaTree(boost::shared_ptr<Storage> storage, unsigned cache_size, bool read_only);
-
+    // Loads the tree from disk, grabbing parameters from the metadata.
+    // "cache_size" is the memory budget of the cache in bytes, and
+    // "cache_policy" picks the node files it evicts (see cache.h).  The
+    // node files on the top "pinned_levels" levels of the tree stay in
+    // the cache once they are loaded.  If a working set was saved, the
+    // node files in it get loaded in the background.
+    MegaTree(boost::shared_ptr<Storage> storage, uint64_t cache_size, bool read_only,
+             CachePolicy cache_policy=LRU_CACHE_POLICY, unsigned pinned_levels=PINNED_LEVELS);
+
+    // Loads the tree from disk, with its node files in a cache that it
+    // shares with other trees (see shared_cache.h).  The share of the
+    // budget the tree is entitled to goes with its "cache_weight".
+    MegaTree(boost::shared_ptr<Storage> storage, boost::shared_ptr<SharedCache> shared_cache, bool read_only,
+             double cache_weight=1.0, CachePolicy cache_policy=LRU_CACHE_POLICY, unsigned pinned_levels=PINNED_LEVELS);
+
+    // Creates a new tree.  "compression" names the codec for the node
+    // files (see compress.h), or is "none".  "node_layout" is "compact"
+    // or "indexed" (see node_file_format.h).
     MegaTree(boost::shared_ptr<Storage> storage, const std::vector<double>& cell_center, const double& cell_size,
 	     unsigned subtree_width, unsigned subfolder_depth,
-	     unsigned cache_size=CACHE_SIZE, double _min_cell_size=MIN_CELL_SIZE);
+	     uint64_t cache_size=CACHE_SIZE, double _min_cell_size=MIN_CELL_SIZE,
+	     const std::string& compression="none", const std::string& node_layout="compact",
+	     CachePolicy cache_policy=LRU_CACHE_POLICY, unsigned pinned_levels=PINNED_LEVELS);
 
     ~MegaTree();
 
@@ -60,6 +107,66 @@ namespace megatree
     // cache functions
     void flushCache();
 
+    // Writes the node files that are modified now in the background,
+    // while the tree keeps changing: flushCache() without stopping the
+    // inserts.  The files get serialized a few at a time as they are
+    // written, except for the files that get used before they are
+    // written, which are serialized right away.  Once the checkpoint
+    // has landed, storage holds every change that was made before
+    // checkpoint() was called (changes to nodes that are in use while
+    // it is called may or may not make it), and possibly newer versions
+    // of some files that got evicted since.  Returns the number of the
+    // checkpoint, which is passed on to "callback" once it landed.  One
+    // checkpoint runs at a time, a new one waits for the last one to land.
+    typedef boost::function<void(unsigned checkpoint)> CheckpointCallback;
+    unsigned checkpoint(const CheckpointCallback& callback = CheckpointCallback());
+
+    // Whether a checkpoint has landed, and waits for it to land.  A
+    // checkpoint lands after its callback returned.
+    bool checkpointLanded(unsigned checkpoint);
+    void waitForCheckpoint(unsigned checkpoint);
+
+    // Starts loading node files in the background, so they are in the
+    // cache by the time they are read.  Files that are cached already
+    // are left alone.  Nothing is prefetched while the cache is over the
+    // high watermark.
+    void prefetch(const std::vector<IdType>& file_ids);
+
+    // Prefetches the node files that a range query from "lo" to "hi" at
+    // "resolution" reads.  Which child files a node file has is only
+    // known once it is loaded, so the child files of every file are
+    // prefetched as it comes in, one batch per file.
+    void prefetch(const std::vector<double>& lo, const std::vector<double>& hi, double resolution);
+
+    // Waits until the prefetches are done, and the node files that are
+    // loading are loaded.
+    void waitForPrefetches();
+
+    // With automatic prefetching, ChildIterator prefetches the files of
+    // the grandchildren of the node it expands.
+    void setAutoPrefetch(bool _auto_prefetch) { auto_prefetch = _auto_prefetch; }
+
+    // Saves the ids of the node files in the cache to storage, so the
+    // next tree that opens the storage starts with them: first the
+    // pinned files, then the others in the order the cache would evict
+    // them last.  Modified files are left out, they may not be in
+    // storage yet.  Read-only trees save their working set too, it is
+    // not part of the tree.
+    void saveWorkingSet();
+
+    // Whether the destructor saves the working set, after it flushed the cache.
+    void setSaveWorkingSet(bool _save_working_set) { save_working_set = _save_working_set; }
+
+    // Where the memory of the cache goes.  Eviction keeps the total
+    // within the budget, not counting the files that are being evicted.
+    // With a shared cache, the budget is what the tree may use right now.
+    CacheStats getCacheStats();
+
+    // Brings the cache under its high watermark: waits until the eviction
+    // thread is done with the evictions the cache needs, and the files it
+    // evicted or wrote back are written.
+    void waitForEviction();
+
     // Slow.  For careful debugging only.  Prints out which files still have nodes in use.
     void dumpNodesInUse();
 
@@ -69,6 +176,10 @@ namespace megatree
       count_hit = count_miss = count_file_write = count_nodes_read = 0;
     }
 
+    // Node files found in the cache, and node files loaded from storage
+    unsigned getHitCount() { return count_hit; }
+    unsigned getMissCount() { return count_miss; }
+
     // Get the total number of points in this tree
     unsigned long getNumPoints()
     {
@@ -82,13 +193,14 @@ namespace megatree
     // Create a string with some statistics about this tree (read/write/cache_miss/...)
     std::string toString()
       {
+        CacheStats stats = getCacheStats();
 	std::stringstream s;
 	s << "Num nodes " << getNumPoints() << ", hit count " << count_hit << ", miss count " << count_miss  
 	  << ", write count " << count_file_write << ", total nodes read " << count_nodes_read 
-	  << ", nodes being written " << current_write_size
-          << ", nodes per file " << (int)((float)current_cache_size / (float)file_cache.size())
-	  << ", total cache usage " << (int)((float)current_cache_size / (float)max_cache_size * 100.0) << "%"
-          << ", open files " << file_cache.size();
+	  << ", bytes being written " << stats.write_bytes
+          << ", nodes per file " << (int)((float)stats.num_nodes / (float)stats.num_files)
+	  << ", total cache usage " << (int)((float)stats.total() / (float)stats.budget * 100.0) << "%"
+          << ", open files " << stats.num_files << " (" << stats.num_pinned_files << " pinned)";
 	return s.str();
       }
 
@@ -119,22 +231,69 @@ namespace megatree
 
 
   private:
-    unsigned cacheSize() const { return current_cache_size; }
+    friend class SharedCache;
+
+    // One partition of the file cache.  Node files are spread over the
+    // shards on the hash of their id.  Each shard has its own lock,
+    // eviction order and node counts, so threads working on files in different
+    // shards don't wait for each other.
+    //
+    // The memory of a file is counted in its shard as the file reports
+    // changes through NodeFile::takeCacheDelta(), so the shard always
+    // holds the sum of what its files accounted for.
+    //
+    // Files on the pinned levels are kept apart from the cache, so they
+    // are never evicted and hits on them don't touch the cache policy.
+    typedef std::tr1::unordered_map<IdType, NodeFile*> PinnedFiles;
+    struct FileCacheShard
+    {
+      FileCacheShard(): cache_bytes(0), evicting_bytes(0), write_bytes(0), cache_size(0) {}
+
+      boost::mutex mutex;
+      Cache<IdType, NodeFile> file_cache;
+      PinnedFiles pinned_files;
+      uint64_t cache_bytes;  // Memory of the files in this shard.
+      uint64_t evicting_bytes;  // Memory of the files that get deleted once they are written.
+      uint64_t write_bytes;  // Serialized files of this shard being written.
+      unsigned cache_size;  // Number of nodes in the files of this shard.
+    };
+
+    FileCacheShard& fileCacheShard(const IdType& file_id);
+
+    // Adds the change in memory of a file to its shard.  Don't hold the
+    // lock of the shard.
+    void accountNodeFile(FileCacheShard& shard, int64_t bytes, int nodes);
+
+    // Runs the callbacks that waited for a file to get loaded.  The
+    // caller added a user to the file, which gets removed here.
+    void fileLoaded(NodeFile* node_file);
 
     // callback after getAsync on storage finishes
-    void readNodeFileCb(NodeFile* node_file, const ByteVec& buffer);
+    void readNodeFileCb(FileCacheShard* shard, NodeFile* node_file, const ByteVec& buffer);
+    void readNodeFileBufferCb(FileCacheShard* shard, NodeFile* node_file, const ByteBufferPtr& buffer);
+
+    // Counts the reads of node files from storage, which the destructor
+    // waits for.  A read is done once its callback no longer uses the tree.
+    void startReads(unsigned num_reads);
+    void finishRead();
 
     // callback after putAsync on storage finishes when evicting node files
-    void evictNodeFileCb(CacheIterator<IdType, NodeFile> it);
+    void evictNodeFileCb(FileCacheShard* shard, CacheIterator<IdType, NodeFile> it, uint64_t evicting_bytes, uint64_t write_bytes,
+                         unsigned generation);
 
     // callback after putAsync on storage finishes when flushing node files to disk
-    void flushNodeFileCb(CacheIterator<IdType, NodeFile> it, boost::mutex& mutex, boost::condition& condition, unsigned& remaining);
+    void flushNodeFileCb(FileCacheShard* shard, NodeFile* node_file, uint64_t write_bytes, unsigned generation,
+                         boost::mutex& mutex, boost::condition& condition, unsigned& remaining);
 
     void createRoot(NodeHandle &root);
 
+    // Reads the metadata of an existing tree, and initializes it
+    void openTree(uint64_t cache_size, CachePolicy cache_policy, unsigned pinned_levels);
+
     void initTree(boost::shared_ptr<Storage> storage, const std::vector<double>& _cell_center, const double& _cell_size,
 		  unsigned _subtree_width, unsigned _subfolder_depth,
-		  unsigned _cache_size, double _min_cell_size);
+		  uint64_t _cache_size, CachePolicy _cache_policy, unsigned _pinned_levels,
+		  double _min_cell_size);
 
 
     // NodeFile methods
@@ -143,7 +302,97 @@ namespace megatree
     NodeFile* getNodeFile(const IdType& file_id);
     void releaseNodeFile(NodeFile*& node_file);
 
-    void cacheMaintenance();
+    // Reads a node of a file that is in use, and accounts for the nodes
+    // that get decoded.  Read-only trees read loaded files without
+    // locking them, into the local node of the handle if need be.
+    Node* readFileNode(NodeFile* file, const IdType& node_id, NodeHandle& handle);
+
+    // Gets many files in use at once, like getNodeFile().  The files that
+    // are not in the cache are loaded in one batch.  Looking up files
+    // for a prefetch doesn't count as a hit.
+    void getNodeFiles(const std::vector<IdType>& file_ids, std::vector<NodeFile*>& files, bool prefetching);
+
+    // Returns the file in use if it is in the cache, or NULL.  Lock the shard before calling.
+    NodeFile* findCachedFile(FileCacheShard& shard, const IdType& file_id, bool prefetching=false);
+    // Returns a file that was found in the cache.  Lock the shard before calling.
+    NodeFile* useCachedFile(FileCacheShard& shard, CacheIterator<IdType, NodeFile>& it, bool prefetching=false);
+    // Adds a new file to the cache, or to the pinned files.  Lock the shard before calling.
+    void addCachedFile(FileCacheShard& shard, const IdType& file_id, NodeFile* file);
+
+    // Wakes up the eviction thread above the high watermark.  Above the
+    // budget, drops clean files right away, and waits for the eviction
+    // thread for the rest if "may_block".
+    void cacheMaintenance(bool may_block);
+    uint64_t usedCacheBytes();
+
+    // What the cache may use, given that it uses "used_bytes": the
+    // budget of the tree, or its part of a shared cache.  With
+    // "evict_others", the shared cache wakes up the eviction threads of
+    // other trees that are over their part, so don't hold background_mutex.
+    uint64_t cacheBudget(uint64_t used_bytes, bool evict_others=false);
+
+    // Wakes up the eviction thread, for a shared cache that is over
+    // the budget of this tree.
+    void requestEviction();
+
+    int64_t evictBytes(int64_t bytes_to_evict, bool clean_only);
+    int64_t evictFromShard(FileCacheShard& shard, int64_t bytes_to_evict, bool clean_only);
+
+    // Evicts down to the low watermark when woken up, and writes the
+    // modified files that are up for eviction next, so they can be
+    // dropped without waiting for storage.
+    void evictionThread();
+    void writeBack(int64_t bytes_to_scan);
+    void writeBackShard(FileCacheShard& shard, int64_t bytes_to_scan);
+    void writeBackNodeFileCb(FileCacheShard* shard, NodeFile* node_file, uint64_t write_bytes, unsigned generation);
+
+    // A write that an eviction, the eviction thread or a flush started is done.
+    // A checkpoint waits for the writes of the generation before it, the
+    // destructor for all of them.
+    void finishWrite(unsigned generation);
+
+    // Serializes a file of the running checkpoint and starts writing
+    // it, unless that happened already.  Returns false if it did.
+    bool writeCheckpointFile(const IdType& file_id, NodeFile* node_file);
+    // Writes the next file from the queue of the running checkpoint
+    void writeNextCheckpointFile();
+    void checkpointFileCb(FileCacheShard* shard, NodeFile* node_file, uint64_t write_bytes);
+    // Lands the running checkpoint, once all of its writes are done
+    void checkCheckpoint();
+
+    // The part of the tree a prefetch covers
+    struct PrefetchRegion
+    {
+      double mid[3], size[3];
+      double resolution;
+    };
+
+    // Prefetches the child files of a file in the region, once the file
+    // is loaded.  Removes the user of the file that the caller added.
+    void prefetchRegionCb(const IdType& file_id, NodeFile* node_file, const PrefetchRegion& region);
+    void prefetchRegionFiles(const std::vector<IdType>& file_ids, const PrefetchRegion& region);
+    void prefetchGrandchildFiles(const NodeHandle& parent, NodeHandle* children);
+
+    // The node files of a saved working set, which a warm restart loads
+    // a batch at a time, until they are all loaded or the cache is over
+    // the high watermark.  Counts as a prefetch in flight.
+    struct WorkingSet
+    {
+      WorkingSet(): next(0), loading(0) {}
+
+      std::vector<IdType> file_ids;
+      size_t next;  // First file of the next batch
+      unsigned loading;  // Files of the batch that are not loaded yet.  Protected by background_mutex.
+    };
+
+    void warmCache();
+    void readWorkingSetCb(const ByteVec& data);
+    void warmWorkingSet(boost::shared_ptr<WorkingSet> working_set);
+    // A file of the batch is loaded.  Removes the user of the file that the caller added.
+    void workingSetFileCb(NodeFile* node_file, boost::shared_ptr<WorkingSet> working_set);
+    // Returns true for the last file of the batch
+    bool finishWorkingSetFile(boost::shared_ptr<WorkingSet> working_set);
+    NodeGeometry getNodeGeometry(const IdType& node_id);
     void writeMetaData();
 
     bool checkEqualRecursive(MegaTree& tree1, MegaTree& tree2, NodeHandle& node1, NodeHandle& node2);
@@ -153,18 +402,56 @@ namespace megatree
     boost::shared_ptr<Storage> storage;
     
     // cache properties
-    boost::mutex file_cache_mutex;
-    Cache<IdType, NodeFile> file_cache;  // front is most recenty used
-    unsigned current_cache_size;  // Number of nodes currently in the cache.
-    unsigned current_write_size;  // Number of nodes currently being written.
+    FileCacheShard file_cache_shards[FILE_CACHE_SHARDS];
+    boost::mutex eviction_mutex;  // Only one thread evicts at a time
+    unsigned eviction_shard;  // Shard where the next eviction starts.  Protected by eviction_mutex.
+
+    // The eviction thread, and what it shares with the threads that wait
+    // for it.  Protected by background_mutex.
+    boost::thread eviction_thread;
+    boost::mutex background_mutex;
+    boost::condition eviction_wakeup, eviction_done;
+    bool eviction_requested;
+    bool eviction_running;
+    bool eviction_stuck;  // The last eviction didn't get below the budget
+    bool stop_eviction;
+    unsigned checkpoints_started, checkpoints_landed;
+    bool checkpoint_scanning;  // The running checkpoint is still picking its files
+    bool checkpoint_landing;  // The callback of the running checkpoint runs
+    int checkpoint_files;  // Files of the running checkpoint that are not written yet
+    unsigned checkpoint_writes;  // Checkpoint writes whose callback didn't return yet
+    std::vector<std::pair<IdType, NodeFile*> > checkpoint_queue;  // Files it still has to serialize
+    CheckpointCallback checkpoint_callback;
+    unsigned checkpoint_generation;  // Generation of the writes the running checkpoint waits for
+    boost::condition checkpoint_done;
+    unsigned reads_in_flight;
+    boost::condition read_done;
+    unsigned prefetches_in_flight;  // Region prefetches waiting for a file
+    boost::condition prefetch_done;
+    bool auto_prefetch;
+    bool save_working_set;
+    bool stop_warm_up;  // The tree is destructed, loading the working set stops
+
+    // Writes of evictions, of the eviction thread and of flushes count
+    // against the generation they started in.  The generation only changes while
+    // all shards are locked, and the counts are atomic.
+    unsigned write_generation;
+    volatile unsigned writes_in_flight[2];
+    boost::condition write_done;  // Notified under background_mutex as a write finishes
 
     // tree properties
     double min_cell_size;  // Minimum edge length of a cell in this tree
     NodeGeometry root_geometry;
-    unsigned max_cache_size, subtree_width, subfolder_depth;
-    boost::shared_ptr<Allocator<Node> > node_allocator;
+    uint64_t max_cache_size;  // Memory budget of the cache, in bytes
+    boost::shared_ptr<SharedCache> shared_cache;  // Budget shared with other trees, or NULL
+    unsigned pinned_levels;  // Node files with ids on a lower level are pinned
+    unsigned subtree_width, subfolder_depth;
+    unsigned tree_version;  // Version of the node files of this tree
+    std::string compression;  // Codec of the node files of this tree
+    NodeLayout node_layout;  // Layout of the version 12 node files of this tree
     StdSingletonAllocatorInstance<std::_Rb_tree_node<std::pair<const ShortId, Node*> > >* singleton_allocator;
-    // Counters that track tree statistics.
+    // Counters that track tree statistics.  Threads count them under
+    // different locks, so they are added to atomically.
     unsigned count_hit, count_miss, count_file_write, count_nodes_read;
 
     bool read_only;
@@ -186,19 +473,42 @@ namespace megatree
           children_file->waitUntilLoaded();
         }
       
-        // get all children
+        // get all children.  Loaded files of read-only trees are read
+        // without locking them, the others get locked.  The state of a
+        // file doesn't change while it is locked.
+        bool shared = tree.read_only && children_file->getNodeState() == LOADED;
+        boost::mutex::scoped_lock lock(children_file->mutex, boost::defer_lock);
+        if (!shared)
+        {
+          lock.lock();
+          shared = tree.read_only && children_file->getNodeState() == LOADED;
+        }
         for (unsigned int i=0; i<8; i++)
         {
           if (parent.hasChild(i))
           {
             IdType child_id = parent.getId().getChild(i);
             NodeGeometry child_geometry = parent.getNodeGeometry().getChild(i);
-            Node* child_node = children_file->readNode(tree.getShortId(child_id));
+            Node* child_node = shared ?
+              children_file->readNodeShared(tree.getShortId(child_id), children[i].localNode()) :
+              children_file->readNode(tree.getShortId(child_id));
             children[i].initialize(child_node, child_id, children_file, child_geometry);
           }
         }
+        if (!shared)
+        {
+          int64_t bytes;
+          int nodes;
+          children_file->takeCacheDelta(bytes, nodes);
+          lock.unlock();
+          tree.accountNodeFile(tree.fileCacheShard(tree.getFileId(parent.getId().getChild(0))), bytes, nodes);
+        }
+        else if (lock.owns_lock())
+          lock.unlock();
         if (!_children_file)
           children_file->removeUser();
+        if (tree.auto_prefetch)
+          tree.prefetchGrandchildFiles(parent, children);
       
         // get first child
         next();
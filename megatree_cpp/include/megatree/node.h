@@ -19,6 +19,18 @@ class NodeFile;
   static const uint64_t BITS_2 = 32768;
 
 
+// The exact sums behind the averages of a node with children, so the
+// node can follow a change in one child without reading the others.
+// The points are summed in the frame of the children, which has one
+// bit more than the frame of the node.
+struct NodeSums
+{
+  uint64_t point[3];
+  uint64_t color[3];
+  Count count;
+};
+
+
 // Node
 class Node
 {
@@ -68,11 +80,19 @@ public:
 
 
   void copyFromChildNodes(Node* child_nodes[8]) 
+  {
+    NodeSums sums;
+    copyFromChildNodes(child_nodes, sums);
+  }
+
+
+  // Also returns the sums behind the new averages.
+  void copyFromChildNodes(Node* child_nodes[8], NodeSums& sums)
   {
     children = 0;
-    count = 0;
-    uint64_t sum_point[3] = {0,0,0};
-    uint64_t sum_color[3] = {0,0,0};
+    sums.point[0] = sums.point[1] = sums.point[2] = 0;
+    sums.color[0] = sums.color[1] = sums.color[2] = 0;
+    sums.count = 0;
 
     for (unsigned int i = 0; i < 8; i++)
     {
@@ -81,38 +101,46 @@ public:
         children += (1 << i);
         //printf("using %s\n", child_nodes[i]->toString().c_str());
 
-        const Count& child_cnt = child_nodes[i]->count;
-        Point* child_pnt = child_nodes[i]->point;
-        Color* child_col = child_nodes[i]->color;
-        
-        uint64_t child_offset[3];
-        getChildBitOffset(i, child_offset);
+        // TODO: sum will overflow at some point.
+        addChildToSums(i, *child_nodes[i], sums);
+      }
+    }
+    copyFromSums(sums);
 
-        sum_point[0] += child_cnt * (child_pnt[0] + child_offset[0]);
-        sum_point[1] += child_cnt * (child_pnt[1] + child_offset[1]);
-        sum_point[2] += child_cnt * (child_pnt[2] + child_offset[2]);
+    //printf("result %s\n", toString().c_str());
+  }
 
-        sum_color[0] += child_cnt * child_col[0];
-        sum_color[1] += child_cnt * child_col[1];
-        sum_color[2] += child_cnt * child_col[2];
 
-        // TODO: sum will overflow at some point.
-        count += child_cnt;
-      }
+  // Follows a change of child "child" from "old_child" into
+  // "new_child", given the sums behind this node.  The result is the
+  // same as copyFromChildNodes() would give.
+  void updateChildNode(uint8_t child, const Node& old_child, const Node& new_child, NodeSums& sums)
+  {
+    // The sums wrap around while the old child is taken out, and back
+    // when the new child is added.
+    NodeSums old_sums = {{0,0,0}, {0,0,0}, 0};
+    addChildToSums(child, old_child, old_sums);
+    for (unsigned i = 0; i < 3; i++)
+    {
+      sums.point[i] -= old_sums.point[i];
+      sums.color[i] -= old_sums.color[i];
     }
+    sums.count -= old_sums.count;
 
-    //we need to shift back down because we go up a level higher than we store
-    //things to compute the average, getChildBitOffset holds the shifts that
-    //bump things up, perhaps that should change at some point
-    point[0] = (sum_point[0] / count) >> 1;
-    point[1] = (sum_point[1] / count) >> 1;
-    point[2] = (sum_point[2] / count) >> 1;
+    addChildToSums(child, new_child, sums);
+    setChild(child);
+    copyFromSums(sums);
+  }
 
-    color[0] = sum_color[0] / count;
-    color[1] = sum_color[1] / count;
-    color[2] = sum_color[2] / count;
 
-    //printf("result %s\n", toString().c_str());
+  // Whether "sums" are the sums behind the current averages
+  bool matchesSums(const NodeSums& sums) const
+  {
+    Node n;
+    n.copyFromSums(sums);
+    return sums.count == count &&
+           n.point[0] == point[0] && n.point[1] == point[1] && n.point[2] == point[2] &&
+           n.color[0] == color[0] && n.color[1] == color[1] && n.color[2] == color[2];
   }
 
 
@@ -243,7 +271,7 @@ public:
     return point[0] == n.point[0] &&
            point[1] == n.point[1] &&
            point[2] == n.point[2] &&
-           color[1] == n.color[0] &&
+           color[0] == n.color[0] &&
            color[1] == n.color[1] &&
            color[2] == n.color[2] &&
            count == n.count &&
@@ -276,6 +304,39 @@ private:
   uint8_t children;
 
 
+  void addChildToSums(uint8_t child, const Node& child_node, NodeSums& sums) const
+  {
+    uint64_t child_offset[3];
+    getChildBitOffset(child, child_offset);
+
+    const Count& child_cnt = child_node.count;
+    for (unsigned i = 0; i < 3; i++)
+    {
+      sums.point[i] += child_cnt * (child_node.point[i] + child_offset[i]);
+      sums.color[i] += child_cnt * child_node.color[i];
+    }
+    sums.count += child_cnt;
+  }
+
+  void copyFromSums(const NodeSums& sums)
+  {
+    count = sums.count;
+    if (count == 0)
+      return;
+
+    //we need to shift back down because we go up a level higher than we store
+    //things to compute the average, getChildBitOffset holds the shifts that
+    //bump things up, perhaps that should change at some point
+    point[0] = (sums.point[0] / count) >> 1;
+    point[1] = (sums.point[1] / count) >> 1;
+    point[2] = (sums.point[2] / count) >> 1;
+
+    color[0] = sums.color[0] / count;
+    color[1] = sums.color[1] / count;
+    color[2] = sums.color[2] / count;
+  }
+
+
   // Conversions between external floating point representation and
   // internal fixed precision representation.
   void float_to_fixed(const NodeGeometry &ng, const double pt_float[3], Point pt_fixed[3]) const
@@ -1,102 +1,22 @@
 #ifndef MEGATREE_NODE_FILE_H_
 #define MEGATREE_NODE_FILE_H_
 
-#include <megatree/std_singleton_allocator.h>
-#include <megatree/allocator.h>
 #include <megatree/node.h>
 #include <megatree/cache.h>
+#include <megatree/short_id_table.h>
+#include <megatree/node_file_format.h>
 #include <megatree/storage.h>  // for ByteVec typedef
 #include <megatree/tree_common.h>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/condition.hpp>
+#include <boost/function.hpp>
 #include <boost/filesystem.hpp>
-#include <pthread.h>
+#include <vector>
 
 
 namespace megatree
 {
 
-class SpinLock
-{
-  public:
-    SpinLock()
-    {
-      int ret = pthread_spin_init(&spinlock, 0);
-      assert(ret == 0);
-    }
-
-    void lock()
-    {
-      int ret = pthread_spin_lock(&spinlock);
-      assert(ret == 0);
-    }
-
-    void unlock()
-    {
-      int ret = pthread_spin_unlock(&spinlock);
-      assert(ret == 0);
-    }
-
-    ~SpinLock()
-    {
-      pthread_spin_destroy(&spinlock);
-    }
-
-  class ScopedLock
-  {
-    public:
-      ScopedLock(SpinLock& _spinlock): spinlock(_spinlock)
-      {
-        spinlock.lock();
-      }
-
-      ~ScopedLock()
-      {
-        spinlock.unlock();
-      }
-
-    private:
-      SpinLock& spinlock;
-
-  };
-
-  private:
-    pthread_spinlock_t spinlock;
-};
-
-
-class Cond
-{
-public:
-  Cond(): cond(false)
-  {
-  }
-
-  void wait(SpinLock& spinlock)
-  {
-    cond = false;
-    spinlock.unlock();
-    //TODO: There has just got to be a better way than having to write a custom
-    //while loop here. The pthread_cond stuff won't take a pthread_spinlock as
-    //input though and I cannot for the life of me figure out how to get the
-    //mutex that, I think, is contained within the pthread_spinlock... ugh
-    //swap this out for something better... please
-    while(!cond)
-      usleep(10);
-    spinlock.lock();
-  }
-
-  void notify_all()
-  {
-    cond = true;
-  }
-
-private:
-  bool cond;
-};
-
-
-
 enum NodeState
 {
   INVALID,
@@ -109,17 +29,22 @@ enum NodeState
 
 class NodeFile
 {
-  typedef Allocator<Node> NodeAllocator;
-  typedef Allocator<std::pair<ShortId, Node*> > PairAllocator;
-
 public:
-  NodeFile(const boost::filesystem::path& _path,
-           boost::shared_ptr<NodeAllocator> _node_allocator = boost::shared_ptr<NodeAllocator>(),
-           boost::shared_ptr<PairAllocator> _pair_allocator = boost::shared_ptr<PairAllocator>())
+  // The format version determines how the file is (de)serialized.
+  // Version 12 files need to know the subtree width of the tree, and
+  // whether they are the root node file.  The layout only determines
+  // how version 12 files are written, they can be read in any layout.
+  NodeFile(const boost::filesystem::path& _path, unsigned _format_version = 11,
+           unsigned _subtree_width = 0, bool _root_file = false,
+           NodeLayout _layout = COMPACT_NODE_LAYOUT)
   : node_state(LOADING), path(_path),
-    child_files(0),
-    node_allocator(_node_allocator), pair_allocator(_pair_allocator),
-    use_count(0) {}
+    format_version(_format_version), subtree_width(_subtree_width), root_file(_root_file),
+    layout(_layout), child_files(0), num_lazy_nodes(0),
+    use_count(0), checkpoint_pending(false), accounted_bytes(0), accounted_nodes(0)
+  {
+    assert(format_version == 11 || format_version == 12);
+    assert(format_version == 11 || root_file || subtree_width > 0);
+  }
 
   ~NodeFile();
 
@@ -129,6 +54,13 @@ public:
   // deserializes a ByteVec into the node file
   void deserialize(const ByteVec& buffer);
 
+  // Deserializes lazily from a buffer that is shared with the storage.
+  // The file keeps a reference to the buffer, and nodes are only decoded
+  // when readNode() asks for them.  All nodes get decoded as soon as the
+  // file itself gets modified.  Version 12 files are only loaded lazily
+  // in the indexed layout, the compact layout gets decoded right away.
+  void deserialize(const ByteBufferPtr& buffer);
+
   // serialized the node file into a ByteVec
   void serialize(ByteVec& buffer);
 
@@ -139,9 +71,25 @@ public:
   // Reads an existing node from the cache.  Must return this node with releaseNode()
   Node* readNode(const ShortId& short_id);
 
+  // Reads a node of a loaded file without locking the mutex, for trees
+  // that are opened read-only.  Such a file never changes once it is
+  // loaded: a node that isn't decoded yet gets decoded into "copy"
+  // instead of into the node cache.  So any number of threads can read
+  // the file at the same time.  Returns the node, or NULL if the file
+  // doesn't have it.  Must return this node with releaseNode() (or
+  // removeUser(), as it isn't modified).
+  Node* readNodeShared(const ShortId& short_id, Node& copy);
+
   // Creates a new node in this file.  Must return this node with releaseNode()
   Node* createNode(const ShortId& short_id);
 
+  // The sums behind the averages of a node, if they are known and still
+  // match the node.  Otherwise returns NULL.  The sums only live in
+  // memory, for the nodes whose summaries were updated since the file
+  // was loaded.  Lock the mutex before calling.
+  NodeSums* getNodeSums(const ShortId& short_id, const Node* node);
+  void setNodeSums(const ShortId& short_id, const NodeSums& sums);
+
   void initializeFromChildren(const boost::filesystem::path &_path,
       std::vector<boost::shared_ptr<NodeFile> >& children);
   void initializeRootNodeFile(const boost::filesystem::path &_path, NodeFile& child);
@@ -154,7 +102,8 @@ public:
     is_modified = false;
   }
 
-  // get the number of nodes that are currently in use.  Protected by mutex.
+  // get the number of nodes that are currently in use.  The count is
+  // atomic, but lock the mutex to keep it from changing.
   unsigned users() const
   {
     return use_count;
@@ -177,79 +126,148 @@ public:
     child_files &= ~(1 << child);
   }
 
-  // Protected by mutex.
+  // Atomic, so nodes of read-only files are used without the mutex.
+  // Adding the first user must happen under the lock of the cache shard
+  // though, which keeps the file from getting evicted.
   void addUser()
   {
-    use_count++;
+    __sync_fetch_and_add(&use_count, 1);
   }
 
-  // Protected by mutex.
   void removeUser()
   {
     assert(use_count > 0);
-    use_count--;
+    __sync_fetch_and_sub(&use_count, 1);
   }
 
   boost::filesystem::path getPath() const { return path; }
 
+  // A lazily loaded file counts all of its nodes, decoded or not, so
+  // the size stays the same as nodes get decoded.
   unsigned cacheSize() const
   {
-    return node_cache.size();
+    return lazy_buffer ? num_lazy_nodes : node_cache.size();
   }
 
+  // Bytes of memory taken by the file: the file itself, its node tables,
+  // and the buffer of a lazily loaded file.  Lock the mutex before calling.
+  size_t memoryUsage() const;
+
+  // How much the memory and the number of nodes of the file changed
+  // since the last call, for keeping track of the size of the cache.
+  // Lock the mutex before calling.
+  void takeCacheDelta(int64_t& bytes, int& nodes);
+
+  // What takeCacheDelta() accounted for so far.  Lock the mutex before calling.
+  size_t accountedBytes() const { return accounted_bytes; }
+  unsigned accountedNodes() const { return accounted_nodes; }
+
   bool isModified()
   {
     return is_modified;
   }
 
-  NodeState getNodeState()
+  // The file is part of a checkpoint, and still has to be serialized
+  // for it.  Set while all shards of the cache are locked, and cleared
+  // under the mutex.
+  bool checkpointPending() const { return checkpoint_pending; }
+  void setCheckpointPending(bool pending) { checkpoint_pending = pending; }
+
+  // Doesn't lock, as it gets called for every node that is read.  The
+  // state only changes under node_state_mutex, and a file that reads as
+  // LOADED has all of its nodes in place.
+  NodeState getNodeState() const
   {
-    SpinLock::ScopedLock lock(node_state_mutex);
-    return node_state;
+    NodeState state = node_state;
+    __sync_synchronize();
+    return state;
   }
 
   void setNodeState(NodeState state);
 
+  // Blocks until the file is loaded.
   void waitUntilLoaded();
 
+  // Runs the callback once the file is loaded, right away if it is
+  // loaded already.  Otherwise the callback runs from
+  // runLoadedCallbacks(), on the thread that loaded the file.  Keep a
+  // node of the file in use until the callback ran, so the file doesn't
+  // get evicted.
+  typedef boost::function<void()> LoadedCallback;
+  void whenLoaded(const LoadedCallback& callback);
+
+  // Runs the callbacks that were waiting for the file to get loaded.
+  // Call after the file got loaded, without holding the mutex, as the
+  // callbacks may read nodes from the file.
+  void runLoadedCallbacks();
+
   boost::mutex mutex;
 
 private:
 
-  SpinLock node_state_mutex;
-  //  boost::condition node_state_condition;
-  Cond node_state_condition;
-  NodeState node_state;
+  boost::mutex node_state_mutex;
+  boost::condition node_state_condition;
+  volatile NodeState node_state;
+  std::vector<LoadedCallback> loaded_callbacks;
+
+  // Sets the state to LOADED, and wakes up the threads waiting for it.
+  void setLoaded();
 
   boost::filesystem::path path;
 
+  unsigned format_version, subtree_width;
+  bool root_file;
+  NodeLayout layout;
+
   // Bitstring, indicating which child files exist.
   uint8_t child_files;
 
   // Lookup table, keyed on the node's short_id in the file.
   //
-  // The node cache used to be an std::tr1::unordered_map, but was
-  // switched to a map to get more deterministic memory usage.  The
-  // unordered_map was eating memory by allocating buckets and
-  // hashtable nodes (generally when createNode was called) and caused
-  // the overall memory usage of import_las to grow over time, until
-  // it used up all the machine's memory.  After changing to std::map,
-  // the memory usage now remains flat after the initial cache fill.
-  //
-  // The memory usage of std::map is much better, and the speed did
-  // not measurably change.
-  typedef std::map<ShortId, Node*> NodeCache;
-  //std::map<ShortId, Node*, std::less<ShortId>, StdSingletonAllocator <std::pair<const ShortId, Node*> > > node_cache;
-  std::map<ShortId, Node*, std::less<ShortId> > node_cache;
+  // The node cache used to be an std::map<ShortId, Node*> with every
+  // node allocated separately.  Walking the red-black tree and chasing
+  // the node pointers showed up prominently in readNode, serialize and
+  // deserialize, so the nodes now live in contiguous blocks owned by
+  // the table, indexed by an open-addressing hash.  The whole file is
+  // torn down by freeing a handful of blocks.
+  typedef ShortIdTable<Node> NodeCache;
+  NodeCache node_cache;
+
+  // Sums behind the averages of nodes in the node cache, see getNodeSums()
+  ShortIdTable<NodeSums> node_sums;
+
+  // Serialized nodes of a lazily loaded file, sorted on short id.  Only
+  // the nodes that have been read are in the node cache.  Version 12
+  // files are read through the index of the buffer.
+  ByteBufferPtr lazy_buffer;
+  IndexedNodeFileReader lazy_index;
+  unsigned num_lazy_nodes;
+
+  // Finds the offset of a serialized node in the lazy buffer (the record
+  // index for version 12).  Returns false if the node is not in the buffer.
+  bool findLazyNode(const ShortId& short_id, unsigned& offset) const;
+
+  // Decodes a node from the lazy buffer, at the offset findLazyNode() gave.
+  void decodeLazyNode(Node* node, unsigned offset) const;
+
+  // Decodes all remaining nodes from the lazy buffer, and drops the buffer.
+  void decodeAllLazyNodes();
+
+  // Version 12 (de)serialization of the whole file
+  void serializeV12(ByteVec& buffer);
+  void deserializeV12(const uint8_t* data, size_t size);
 
   static void serializeNode(const Node* node, const ShortId& short_id, ByteVec& buffer, unsigned& offset);
-  static void deserializeNode(Node* node, ShortId& short_id, const ByteVec& buffer, unsigned& offse);
+  static void deserializeNode(Node* node, ShortId& short_id, const uint8_t* buffer, unsigned& offset);
+  static void nodeToRecord(const Node* node, NodeRecord& record);
+  static void recordToNode(const NodeRecord& record, Node* node);
 
-  boost::shared_ptr<NodeAllocator> node_allocator;
-  boost::shared_ptr<PairAllocator> pair_allocator;
-
-  size_t use_count;
+  volatile size_t use_count;
   bool is_modified;
+  bool checkpoint_pending;
+
+  size_t accounted_bytes;
+  unsigned accounted_nodes;
 };
 
 }
@@ -16,6 +16,25 @@ public:
     : node(NULL), node_file(NULL), modified(false), new_family(false)
   {}
 
+  NodeHandle(const NodeHandle& nh)
+    : node(NULL)
+  {
+    *this = nh;
+  }
+
+  NodeHandle& operator=(const NodeHandle& nh)
+  {
+    // A node that was decoded into the other handle gets copied along
+    local_node = nh.local_node;
+    node = nh.node == &nh.local_node ? &local_node : nh.node;
+    node_geom = nh.node_geom;
+    id = nh.id;
+    node_file = nh.node_file;
+    modified = nh.modified;
+    new_family = nh.new_family;
+    return *this;
+  }
+
   ~NodeHandle()
   {
     if (node)
@@ -31,6 +50,13 @@ public:
     node_file = node_file_p;
     node_geom = node_geom_p;
   }
+
+  // Room for a node that is read from a read-only file without putting
+  // it in the node cache of the file (see NodeFile::readNodeShared).
+  Node& localNode()
+  {
+    return local_node;
+  }
   
 
   bool isValid() const
@@ -161,6 +187,27 @@ public:
     node->copyFromChildNodes(node_children);
   }
 
+  // Also returns the sums behind the new averages (see NodeSums).
+  void copyFromChildNodes(NodeHandle children[8], NodeSums& sums)
+  {
+    modified = true;
+
+    Node* node_children[8];
+    for (unsigned i=0; i<8; i++)
+      if (children[i].isValid())
+        node_children[i] = children[i].getNode();
+      else
+        node_children[i] = NULL;
+
+    node->copyFromChildNodes(node_children, sums);
+  }
+
+  void updateChildNode(uint8_t child, const Node& old_child, const Node& new_child, NodeSums& sums)
+  {
+    modified = true;
+    node->updateChildNode(child, old_child, new_child, sums);
+  }
+
   bool isNewFamily()
   {
     return new_family;
@@ -172,11 +219,20 @@ public:
     node_file->waitUntilLoaded();
   }
 
+  // Runs the callback once the node is loaded, instead of blocking.
+  // Keep the node until the callback ran.
+  void whenLoaded(const NodeFile::LoadedCallback& callback)
+  {
+    assert(node_file);
+    node_file->whenLoaded(callback);
+  }
+
   friend class NodeCache;
 
   
 private:
   Node* node;
+  Node local_node;
   NodeGeometry node_geom;
   IdType id;
   NodeFile* node_file;
@@ -0,0 +1,79 @@
+#ifndef MEGATREE_SHARED_CACHE_H
+#define MEGATREE_SHARED_CACHE_H
+
+#include <vector>
+#include <boost/cstdint.hpp>
+#include <boost/thread/mutex.hpp>
+
+
+namespace megatree
+{
+
+class MegaTree;
+
+// One memory budget for the caches of several trees, like the trees a
+// server or a viewer has open at the same time.  Every tree keeps its
+// own file cache, but they are sized against the budget of all trees
+// together, instead of each tree getting a fixed part of the memory:
+// while there is room, a busy tree grows into the memory that idle
+// trees don't use.  Once the trees together go over the budget, every
+// tree is entitled to a share in proportion to its weight, and the
+// trees that use more than their share give up files first.
+//
+// Trees attach to the cache when they are constructed with it, and
+// detach when they are destructed.  The cache must outlive the trees.
+class SharedCache
+{
+public:
+  SharedCache(uint64_t _budget)
+    : budget(_budget)
+  {}
+
+  uint64_t getBudget() const { return budget; }
+
+  // Memory use of one tree, as the tree last reported it.
+  struct TreeUsage
+  {
+    const MegaTree* tree;
+    double weight;
+    uint64_t used_bytes;
+    uint64_t budget;  // What the tree may use right now
+  };
+
+  // The trees attached to the cache, in the order they attached.
+  std::vector<TreeUsage> getUsage();
+
+  // Memory use of all trees together.
+  uint64_t usedBytes();
+
+private:
+  friend class MegaTree;
+
+  struct Member
+  {
+    MegaTree* tree;
+    double weight;
+    uint64_t used_bytes;
+  };
+
+  void attach(MegaTree* tree, double weight);
+  void detach(MegaTree* tree);
+
+  // Records how much memory "tree" uses, and returns how much it may
+  // use.  With "evict_others", asks the other trees that are over their
+  // budget to evict.  Only trees that grow do that, or the eviction
+  // threads of the trees would keep waking up each other.  Don't call
+  // while holding locks of a tree that other trees may take.
+  uint64_t treeBudget(MegaTree* tree, uint64_t used_bytes, bool evict_others);
+
+  // The budget of every member.  Lock the mutex before calling.
+  void computeBudgets(std::vector<uint64_t>& budgets) const;
+
+  uint64_t budget;
+  boost::mutex mutex;
+  std::vector<Member> members;
+};
+
+}
+
+#endif
@@ -3,6 +3,9 @@
 
 #include <vector>
 #include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition.hpp>
 
 #include "megatree/node.h"
 #include "megatree/megatree.h"
@@ -15,6 +18,31 @@ namespace megatree
 {
 void addPoint(MegaTree &tree, const std::vector<double> &pt, const std::vector<double>& color = std::vector<double>(3, 0));
 
+// Adds a batch of points.  "pts" holds x, y and z of every point one
+// after the other, and "colors" holds r, g and b the same way, or is
+// empty for black points.  The points are sorted in Morton order, and
+// the points that share a path share the descent down the tree, so
+// every node file on the way is fetched once per batch instead of once
+// per point.
+//
+// With several threads, the batch is split into the subtrees the points
+// fall in, and every thread adds the points of whole subtrees, so the
+// threads don't share nodes.  The summaries of the nodes above the
+// subtrees are updated at the end.
+//
+// The tree is the one that addPoint() gives for the points in the order
+// of sortMortonOrder(), for any number of threads.  Adding the points
+// in another order may give another tree: a point that a leaf passes
+// down gets rounded to its parent cell, and points closer than the
+// smallest cell are summed in the order they come in.
+void addPoints(MegaTree &tree, const std::vector<double>& pts, const std::vector<double>& colors,
+               unsigned num_threads = 1);
+
+// Sorts the indices of the points in "order" (into "pts", see
+// addPoints()) by the path of the points from the root, in Morton
+// order.  Points on the same path stay in the order they came in.
+void sortMortonOrder(const NodeGeometry& root, const std::vector<double>& pts, std::vector<size_t>& order);
+
 
 void queryRange(MegaTree &tree, const std::vector<double>& lo, const std::vector<double>&hi,
                 double resolution, std::vector<double> &results, std::vector<double> &colors);
@@ -30,9 +58,94 @@ bool nodeInsideRange(const NodeGeometry& node_geom, const double* range_mid, con
 bool nodeOutsideRange(const NodeGeometry& node_geom, const double* range_mid, const double* range_size);
 
 
+// Same as queryRange(), on an AsyncTraversal.  The points come in a
+// different order.
 void rangeQueryLoop(MegaTree& tree, std::vector<double> lo, std::vector<double> hi,
                     double resolution, std::vector<double>& results, std::vector<double>& colors);
 
+// Re-computes the summary of "node" after its child "child" changed from
+// "old_child" into "new_child".  Once the exact sums behind the node are
+// known (see NodeSums) this takes constant time, without reading the
+// other children.  "children_file" must be in use until this returns.
+void updateSummary(MegaTree& tree, NodeHandle& node, uint8_t child,
+                   const Node& old_child, const Node& new_child, NodeFile* children_file);
+
+
+
+
+// Walks the tree without waiting for the node files one at a time.
+// Nodes whose file is still loading are set aside, and go back to the
+// traversal from the load callback of their file, so the loads of all
+// the nodes the traversal reached are in flight at once.  Ready nodes
+// are visited depth first, on the thread that calls run().
+class AsyncTraversal
+{
+public:
+  // Visits a node, and returns true to visit its children too.  "state"
+  // starts as the state that the visit of the parent left behind, for
+  // visitors that keep track of something along the path from the root.
+  typedef boost::function<bool(NodeHandle& node, unsigned& state)> Visitor;
+
+  // At most "max_loading" nodes wait for their file at a time.
+  AsyncTraversal(MegaTree& tree, unsigned max_loading = 256);
+
+  // Visits the tree from the root.  Returns when all nodes that were
+  // asked for are visited.
+  void run(const Visitor& visitor, unsigned root_state = 0);
+
+private:
+  struct Task
+  {
+    NodeHandle* node;
+    unsigned state;
+  };
+
+  void expand(NodeHandle& node, unsigned state);
+  void nodeLoaded(const Task& task);
+
+  MegaTree& tree;
+  unsigned max_loading;
+
+  boost::mutex mutex;
+  boost::condition loaded;
+  std::vector<Task> ready;  // Protected by mutex
+  unsigned loading;  // Protected by mutex
+};
+
+
+
+
+// Collects points that come one at a time, and adds them to the tree
+// with addPoints() once there are "batch_size" of them.  The points
+// that are left are added by flush(), or when the inserter is
+// destructed.
+class BatchInserter
+{
+public:
+  static const size_t DEFAULT_BATCH_SIZE = 100000;
+
+  BatchInserter(MegaTree& _tree, size_t _batch_size = DEFAULT_BATCH_SIZE, unsigned _num_threads = 1)
+    : tree(_tree), batch_size(_batch_size), num_threads(_num_threads)
+  {
+    pts.reserve(3 * batch_size);
+    colors.reserve(3 * batch_size);
+  }
+
+  ~BatchInserter()
+  {
+    flush();
+  }
+
+  void addPoint(const std::vector<double>& pt, const std::vector<double>& color = std::vector<double>(3, 0));
+  void flush();
+
+private:
+  MegaTree& tree;
+  size_t batch_size;
+  unsigned num_threads;
+  std::vector<double> pts, colors;
+};
+
 
 
 
@@ -43,35 +156,19 @@ public:
     : nh(nh_p)
   {
     // copy value of original point
-    orig_cnt = nh->getCount();
-    Point* pnt = nh->getNode()->point;
-    Color* col = nh->getNode()->color;
-    for (unsigned i=0; i<3; i++){
-      orig_pnt[i] = pnt[i];
-      orig_col[i] = col[i];
-    }
+    orig = *nh->getNode();
   }
 
   NodeCache(const NodeCache& nc)
   {
     nh = nc.nh;
-    orig_cnt= nc.orig_cnt;
-    
-    for (unsigned i=0; i<3; i++){
-      orig_pnt[i] = nc.orig_pnt[i];
-      orig_col[i] = nc.orig_col[i];
-    }
+    orig = nc.orig;
   }
 
   NodeCache& operator =(const NodeCache& nc)
   {
     nh = nc.nh;
-    orig_cnt= nc.orig_cnt;
-    
-    for (unsigned i=0; i<3; i++){
-      orig_pnt[i] = nc.orig_pnt[i];
-      orig_col[i] = nc.orig_col[i];
-    }
+    orig = nc.orig;
     return *this;
   }
 
@@ -90,40 +187,17 @@ public:
   }
 
 
-  void mergeChild(const NodeCache& nc)
+  // Updates this node for the changes in the child since it was cached.
+  void mergeChild(MegaTree& tree, const NodeCache& nc)
   {
     assert(nc.nh);
     assert(nh);
-
-    // child offset
-    uint64_t child_offset[3];
-    nh->getNode()->getChildBitOffset(nc.nh->getId().getChildNr(), child_offset);
-
-    // compute difference between original child node and the  current child node
-    uint64_t child_cnt_curr = nc.nh->getCount();
-    uint64_t diff_sum_pnt[3], diff_sum_col[3];
-    uint64_t diff_cnt = child_cnt_curr-nc.orig_cnt;
-    for (unsigned i=0; i<3; i++){
-      diff_sum_pnt[i] = nc.nh->getNode()->point[i]*child_cnt_curr - nc.orig_pnt[i]*nc.orig_cnt + child_offset[i]*diff_cnt;
-      diff_sum_col[i] = nc.nh->getNode()->color[i]*child_cnt_curr - nc.orig_col[i]*nc.orig_cnt;
-    }    
-
-    // update point of this node
-    Point* pnt = nh->getNode()->point;
-    Color* col = nh->getNode()->color;
-    uint64_t& cnt = nh->getNode()->count;
-    for (unsigned i=0; i<3; i++){
-      pnt[i] = (pnt[i]*cnt + diff_sum_pnt[i]) / (cnt + diff_cnt);
-      col[i] = (col[i]*cnt + diff_sum_col[i]) / (cnt + diff_cnt);
-    }
-    cnt += diff_cnt;
+    updateSummary(tree, *nh, nc.nh->getId().getChildNr(), nc.orig, *nc.nh->getNode(), nc.nh->getNodeFile());
   }
 
 
   NodeHandle* nh;
-  uint64_t orig_pnt[3];
-  uint64_t orig_col[3];
-  uint64_t orig_cnt;
+  Node orig;
 };
 
 
@@ -174,7 +248,7 @@ private:
     NodeCache child = nodes.top();
     nodes.pop();
     if (!nodes.empty())
-      nodes.top().mergeChild(child);
+      nodes.top().mergeChild(tree, child);
 
     child.release(tree);  // after this, the child is written and destroyed
   }
@@ -2,6 +2,7 @@
 #include <unistd.h>
 #include <iostream>
 #include <vector>
+#include <boost/bind.hpp>
 
 #include <megatree/common.h>
 #include <megatree/megatree.h>
@@ -29,9 +30,6 @@ struct Analysis
   std::vector<unsigned long> count_distr;
   std::vector<unsigned long> tendril_length_distr;
 
-  // State variables for the current run.
-  unsigned long tendril_length;
-
   void dump()
   {
     printf("analysis:\n");
@@ -62,11 +60,16 @@ struct Analysis
   }
 };
 
-void analyze(MegaTree &tree, NodeHandle& node, Analysis& a, unsigned int depth=0)
+// Visits a node on an AsyncTraversal.  The state is the length of the
+// tendril that leads to the node.
+bool analyze(MegaTree* tree, Analysis* analysis, NodeHandle& node, unsigned& tendril_length)
 {
+  Analysis& a = *analysis;
+  unsigned int depth = node.getId().level() - 1;
+
   if (a.num_nodes % 100000L == 0) {
-    printf("At %5.1lfM: %s\n", double(a.num_nodes) / double(1000000), tree.toString().c_str());
-    tree.resetCount();
+    printf("At %5.1lfM: %s\n", double(a.num_nodes) / double(1000000), tree->toString().c_str());
+    tree->resetCount();
   }
   a.num_nodes++;
   if (node.isLeaf())
@@ -95,30 +98,27 @@ void analyze(MegaTree &tree, NodeHandle& node, Analysis& a, unsigned int depth=0
     ++a.count_distr[node.getCount()];
 
   // Updates tendril statistics.
-  if (node.isLeaf() && a.tendril_length > 0)
+  if (node.isLeaf() && tendril_length > 0)
   {
-    if (a.tendril_length >= a.tendril_length_distr.size())
+    if (tendril_length >= a.tendril_length_distr.size())
       ++a.tendril_length_distr.back();
     else
-      ++a.tendril_length_distr[a.tendril_length];
+      ++a.tendril_length_distr[tendril_length];
   }
   else if (node.getCount() == 1)
   {
     printf("node with count 1 that is not leaf\n");
-    ++a.tendril_length;
+    ++tendril_length;
   }
   else
-    a.tendril_length = 0;
+    tendril_length = 0;
 
   // Descend
-  for (MegaTree::ChildIterator it(tree, node); !it.finished(); it.next())
-  {
-    analyze(tree, it.getChildNode(), a, depth + 1);
-  }
+  return true;
 }
 
 struct arguments_t {
-  int cache_size;
+  uint64_t cache_size;
   char* tree;
 };
 
@@ -143,19 +143,19 @@ int main (int argc, char** argv)
 {
   // Default command line arguments
   struct arguments_t arguments;
-  arguments.cache_size = 3000000;
+  arguments.cache_size = 1024 * 1024 * 1024;
   arguments.tree = 0;
   
   // Parses command line options
   struct argp_option options[] = {
-    {"cache-size", 'c', "SIZE",   0,     "Cache size"},
+    {"cache-size", 'c', "SIZE",   0,     "Memory budget of the cache, in bytes"},
     {"tree",       't', "TREE",   0,     "Path to tree"},
     { 0 }
   };
   struct argp argp = { options, parse_opt };
   int parse_ok = argp_parse(&argp, argc, argv, 0, 0, &arguments);
   printf("Arguments parsed: %d\n", parse_ok);
-  printf("Cache size: %d\n", arguments.cache_size);
+  printf("Cache size: %llu bytes\n", (unsigned long long)arguments.cache_size);
   printf("Tree: %s\n", arguments.tree);
 
   if (!arguments.tree) {
@@ -168,11 +168,10 @@ int main (int argc, char** argv)
   MegaTree tree(storage, arguments.cache_size, true);
   Analysis analysis;
 
+  // Walks the tree with many node files loading at once
   Tictoc overall_timer;
-  NodeHandle root;
-  tree.getRoot(root);
-  analyze(tree, root, analysis);
-  tree.releaseNode(root);
+  AsyncTraversal traversal(tree);
+  traversal.run(boost::bind(&analyze, &tree, &analysis, _1, _2));
   float overall_time = overall_timer.toc();
 
   analysis.dump();
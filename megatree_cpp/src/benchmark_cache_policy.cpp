@@ -0,0 +1,144 @@
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include <megatree/common.h>
+#include <megatree/cache.h>
+#include <megatree/megatree.h>
+#include <megatree/storage_factory.h>
+#include <megatree/tree_functions.h>
+
+// Replays the same mix of interactive queries and full scans on a tree
+// with each cache policy.  The interactive queries look at parts of the
+// tree at a coarse resolution, like a viewer does, and keep coming back
+// to the upper levels of the tree.  Now and then a full scan at the
+// finest resolution (like analyze or an export) runs through the whole
+// tree.
+
+using namespace megatree;
+
+const unsigned QUERIES_PER_SCAN = 20;
+const double SCAN_RESOLUTION = 0.00001;
+
+
+struct PolicyResult
+{
+  unsigned interactive_hits, interactive_misses;
+  unsigned scan_hits, scan_misses;
+  double seconds;
+};
+
+
+static double secondsSince(const boost::posix_time::ptime& started)
+{
+  return (boost::posix_time::microsec_clock::universal_time() - started).total_microseconds() / 1e6;
+}
+
+
+static double hitRatio(unsigned hits, unsigned misses)
+{
+  return hits + misses == 0 ? 0.0 : 100.0 * hits / (hits + misses);
+}
+
+
+static PolicyResult benchmark(const char* tree_path, uint64_t cache_size, CachePolicy policy, unsigned num_scans)
+{
+  boost::shared_ptr<Storage> storage(openStorage(tree_path));
+  MegaTree tree(storage, cache_size, true, policy);
+  boost::posix_time::ptime started = boost::posix_time::microsec_clock::universal_time();
+
+  // Finds where the points are, from overviews of the whole tree that
+  // zoom in until the points are spread out
+  NodeGeometry root_geom(tree.getRootGeometry());
+  std::vector<double> lo(3), hi(3), results, colors;
+  for (unsigned k = 0; k < 3; k++)
+  {
+    lo[k] = root_geom.getLo(k);
+    hi[k] = root_geom.getHi(k);
+  }
+  std::vector<double> data_lo(3), data_hi(3);
+  double extent = 0, resolution = root_geom.getSize() / 1000;
+  for (unsigned zoom = 0; zoom < 10 && !(extent > 0 && resolution <= extent / 100); zoom++)
+  {
+    results.clear();
+    colors.clear();
+    queryRange(tree, lo, hi, resolution, results, colors);
+    if (results.empty())
+    {
+      fprintf(stderr, "The tree is empty\n");
+      exit(-1);
+    }
+    data_lo.assign(results.begin(), results.begin() + 3);
+    data_hi = data_lo;
+    for (size_t i = 0; i < results.size(); i++)
+    {
+      data_lo[i % 3] = std::min(data_lo[i % 3], results[i]);
+      data_hi[i % 3] = std::max(data_hi[i % 3], results[i]);
+    }
+    extent = 0;
+    for (unsigned k = 0; k < 3; k++)
+      extent = std::max(extent, data_hi[k] - data_lo[k]);
+    resolution = extent > 0 ? extent / 1000 : resolution / 1000;
+  }
+
+  // The same queries for every policy
+  srand48(32423);
+  PolicyResult result = {0, 0, 0, 0, 0};
+  for (unsigned scan = 0; scan < num_scans; scan++)
+  {
+    tree.resetCount();
+    for (unsigned q = 0; q < QUERIES_PER_SCAN; q++)
+    {
+      // A view of a quarter of the data around a random spot
+      for (unsigned k = 0; k < 3; k++)
+      {
+        double center = data_lo[k] + drand48() * (data_hi[k] - data_lo[k]);
+        lo[k] = center - extent / 8;
+        hi[k] = center + extent / 8;
+      }
+      results.clear();
+      colors.clear();
+      queryRange(tree, lo, hi, extent / 50, results, colors);
+    }
+    result.interactive_hits += tree.getHitCount();
+    result.interactive_misses += tree.getMissCount();
+
+    tree.resetCount();
+    results.clear();
+    colors.clear();
+    queryRange(tree, data_lo, data_hi, SCAN_RESOLUTION, results, colors);
+    result.scan_hits += tree.getHitCount();
+    result.scan_misses += tree.getMissCount();
+  }
+  result.seconds = secondsSince(started);
+  return result;
+}
+
+
+int main (int argc, char** argv)
+{
+  if (argc < 3)
+  {
+    printf("Usage: ./benchmark_cache_policy  tree_path  cache_bytes  [num_scans=5]\n");
+    return -1;
+  }
+  uint64_t cache_size = parseNumberSuffixed(argv[2]);
+  unsigned num_scans = argc > 3 ? atoi(argv[3]) : 5;
+
+  const CachePolicy policies[] = {LRU_CACHE_POLICY, CLOCK_CACHE_POLICY, TWO_QUEUE_CACHE_POLICY};
+  const unsigned num_policies = sizeof(policies) / sizeof(policies[0]);
+  PolicyResult results[num_policies];
+  for (unsigned p = 0; p < num_policies; p++)
+    results[p] = benchmark(argv[1], cache_size, policies[p], num_scans);
+
+  printf("\n%u scans, %u interactive queries per scan, cache size %llu bytes\n",
+         num_scans, QUERIES_PER_SCAN, (unsigned long long)cache_size);
+  printf("policy   interactive hits (%%)   files loaded   scan hits (%%)   files loaded   time (s)\n");
+  for (unsigned p = 0; p < num_policies; p++)
+    printf("%-6s   %20.2f   %12u   %13.2f   %12u   %8.3f\n", cachePolicyName(policies[p]).c_str(),
+           hitRatio(results[p].interactive_hits, results[p].interactive_misses), results[p].interactive_misses,
+           hitRatio(results[p].scan_hits, results[p].scan_misses), results[p].scan_misses,
+           results[p].seconds);
+  return 0;
+}
@@ -0,0 +1,190 @@
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <map>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include <megatree/node.h>
+#include <megatree/short_id_table.h>
+#include <megatree/node_geometry.h>
+
+// Compares the std::map<ShortId, Node*> that node files used to keep
+// their nodes in against the ShortIdTable they use now.  Each round
+// builds a number of node files, looks up every node a few times,
+// walks the nodes in ShortId order like serialize() does and tears the
+// files down again.
+
+using namespace megatree;
+
+const unsigned num_lookups = 4;
+
+typedef std::map<ShortId, Node*> NodeMap;
+typedef ShortIdTable<Node> NodeTable;
+
+
+struct Timings
+{
+  Timings() : insert(0), lookup(0), iterate(0), teardown(0) {}
+  double insert, lookup, iterate, teardown;
+};
+
+
+static void fillNode(Node* node, Count count)
+{
+  static const double center[3] = {0, 0, 0};
+  static const NodeGeometry geometry(center, 1.0);
+  static const double color[3] = {128, 128, 128};
+  node->setPoint(geometry, center, color, count);
+}
+
+
+static double secondsSince(const boost::posix_time::ptime& started)
+{
+  return (boost::posix_time::microsec_clock::universal_time() - started).total_microseconds() / 1e6;
+}
+
+
+// Generates the ids of a node file with the nodes "levels" deep,
+// keeping roughly one out of "sparsity" possible nodes.
+static void generateIds(unsigned levels, unsigned sparsity, std::vector<ShortId>& ids)
+{
+  ids.clear();
+  for (ShortId id = 0; id < (1u << (3 * levels)); id++)
+    if (rand() % sparsity == 0)
+      ids.push_back(id);
+  std::random_shuffle(ids.begin(), ids.end());
+}
+
+
+static void runMap(const std::vector<std::vector<ShortId> >& files, Timings& t, double& checksum)
+{
+  std::vector<NodeMap> maps(files.size());
+  boost::posix_time::ptime started;
+
+  started = boost::posix_time::microsec_clock::universal_time();
+  for (size_t f = 0; f < files.size(); f++)
+    for (size_t i = 0; i < files[f].size(); i++)
+    {
+      Node* node = new Node;
+      fillNode(node, i + 1);
+      maps[f].insert(std::make_pair(files[f][i], node));
+    }
+  t.insert += secondsSince(started);
+
+  started = boost::posix_time::microsec_clock::universal_time();
+  for (unsigned l = 0; l < num_lookups; l++)
+    for (size_t f = 0; f < files.size(); f++)
+      for (size_t i = 0; i < files[f].size(); i++)
+        checksum += maps[f].find(files[f][i])->second->getCount();
+  t.lookup += secondsSince(started);
+
+  started = boost::posix_time::microsec_clock::universal_time();
+  for (size_t f = 0; f < maps.size(); f++)
+    for (NodeMap::const_iterator it = maps[f].begin(); it != maps[f].end(); ++it)
+      checksum += it->first + it->second->getCount();
+  t.iterate += secondsSince(started);
+
+  started = boost::posix_time::microsec_clock::universal_time();
+  for (size_t f = 0; f < maps.size(); f++)
+  {
+    for (NodeMap::iterator it = maps[f].begin(); it != maps[f].end(); ++it)
+      delete it->second;
+    maps[f].clear();
+  }
+  t.teardown += secondsSince(started);
+}
+
+
+static void runTable(const std::vector<std::vector<ShortId> >& files, Timings& t, double& checksum)
+{
+  std::vector<NodeTable*> tables(files.size());
+  boost::posix_time::ptime started;
+
+  started = boost::posix_time::microsec_clock::universal_time();
+  for (size_t f = 0; f < files.size(); f++)
+  {
+    tables[f] = new NodeTable;
+    for (size_t i = 0; i < files[f].size(); i++)
+      fillNode(tables[f]->insert(files[f][i]), i + 1);
+  }
+  t.insert += secondsSince(started);
+
+  started = boost::posix_time::microsec_clock::universal_time();
+  for (unsigned l = 0; l < num_lookups; l++)
+    for (size_t f = 0; f < files.size(); f++)
+      for (size_t i = 0; i < files[f].size(); i++)
+        checksum += tables[f]->find(files[f][i])->getCount();
+  t.lookup += secondsSince(started);
+
+  started = boost::posix_time::microsec_clock::universal_time();
+  std::vector<NodeTable::Entry> entries;
+  for (size_t f = 0; f < tables.size(); f++)
+  {
+    tables[f]->getSorted(entries);
+    for (size_t i = 0; i < entries.size(); i++)
+      checksum += entries[i].first + entries[i].second->getCount();
+  }
+  t.iterate += secondsSince(started);
+
+  started = boost::posix_time::microsec_clock::universal_time();
+  for (size_t f = 0; f < tables.size(); f++)
+    delete tables[f];
+  t.teardown += secondsSince(started);
+}
+
+
+static void printTimings(const char* name, const Timings& t, unsigned num_nodes)
+{
+  printf("%-8s insert %7.1f ns  lookup %7.1f ns  sorted walk %7.1f ns  teardown %7.1f ns  (per node)\n",
+         name,
+         1e9 * t.insert / num_nodes, 1e9 * t.lookup / (num_nodes * num_lookups),
+         1e9 * t.iterate / num_nodes, 1e9 * t.teardown / num_nodes);
+}
+
+
+int main (int argc, char** argv)
+{
+  if (argc < 3)
+  {
+    printf("Usage: ./benchmark_node_file  num_files  levels_per_file  [sparsity=4] [rounds=3]\n");
+    return -1;
+  }
+  unsigned num_files = atoi(argv[1]);
+  unsigned levels = atoi(argv[2]);
+  unsigned sparsity = argc > 3 ? atoi(argv[3]) : 4;
+  unsigned rounds = argc > 4 ? atoi(argv[4]) : 3;
+  if (levels < 1 || levels > 10 || sparsity < 1)
+  {
+    fprintf(stderr, "Levels must be between 1 and 10, sparsity at least 1\n");
+    return -1;
+  }
+
+  std::vector<std::vector<ShortId> > files(num_files);
+  unsigned num_nodes = 0;
+  for (unsigned f = 0; f < num_files; f++)
+  {
+    generateIds(levels, sparsity, files[f]);
+    num_nodes += files[f].size();
+  }
+  printf("%u node files with %u nodes in total, %u rounds\n", num_files, num_nodes, rounds);
+  if (num_nodes == 0)
+    return 0;
+
+  Timings map_timings, table_timings;
+  double map_checksum = 0, table_checksum = 0;
+  for (unsigned r = 0; r < rounds; r++)
+  {
+    runMap(files, map_timings, map_checksum);
+    runTable(files, table_timings, table_checksum);
+  }
+  num_nodes *= rounds;
+
+  printTimings("map", map_timings, num_nodes);
+  printTimings("table", table_timings, num_nodes);
+  if (map_checksum != table_checksum)
+  {
+    fprintf(stderr, "Checksums differ: %f vs %f\n", map_checksum, table_checksum);
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,163 @@
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include <megatree/node_file.h>
+#include <megatree/node_geometry.h>
+
+// Looks up a few nodes in each of a number of cold node files, the way
+// a deep getChildNode chain touches a handful of nodes per file.  Every
+// round loads the files again from their serialized buffers, so the
+// time includes deserializing the file.  Compares decoding the whole
+// file (compact layout) against finding the nodes in the buffer of a
+// lazily loaded file (version 11, and the indexed layout).
+
+using namespace megatree;
+
+
+struct Layout
+{
+  const char* name;
+  unsigned version;
+  NodeLayout layout;
+  bool lazy;
+};
+
+
+static double secondsSince(const boost::posix_time::ptime& started)
+{
+  return (boost::posix_time::microsec_clock::universal_time() - started).total_microseconds() / 1e6;
+}
+
+
+// Generates the ids of a node file with the nodes "levels" deep,
+// keeping roughly one out of "sparsity" possible nodes.
+static void generateIds(unsigned levels, unsigned sparsity, std::vector<ShortId>& ids)
+{
+  ids.clear();
+  for (ShortId id = 0; id < (1u << (3 * levels)); id++)
+    if (rand() % sparsity == 0)
+      ids.push_back(id);
+}
+
+
+static void writeFile(const Layout& layout, unsigned levels, const std::vector<ShortId>& ids, ByteVec& buffer)
+{
+  static const double center[3] = {0, 0, 0};
+  static const NodeGeometry geometry(center, 1.0);
+
+  NodeFile file("f0", layout.version, levels, false, layout.layout);
+  file.deserialize();
+  for (size_t i = 0; i < ids.size(); i++)
+  {
+    double pt[3] = {drand48() - 0.5, drand48() - 0.5, drand48() - 0.5};
+    double color[3] = {255 * drand48(), 255 * drand48(), 255 * drand48()};
+    Node* node = file.createNode(ids[i]);
+    node->setPoint(geometry, pt, color, 1 + ids[i] % 1000);
+    file.releaseNode(node, ids[i], true);
+  }
+  file.serialize(buffer);
+  file.setWritten();
+}
+
+
+static double lookup(const Layout& layout, unsigned levels,
+                     const std::vector<ByteBufferPtr>& buffers, const std::vector<std::vector<ShortId> >& lookups,
+                     double& checksum)
+{
+  boost::posix_time::ptime started = boost::posix_time::microsec_clock::universal_time();
+  for (size_t f = 0; f < buffers.size(); f++)
+  {
+    NodeFile file("f0", layout.version, levels);
+    if (layout.lazy)
+      file.deserialize(buffers[f]);
+    else
+    {
+      const ByteVecBuffer* buffer = static_cast<const ByteVecBuffer*>(buffers[f].get());
+      file.deserialize(buffer->bytes);
+    }
+
+    for (size_t i = 0; i < lookups[f].size(); i++)
+    {
+      Node* node = file.readNode(lookups[f][i]);
+      checksum += node->getCount();
+      file.releaseNode(node, lookups[f][i], false);
+    }
+  }
+  return secondsSince(started);
+}
+
+
+int main (int argc, char** argv)
+{
+  if (argc < 3)
+  {
+    printf("Usage: ./benchmark_node_lookup  num_files  levels_per_file  [lookups_per_file=8] [sparsity=4] [rounds=3]\n");
+    return -1;
+  }
+  unsigned num_files = atoi(argv[1]);
+  unsigned levels = atoi(argv[2]);
+  unsigned lookups_per_file = argc > 3 ? atoi(argv[3]) : 8;
+  unsigned sparsity = argc > 4 ? atoi(argv[4]) : 4;
+  unsigned rounds = argc > 5 ? atoi(argv[5]) : 3;
+  if (levels < 1 || levels > 10 || sparsity < 1)
+  {
+    fprintf(stderr, "Levels must be between 1 and 10, sparsity at least 1\n");
+    return -1;
+  }
+
+  const Layout layouts[] = {
+    {"v11 lazy", 11, COMPACT_NODE_LAYOUT, true},
+    {"compact", 12, COMPACT_NODE_LAYOUT, false},
+    {"indexed", 12, INDEXED_NODE_LAYOUT, true}
+  };
+  const unsigned num_layouts = sizeof(layouts) / sizeof(layouts[0]);
+
+  // The same nodes in every layout
+  std::vector<std::vector<ShortId> > ids(num_files), lookups(num_files);
+  std::vector<std::vector<ByteBufferPtr> > buffers(num_layouts, std::vector<ByteBufferPtr>(num_files));
+  std::vector<size_t> bytes(num_layouts, 0);
+  unsigned num_nodes = 0;
+  for (unsigned f = 0; f < num_files; f++)
+  {
+    do
+      generateIds(levels, sparsity, ids[f]);
+    while (ids[f].empty());
+    num_nodes += ids[f].size();
+    for (unsigned i = 0; i < lookups_per_file; i++)
+      lookups[f].push_back(ids[f][rand() % ids[f].size()]);
+
+    for (unsigned l = 0; l < num_layouts; l++)
+    {
+      srand48(f);
+      ByteVecBuffer* buffer = new ByteVecBuffer;
+      writeFile(layouts[l], levels, ids[f], buffer->bytes);
+      bytes[l] += buffer->bytes.size();
+      buffers[l][f].reset(buffer);
+    }
+  }
+  printf("%u node files with %u nodes in total, %u lookups per file, %u rounds\n",
+         num_files, num_nodes, lookups_per_file, rounds);
+
+  std::vector<double> seconds(num_layouts, 0), checksums(num_layouts, 0);
+  for (unsigned r = 0; r < rounds; r++)
+    for (unsigned l = 0; l < num_layouts; l++)
+      seconds[l] += lookup(layouts[l], levels, buffers[l], lookups, checksums[l]);
+
+  for (unsigned l = 0; l < num_layouts; l++)
+    printf("%-9s %8.1f us per file  %7.1f ns per lookup  %6.1f bytes per node\n",
+           layouts[l].name,
+           1e6 * seconds[l] / (num_files * rounds),
+           1e9 * seconds[l] / (num_files * rounds * std::max(lookups_per_file, 1u)),
+           (double)bytes[l] / num_nodes);
+
+  for (unsigned l = 1; l < num_layouts; l++)
+    if (checksums[l] != checksums[0])
+    {
+      fprintf(stderr, "Checksums differ: %f vs %f\n", checksums[0], checksums[l]);
+      return -1;
+    }
+  return 0;
+}
@@ -1,8 +1,12 @@
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sys/wait.h>
 #include <boost/date_time/posix_time/posix_time_types.hpp>
 
 #include <megatree/common.h>
+#include <megatree/allocator.h>
 #include <megatree/megatree.h>
 #include <megatree/storage_factory.h>
 #include <megatree/tree_functions.h>
@@ -12,18 +16,16 @@ const double resolution = 0.00001;
 
 using namespace megatree;
 
-int main (int argc, char** argv)
+
+// Loads the whole tree in the cache, and queries it again from the warm
+// cache.  Returns the time the warm queries took.
+static double benchmark(const char* tree_path, uint64_t cache_size)
 {
-  if (argc < 3)
-  {
-    printf("Usage: ./benchmark_read  tree_path  cache_size\n");
-    return -1;
-  }
   boost::posix_time::ptime started, finished;
 
   // create megatree
-  boost::shared_ptr<Storage> storage(openStorage(argv[1]));
-  MegaTree tree(storage, parseNumberSuffixed(argv[2]), true);
+  boost::shared_ptr<Storage> storage(openStorage(tree_path));
+  MegaTree tree(storage, cache_size, true);
   NodeHandle root;
 
   NodeGeometry root_geom(tree.getRootGeometry());
@@ -70,5 +72,72 @@ int main (int argc, char** argv)
          (int)root.getCount(), num_queries,
          (finished - started).total_milliseconds() / 1000.0f);
   tree.releaseNode(root);
+  return (finished - started).total_microseconds() / 1e6;
+}
+
+
+// Runs the benchmark in a child process, as the allocators keep their
+// chunks (and so their huge page mode) for the life of the process.
+static bool benchmarkInChild(const char* tree_path, uint64_t cache_size, HugePageMode mode, double& seconds)
+{
+  int fds[2];
+  if (pipe(fds) != 0)
+    return false;
+
+  pid_t pid = fork();
+  if (pid < 0)
+    return false;
+  if (pid == 0)
+  {
+    close(fds[0]);
+    setHugePageMode(mode);
+    seconds = benchmark(tree_path, cache_size);
+    fflush(stdout);
+    _exit(write(fds[1], &seconds, sizeof(seconds)) == sizeof(seconds) ? 0 : 1);
+  }
+
+  close(fds[1]);
+  bool ok = read(fds[0], &seconds, sizeof(seconds)) == sizeof(seconds);
+  close(fds[0]);
+  int status;
+  waitpid(pid, &status, 0);
+  return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+
+int main (int argc, char** argv)
+{
+  if (argc < 3)
+  {
+    printf("Usage: ./benchmark_read  tree_path  cache_bytes  [huge_pages=off|transparent|explicit|compare]\n");
+    return -1;
+  }
+  uint64_t cache_size = parseNumberSuffixed(argv[2]);
+  if (argc < 4 || strcmp(argv[3], "compare") != 0)
+  {
+    if (argc > 3)
+      setHugePageMode(parseHugePageMode(argv[3]));
+    benchmark(argv[1], cache_size);
+    return 0;
+  }
+
+  // Warm queries on the same tree, with the nodes on normal and on huge pages
+  const HugePageMode modes[] = {NO_HUGE_PAGES, TRANSPARENT_HUGE_PAGES, EXPLICIT_HUGE_PAGES};
+  const unsigned num_modes = sizeof(modes) / sizeof(modes[0]);
+  double seconds[num_modes];
+  for (unsigned m = 0; m < num_modes; m++)
+  {
+    printf("\nHuge pages: %s\n", hugePageModeName(modes[m]).c_str());
+    fflush(stdout);
+    if (!benchmarkInChild(argv[1], cache_size, modes[m], seconds[m]))
+    {
+      fprintf(stderr, "Benchmark with huge pages '%s' failed\n", hugePageModeName(modes[m]).c_str());
+      return -1;
+    }
+  }
+
+  printf("\nhuge pages    warm queries (s)   speedup\n");
+  for (unsigned m = 0; m < num_modes; m++)
+    printf("%-11s   %16.3f   %6.2fx\n", hugePageModeName(modes[m]).c_str(), seconds[m], seconds[0] / seconds[m]);
   return 0;
 }
@@ -0,0 +1,108 @@
+#include <cstdio>
+#include <cstdlib>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include <megatree/common.h>
+#include <megatree/storage_factory.h>
+#include <megatree/megatree.h>
+#include <megatree/tree_functions.h>
+
+// Writes the same scans into trees with different subtree widths, and
+// queries each tree back from disk.  Small node files mean more files
+// (more storage round trips), big node files mean more bytes per file.
+
+using namespace megatree;
+
+
+const double SCANNER_RANGE = 30;
+const int POINTS_PER_SCAN = 1000;
+const double CAR_STEP = 0.5;
+const double SCAN_ACCURACY = 0.001;  // 1 mm accuracy of scans
+const double QUERY_RESOLUTION = 0.01;
+
+
+static double secondsSince(const boost::posix_time::ptime& started)
+{
+  return (boost::posix_time::microsec_clock::universal_time() - started).total_microseconds() / 1e6;
+}
+
+
+int main (int argc, char** argv)
+{
+  if (argc < 3)
+  {
+    printf("Usage: ./benchmark_widths  num_scans  tree_prefix  [cache_bytes=256M] [min_width=3] [max_width=8]\n");
+    return -1;
+  }
+  int num_scans = parseNumberSuffixed(argv[1]);
+  std::string tree_prefix = argv[2];
+  uint64_t cache_size = argc > 3 ? parseNumberSuffixed(argv[3]) : CACHE_SIZE;
+  unsigned min_width = argc > 4 ? atoi(argv[4]) : 3;
+  unsigned max_width = argc > 5 ? atoi(argv[5]) : 8;
+  if (min_width < 1 || max_width > 10 || min_width > max_width)
+  {
+    fprintf(stderr, "Subtree widths must be between 1 and 10\n");
+    return -1;
+  }
+
+  // The same points for every width
+  srand48(32423);
+  std::vector<double> random_numbers(3 * POINTS_PER_SCAN * 100);
+  for (size_t i = 0; i < random_numbers.size(); ++i)
+    random_numbers[i] = trunc(drand48() * SCANNER_RANGE * 1000) / 1000;
+
+  std::vector<double> tree_center(3, 0);
+  double tree_size = 6378000+8850; // radius of the earth + height of Mount Everest
+  unsigned num_points = num_scans * POINTS_PER_SCAN;
+  printf("%u points per tree, cache size %llu bytes\n", num_points, (unsigned long long)cache_size);
+  printf("width   insert (points/s)   flush (s)   query (points/s)   points returned\n");
+
+  for (unsigned width = min_width; width <= max_width; width++)
+  {
+    char tree_path[1024];
+    snprintf(tree_path, sizeof(tree_path), "%s%u", tree_prefix.c_str(), width);
+    removePath(tree_path);
+
+    double insert_seconds, flush_seconds;
+    {
+      boost::shared_ptr<Storage> storage(openStorage(tree_path));
+      MegaTree tree(storage, tree_center, tree_size, width, 10000, cache_size, SCAN_ACCURACY);
+
+      std::vector<double> pt(3, 0.0);
+      std::vector<double> white(3, 255);
+      boost::posix_time::ptime started = boost::posix_time::microsec_clock::universal_time();
+      for (int i = 0; i < num_scans; ++i)
+      {
+        for (int j = 0; j < POINTS_PER_SCAN; j++)
+        {
+          pt[0] = i * CAR_STEP;
+          pt[1] = random_numbers[(3*j+1) % random_numbers.size()];
+          pt[2] = random_numbers[(3*j+2) % random_numbers.size()];
+          addPoint(tree, pt, white);
+        }
+      }
+      insert_seconds = secondsSince(started);
+
+      started = boost::posix_time::microsec_clock::universal_time();
+      tree.flushCache();
+      flush_seconds = secondsSince(started);
+    }
+
+    // Queries everything that was written, from a cold cache
+    boost::shared_ptr<Storage> storage(openStorage(tree_path));
+    MegaTree tree(storage, cache_size, true);
+    std::vector<double> lo(3), hi(3), results, colors;
+    lo[0] = -1;  hi[0] = num_scans * CAR_STEP + 1;
+    lo[1] = -1;  hi[1] = SCANNER_RANGE + 1;
+    lo[2] = -1;  hi[2] = SCANNER_RANGE + 1;
+
+    boost::posix_time::ptime started = boost::posix_time::microsec_clock::universal_time();
+    queryRange(tree, lo, hi, QUERY_RESOLUTION, results, colors);
+    double query_seconds = secondsSince(started);
+
+    printf("%5u   %17.0f   %9.3f   %16.0f   %15zu\n", width,
+           num_points / insert_seconds, flush_seconds,
+           results.size() / 3 / query_seconds, results.size() / 3);
+  }
+  return 0;
+}
@@ -19,9 +19,9 @@ const double SCAN_ACCURACY = 0.001;  // 1 mm accuracy of scans
 
 int main (int argc, char** argv)
 {
-  if (argc != 5 && argc != 6)
+  if (argc < 5 || argc > 8)
   {
-    printf("Usage: ./benchmark_write   subtree_width  subfolder_depth  cache_size  num_scans [tree]\n");
+    printf("Usage: ./benchmark_write   subtree_width  subfolder_depth  cache_bytes  num_scans [tree] [scan_accuracy] [batch_size]\n");
     return -1;
   }
   int NUM_SCANS = parseNumberSuffixed(argv[4]);
@@ -39,9 +39,12 @@ int main (int argc, char** argv)
   
   double scan_accuracy = SCAN_ACCURACY;
   if (argc > 6){
-    scan_accuracy = atoi(argv[6]);
+    scan_accuracy = atof(argv[6]);
   }
-    
+
+  size_t batch_size = BatchInserter::DEFAULT_BATCH_SIZE;
+  if (argc > 7)
+    batch_size = parseNumberSuffixed(argv[7]);
 
   // create megatree
   std::vector<double> tree_center(3, 0);
@@ -64,6 +67,7 @@ int main (int argc, char** argv)
   }
   std::vector<double> pt(3, 0.0);
   std::vector<double> white(3, 255);
+  BatchInserter inserter(tree, batch_size);
 
   // adding points to tree
   printf("Adding %d sorted points.\n", POINTS_PER_SCAN);    
@@ -86,9 +90,10 @@ int main (int argc, char** argv)
       pt[0] = ((double)i*CAR_STEP);
       pt[1] = random_numbers[(3*j+1)%num_random_numbers];
       pt[2] = random_numbers[(3*j+2)%num_random_numbers];
-      addPoint(tree, pt, white);
+      inserter.addPoint(pt, white);
     }
   }
+  inserter.flush();
   dumpTimers();
   finished = boost::posix_time::microsec_clock::universal_time();
   tree.flushCache();
@@ -45,18 +45,20 @@ int main (int argc, char** argv)
   std::vector<double> tree_center(3, 0);
   double tree_size = 2 * (6378000+8850+10000); // radius of the earth + height of Mount Everest + padding
 
-  if(argc != 4)
+  if(argc < 4 || argc > 6)
   {
-    printf("Usage: ./create tree_path  subtree_width subfolder_depth\n");
+    printf("Usage: ./create tree_path  subtree_width subfolder_depth [compression=none|zlib] [node_layout=compact|indexed]\n");
     return -1;
   }
+  std::string compression = argc > 4 ? argv[4] : "none";
+  std::string node_layout = argc > 5 ? argv[5] : "compact";
 
   boost::filesystem::path tree_path(argv[1]);
   removePath(tree_path);
   boost::shared_ptr<Storage> storage(openStorage(tree_path));
   MegaTree tree(storage, tree_center, tree_size,
                 atoi(argv[2]), atoi(argv[3]),  // subtree_width, subfolder_depth
-                1000000);
+                CACHE_SIZE, MIN_CELL_SIZE, compression, node_layout);
   
   return 0;
 }
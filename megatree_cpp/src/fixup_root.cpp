@@ -8,6 +8,9 @@
 
 using namespace megatree;
 
+// Must match how the mapreduces work.  Change this with great caution.
+const unsigned subtree_width = 6;
+
 struct arguments_t {
   char* tree;
 };
@@ -62,11 +65,11 @@ int main (int argc, char** argv)
     exit(1);
   }
 
-  NodeFile f1("f1");
+  NodeFile f1("f1", 11, subtree_width);
   f1.deserialize(f1_binary);
   printf("Loaded f1 with %u nodes\n", f1.cacheSize());
 
-  NodeFile f("f");
+  NodeFile f("f", 11, subtree_width, true);
   f.initializeRootNodeFile(boost::filesystem::path("f"), f1);
   ByteVec f_binary;
   f.serialize(f_binary);
@@ -79,7 +82,7 @@ int main (int argc, char** argv)
   std::stringstream output;
   output << "version = " << 11 << std::endl;  // Must match how the mapreduces work.  Change this with great caution.
   output << "min_cell_size = " << 0.001 << std::endl;
-  output << "subtree_width = " << 6 << std::endl;
+  output << "subtree_width = " << subtree_width << std::endl;
   output << "subfolder_depth = " << 10000000 << std::endl;
   output << "tree_center_x = " << 0 << std::endl;
   output << "tree_center_y = " << 0 << std::endl;
@@ -1,12 +1,14 @@
 #include <megatree/megatree.h>
 #include <megatree/tree_functions.h>
 #include <megatree/metadata.h>
+#include <megatree/compressed_storage.h>
 
 #include <iostream>
 #include <fstream>
 #include <cstdio>
 #include <cmath>
 #include <vector>
+#include <algorithm>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -16,9 +18,36 @@
 namespace megatree
 {
 
+// Wraps the storage of a tree whose node files are compressed.
+static boost::shared_ptr<Storage> wrapStorage(boost::shared_ptr<Storage> storage, const std::string& compression)
+{
+  if (compression == "none")
+    return storage;
+  return boost::shared_ptr<Storage>(new CompressedStorage(storage, parseCompressionCodec(compression)));
+}
+
+
 // Loads the tree from disk, grabbing parameters from the metadata
-MegaTree::MegaTree(boost::shared_ptr<Storage> _storage, unsigned cache_size, bool _read_only)
+MegaTree::MegaTree(boost::shared_ptr<Storage> _storage, uint64_t cache_size, bool _read_only,
+                   CachePolicy cache_policy, unsigned pinned_levels)
   : storage(_storage), read_only(_read_only)
+{
+  openTree(cache_size, cache_policy, pinned_levels);
+  warmCache();
+}
+
+
+MegaTree::MegaTree(boost::shared_ptr<Storage> _storage, boost::shared_ptr<SharedCache> _shared_cache, bool _read_only,
+                   double cache_weight, CachePolicy cache_policy, unsigned pinned_levels)
+  : storage(_storage), shared_cache(_shared_cache), read_only(_read_only)
+{
+  openTree(shared_cache->getBudget(), cache_policy, pinned_levels);
+  shared_cache->attach(this, cache_weight);
+  warmCache();
+}
+
+
+void MegaTree::openTree(uint64_t cache_size, CachePolicy cache_policy, unsigned pinned_levels)
 {
   printf("Reading existing tree\n");
 
@@ -28,11 +57,11 @@ MegaTree::MegaTree(boost::shared_ptr<Storage> _storage, unsigned cache_size, boo
   MetaData metadata;
   metadata.deserialize(data);
 
-  // Checks that the on-disk version matches the code version.
-  if (metadata.version != version)
+  // Checks that the code can handle the on-disk version.
+  if (metadata.version < OLDEST_READABLE_VERSION || metadata.version > version)
   {
-    fprintf(stderr, "You are trying to read a tree with version %d from disk, but your code was compiled for version %d\n",
-            metadata.version, version);
+    fprintf(stderr, "You are trying to read a tree with version %d from disk, but your code was compiled for versions %d to %d\n",
+            metadata.version, OLDEST_READABLE_VERSION, version);
     abort();
   }
 
@@ -40,19 +69,25 @@ MegaTree::MegaTree(boost::shared_ptr<Storage> _storage, unsigned cache_size, boo
   min_cell_size = metadata.min_cell_size;
   subtree_width = metadata.subtree_width;
   subfolder_depth = metadata.subfolder_depth;
+  compression = metadata.compression;
+  node_layout = parseNodeLayout(metadata.node_layout);
 
   // Initializes the tree
-  initTree(storage, metadata.root_center, metadata.root_size, subtree_width, subfolder_depth, cache_size, min_cell_size);
+  initTree(wrapStorage(storage, compression), metadata.root_center, metadata.root_size, subtree_width, subfolder_depth,
+           cache_size, cache_policy, pinned_levels, min_cell_size);
+  tree_version = metadata.version;
 }
 
 
 
 MegaTree::MegaTree(boost::shared_ptr<Storage> _storage, const std::vector<double>& cell_center, const double& cell_size,
                    unsigned subtree_width, unsigned subfolder_depth,
-                   unsigned cache_size, double min_cell_size)
-  : storage(_storage), read_only(false)
+                   uint64_t cache_size, double min_cell_size, const std::string& _compression,
+                   const std::string& _node_layout, CachePolicy cache_policy, unsigned pinned_levels)
+  : storage(_storage), compression(_compression), node_layout(parseNodeLayout(_node_layout)), read_only(false)
 {
-  initTree(storage, cell_center, cell_size, subtree_width, subfolder_depth, cache_size, min_cell_size);
+  initTree(wrapStorage(storage, compression), cell_center, cell_size, subtree_width, subfolder_depth,
+           cache_size, cache_policy, pinned_levels, min_cell_size);
 
   // Creates the root node for this new tree.
   NodeHandle root;
@@ -66,44 +101,59 @@ MegaTree::MegaTree(boost::shared_ptr<Storage> _storage, const std::vector<double
 
 MegaTree::~MegaTree()
 {
-  flushCache();
+  // Other trees no longer wake up the eviction thread
+  if (shared_cache)
+    shared_cache->detach(this);
 
-  while (true)
   {
-    {
-      // delete node file pointers
-      boost::mutex::scoped_lock lock(file_cache_mutex);
-      if (file_cache.size() == 0)
-        break;
-
-      CacheIterator<IdType, NodeFile> it = file_cache.iterate();
-      while (!it.finished())
-      {
-        NodeFile* to_delete(NULL);
-        {
-          // lock node file
-          boost::mutex::scoped_try_lock file_lock(it.get()->mutex);
+    boost::mutex::scoped_lock lock(background_mutex);
+    stop_warm_up = true;
+    while (prefetches_in_flight > 0)
+      prefetch_done.wait(lock);
+    while (reads_in_flight > 0)
+      read_done.wait(lock);
+    while (checkpoints_landed != checkpoints_started)
+      checkpoint_done.wait(lock);
+    // A write of the checkpoint may still be in its callback after
+    // another one landed the checkpoint
+    while (checkpoint_writes > 0)
+      write_done.wait(lock);
+    stop_eviction = true;
+    eviction_wakeup.notify_one();
+  }
+  eviction_thread.join();
 
-          // delete node file and remove it form cache
-          if (file_lock && it.get()->getNodeState() == LOADED)
-          {
-            CacheIterator<IdType, NodeFile> it_to_delete = it;
-            it.next();
-            to_delete = it_to_delete.get();
-            file_cache.erase(it_to_delete);
-            current_cache_size -= to_delete->cacheSize();
-          }
-          else
-            it.next();
-        }
+  flushCache();
+  if (save_working_set)
+    saveWorkingSet();
 
-        if (to_delete)
-          delete to_delete;
+  // Once the files that were evicted are written, no I/O is left, and
+  // every file in the cache is loaded.
+  {
+    boost::mutex::scoped_lock lock(background_mutex);
+    while (writes_in_flight[0] + writes_in_flight[1] > 0)
+      write_done.wait(lock);
+  }
 
-      }
+  for (unsigned i = 0; i < FILE_CACHE_SHARDS; i++)
+  {
+    // delete node file pointers
+    FileCacheShard& shard = file_cache_shards[i];
+    boost::mutex::scoped_lock lock(shard.mutex);
+    for (CacheIterator<IdType, NodeFile> it = shard.file_cache.iterate(); !it.finished(); it.next())
+    {
+      assert(it.get()->getNodeState() == LOADED);
+      delete it.get();
+    }
+    for (PinnedFiles::iterator pinned_it = shard.pinned_files.begin(); pinned_it != shard.pinned_files.end(); pinned_it++)
+    {
+      assert(pinned_it->second->getNodeState() == LOADED);
+      delete pinned_it->second;
     }
-    // sleep
-    usleep(100000);
+    shard.file_cache.clear();
+    shard.pinned_files.clear();
+    shard.cache_bytes = 0;
+    shard.cache_size = 0;
   }
 
   if (singleton_allocator) {
@@ -116,21 +166,32 @@ MegaTree::~MegaTree()
 
 void MegaTree::initTree(boost::shared_ptr<Storage> _storage, const std::vector<double>& _cell_center, const double& _cell_size,
                         unsigned _subtree_width, unsigned _subfolder_depth,
-                        unsigned _cache_size, double _min_cell_size)
+                        uint64_t _cache_size, CachePolicy _cache_policy, unsigned _pinned_levels,
+                        double _min_cell_size)
 {
   storage = _storage;
   subtree_width = _subtree_width;
   subfolder_depth = _subfolder_depth;
+  tree_version = version;
   max_cache_size = _cache_size;
-  current_cache_size = 0;
-  current_write_size = 0;
+  pinned_levels = _pinned_levels;
+  eviction_shard = 0;
+  eviction_requested = eviction_running = eviction_stuck = stop_eviction = false;
+  checkpoints_started = checkpoints_landed = 0;
+  checkpoint_scanning = checkpoint_landing = false;
+  checkpoint_files = 0;
+  checkpoint_writes = 0;
+  checkpoint_generation = write_generation = 0;
+  writes_in_flight[0] = writes_in_flight[1] = 0;
+  reads_in_flight = prefetches_in_flight = 0;
+  auto_prefetch = false;
+  save_working_set = stop_warm_up = false;
+  for (unsigned i = 0; i < FILE_CACHE_SHARDS; i++)
+    file_cache_shards[i].file_cache.setPolicy(_cache_policy);
 
   // reset counters
   resetCount();
 
-  // Pre-allocates memory for the nodes.
-  node_allocator.reset(new Allocator<Node>(_cache_size + _cache_size / 2));
-
   // TODO: the singleton allocator is disabled for now.  The mapreduce
   // programs couldn't run with it enabled, and tcmalloc does a decent
   // job of allocating for stl containers.
@@ -148,6 +209,8 @@ void MegaTree::initTree(boost::shared_ptr<Storage> _storage, const std::vector<d
          root_geometry.getLo(0), root_geometry.getLo(1), root_geometry.getLo(2),
          root_geometry.getHi(0), root_geometry.getHi(1), root_geometry.getHi(2),
          subtree_width, subfolder_depth);
+
+  eviction_thread = boost::thread(boost::bind(&MegaTree::evictionThread, this));
 }
 
 
@@ -167,8 +230,10 @@ void MegaTree::writeMetaData()
   root_center[0] = (root_geometry.getHi(0) + root_geometry.getLo(0)) / 2.0;
   root_center[1] = (root_geometry.getHi(1) + root_geometry.getLo(1)) / 2.0;
   root_center[2] = (root_geometry.getHi(2) + root_geometry.getLo(2)) / 2.0;
-  MetaData metadata(version, subtree_width, subfolder_depth,
+  MetaData metadata(tree_version, subtree_width, subfolder_depth,
                     min_cell_size, root_geometry.getSize(), root_center);
+  metadata.compression = compression;
+  metadata.node_layout = nodeLayoutName(node_layout);
 
   ByteVec data;
   metadata.serialize(data);
@@ -233,6 +298,116 @@ bool MegaTree::operator==(MegaTree& tree)
 
 
 
+MegaTree::FileCacheShard& MegaTree::fileCacheShard(const IdType& file_id)
+{
+  // Mixes the bits, as the ids of neighboring files only differ in their low bits
+  uint64_t hash = std::tr1::hash<IdType>()(file_id);
+  return file_cache_shards[(hash * 0x9e3779b97f4a7c15ULL >> 32) % FILE_CACHE_SHARDS];
+}
+
+
+// Bookkeeping of one file in the file cache: its node in the eviction order,
+// and its node and bucket in the hash map.
+static const size_t CACHE_ENTRY_BYTES =
+  sizeof(ListNode<Cache<IdType, NodeFile>::Storage>) +
+  sizeof(std::pair<const IdType, Cache<IdType, NodeFile>::ObjListIterator>) + 3 * sizeof(void*);
+
+
+CacheStats MegaTree::getCacheStats()
+{
+  CacheStats stats;
+  stats.node_bytes = stats.write_bytes = stats.evicting_bytes = 0;
+  stats.num_files = stats.num_nodes = stats.num_pinned_files = 0;
+  for (unsigned i = 0; i < FILE_CACHE_SHARDS; i++)
+  {
+    FileCacheShard& shard = file_cache_shards[i];
+    boost::mutex::scoped_lock lock(shard.mutex);
+    stats.node_bytes += shard.cache_bytes;
+    stats.write_bytes += shard.write_bytes;
+    stats.evicting_bytes += shard.evicting_bytes;
+    stats.num_files += shard.file_cache.size() + shard.pinned_files.size();
+    stats.num_pinned_files += shard.pinned_files.size();
+    stats.num_nodes += shard.cache_size;
+  }
+  stats.entry_bytes = stats.num_files * CACHE_ENTRY_BYTES;
+  stats.budget = cacheBudget(stats.total() - stats.evicting_bytes);
+  return stats;
+}
+
+
+void MegaTree::accountNodeFile(FileCacheShard& shard, int64_t bytes, int nodes)
+{
+  if (bytes == 0 && nodes == 0)
+    return;
+  boost::mutex::scoped_lock lock(shard.mutex);
+  shard.cache_bytes += bytes;
+  shard.cache_size += nodes;
+}
+
+
+NodeFile* MegaTree::findCachedFile(FileCacheShard& shard, const IdType& file_id, bool prefetching)
+{
+  // Pinned files are always loaded, once they were loaded.  Their
+  // loads are waited for like any other.
+  PinnedFiles::iterator pinned_it = shard.pinned_files.find(file_id);
+  if (pinned_it != shard.pinned_files.end())
+  {
+    if (!prefetching)
+      __sync_fetch_and_add(&count_hit, 1);
+    pinned_it->second->addUser();
+    return pinned_it->second;
+  }
+
+  Cache<IdType, NodeFile>::iterator it = shard.file_cache.find(file_id);
+  if (!it.finished())
+    return useCachedFile(shard, it, prefetching);
+  return NULL;
+}
+
+
+void MegaTree::addCachedFile(FileCacheShard& shard, const IdType& file_id, NodeFile* file)
+{
+  if (file_id.level() < pinned_levels)
+    shard.pinned_files[file_id] = file;
+  else
+    shard.file_cache.insert(file_id, file);
+
+  int64_t bytes;
+  int nodes;
+  file->takeCacheDelta(bytes, nodes);
+  shard.cache_bytes += bytes;
+  shard.cache_size += nodes;
+}
+
+
+NodeFile* MegaTree::useCachedFile(FileCacheShard& shard, CacheIterator<IdType, NodeFile>& it, bool prefetching)
+{
+  if (!prefetching)
+    __sync_fetch_and_add(&count_hit, 1);
+
+  NodeFile* file = it.get();
+  assert(file->getNodeState() != INVALID);
+
+  // Files of read-only trees are never written, so they are never
+  // evicting.  Other files get locked for the check.
+  if (!read_only)
+  {
+    boost::mutex::scoped_lock file_lock(file->mutex);
+
+    //we need to check if this file is being evicted, and set the state to loading
+    if(file->getNodeState() == EVICTING)
+      file->setNodeState(LOADING);
+  }
+
+  file->addUser();  // make sure file cannot get deleted in cache maintenance
+
+  // Now that the write pointer is definitely elsewhere, tells the
+  // cache policy about the hit.
+  shard.file_cache.touch(it);
+  return file;
+}
+
+
 // create a new node file
 NodeFile* MegaTree::createNodeFile(const IdType& file_id)
 {
@@ -241,21 +416,37 @@ NodeFile* MegaTree::createNodeFile(const IdType& file_id)
   file_id.toPath(subfolder_depth, relative_path, filename);
   boost::filesystem::path path = boost::filesystem::path(relative_path) / filename;
 
-  // Create a new NodeFile and add it to the cache
-  NodeFile* file = new NodeFile(path, node_allocator);
-  file->addUser();  // make sure file cannot get deleted in cache maintenance
+  FileCacheShard& shard = fileCacheShard(file_id);
+  NodeFile* file = NULL;
+  bool created = false, checkpoint_pending = false;
+  {
+    boost::mutex::scoped_lock lock(shard.mutex);
 
-  // The file doesn't exist, so we create it from scratch.
-  file->deserialize();
+    // Another thread may have created the file in the meantime
+    file = findCachedFile(shard, file_id);
+    if (file)
+      checkpoint_pending = file->checkpointPending();
+    else
+    {
+      // Create a new NodeFile and add it to the cache
+      file = new NodeFile(path, tree_version, subtree_width, file_id.isRootFile(), node_layout);
+      file->addUser();  // make sure file cannot get deleted in cache maintenance
 
-  {
-    // TODO: Don't we need to check that this file hasn't been added in the meantime by another thread?
-    boost::mutex::scoped_lock lock(file_cache_mutex);
-    file_cache.push_front(file_id, file);
+      // The file doesn't exist, so we create it from scratch.
+      file->deserialize();
+      addCachedFile(shard, file_id, file);
+      created = true;
+    }
   }
 
-  cacheMaintenance();
-
+  if (created)
+    cacheMaintenance(true);
+  else
+  {
+    file->waitUntilLoaded();
+    if (checkpoint_pending)
+      writeCheckpointFile(file_id, file);
+  }
   return file;
 }
 
@@ -263,68 +454,399 @@ NodeFile* MegaTree::createNodeFile(const IdType& file_id)
 // internal method to get node file based on file id
 NodeFile* MegaTree::getNodeFile(const IdType& file_id)
 {
+  FileCacheShard& shard = fileCacheShard(file_id);
   NodeFile* file(NULL);
+  boost::filesystem::path path;
 
   {
-    //lock the file cache
-    boost::mutex::scoped_lock lock(file_cache_mutex);
+    //lock the shard of the file cache
+    boost::mutex::scoped_lock lock(shard.mutex);
 
     // get the file from the file cache
-    Cache<IdType, NodeFile>::iterator it = file_cache.find(file_id);
-    if (!it.finished())
+    file = findCachedFile(shard, file_id);
+    if (file)
     {
-      count_hit++;
+      // A file of a running checkpoint gets written before it can change
+      bool checkpoint_pending = file->checkpointPending();
+      lock.unlock();
+      if (checkpoint_pending)
+        writeCheckpointFile(file_id, file);
+      return file;
+    }
+
+    // The file wasn't found in the cache, so we load it from storage.
+    // The file goes in the cache before it is loaded, so other threads
+    // asking for it wait for the same load.
+    std::string relative_path, filename;
+    file_id.toPath(subfolder_depth, relative_path, filename);
+    path = boost::filesystem::path(relative_path) / filename;
 
-      file = it.get();
+    // create new nodefile
+    file = new NodeFile(path, tree_version, subtree_width, file_id.isRootFile(), node_layout);
+    file->addUser();  // make sure file cannot get deleted in cache maintenance
 
-      //lock the file
-      boost::mutex::scoped_lock file_lock(file->mutex);
+    // add nodefile to cache
+    addCachedFile(shard, file_id, file);
+    __sync_fetch_and_add(&count_miss, 1);
+  }
 
-      assert(file->getNodeState() != INVALID);
+  // Async request to read the nodefile.  Files of a read-only tree
+  // are decoded lazily, straight from the storage's buffer.
+  startReads(1);
+  if (read_only)
+    storage->getBufferAsync(path, boost::bind(&MegaTree::readNodeFileBufferCb, this, &shard, file, _1));
+  else
+    storage->getAsync(path, boost::bind(&MegaTree::readNodeFileCb, this, &shard, file, _1));
 
-      //we need to check if this file is being evicted, and set the state to loading
-      if(file->getNodeState() == EVICTING)
-        file->setNodeState(LOADING);
+  cacheMaintenance(true);
+  return file;
+}
+
+
+void MegaTree::getNodeFiles(const std::vector<IdType>& file_ids, std::vector<NodeFile*>& files, bool prefetching)
+{
+  files.resize(file_ids.size());
+  std::vector<boost::filesystem::path> paths;
+  std::vector<Storage::GetCallback> callbacks;
+  std::vector<Storage::GetBufferCallback> buffer_callbacks;
+  for (size_t i = 0; i < file_ids.size(); i++)
+  {
+    FileCacheShard& shard = fileCacheShard(file_ids[i]);
+    boost::mutex::scoped_lock lock(shard.mutex);
+    files[i] = findCachedFile(shard, file_ids[i], prefetching);
+    if (files[i])
+      continue;
+
+    std::string relative_path, filename;
+    file_ids[i].toPath(subfolder_depth, relative_path, filename);
+    paths.push_back(boost::filesystem::path(relative_path) / filename);
+
+    files[i] = new NodeFile(paths.back(), tree_version, subtree_width, file_ids[i].isRootFile(), node_layout);
+    files[i]->addUser();  // make sure file cannot get deleted in cache maintenance
+    addCachedFile(shard, file_ids[i], files[i]);
+    __sync_fetch_and_add(&count_miss, 1);
+
+    if (read_only)
+      buffer_callbacks.push_back(boost::bind(&MegaTree::readNodeFileBufferCb, this, &shard, files[i], _1));
+    else
+      callbacks.push_back(boost::bind(&MegaTree::readNodeFileCb, this, &shard, files[i], _1));
+  }
+  if (paths.empty())
+    return;
+
+  startReads(paths.size());
+  if (read_only)
+    storage->getBufferBatchAsync(paths, buffer_callbacks);
+  else
+    storage->getBatchAsync(paths, callbacks);
+  cacheMaintenance(!prefetching);
+}
+
+
+void MegaTree::prefetch(const std::vector<IdType>& file_ids)
+{
+  uint64_t used_bytes = usedCacheBytes();
+  if (file_ids.empty() || used_bytes > cacheBudget(used_bytes) * EVICTION_HIGH_WATERMARK)
+    return;
+
+  std::vector<NodeFile*> files;
+  getNodeFiles(file_ids, files, true);
+  for (size_t i = 0; i < files.size(); i++)
+    releaseNodeFile(files[i]);
+}
+
+
+void MegaTree::prefetch(const std::vector<double>& lo, const std::vector<double>& hi, double resolution)
+{
+  PrefetchRegion region;
+  for (unsigned k = 0; k < 3; k++)
+  {
+    region.mid[k] = (hi[k] + lo[k]) / 2;
+    region.size[k] = hi[k] - lo[k];
+  }
+  region.resolution = resolution;
+
+  prefetchRegionFiles(std::vector<IdType>(1, getFileId(IdType(1L))), region);
+}
+
+
+void MegaTree::waitForPrefetches()
+{
+  boost::mutex::scoped_lock lock(background_mutex);
+  while (true)
+  {
+    if (prefetches_in_flight > 0)
+      prefetch_done.wait(lock);
+    else if (reads_in_flight > 0)
+      read_done.wait(lock);
+    else
+      return;
+  }
+}
+
+
+void MegaTree::prefetchRegionFiles(const std::vector<IdType>& file_ids, const PrefetchRegion& region)
+{
+  uint64_t used_bytes = usedCacheBytes();
+  if (file_ids.empty() || used_bytes > cacheBudget(used_bytes) * EVICTION_HIGH_WATERMARK)
+    return;
+
+  std::vector<NodeFile*> files;
+  getNodeFiles(file_ids, files, true);
+  {
+    boost::mutex::scoped_lock lock(background_mutex);
+    prefetches_in_flight += files.size();
+  }
+  for (size_t i = 0; i < files.size(); i++)
+    files[i]->whenLoaded(boost::bind(&MegaTree::prefetchRegionCb, this, file_ids[i], files[i], region));
+}
 
-      file->addUser();  // make sure file cannot get deleted in cache maintenance
 
-      // Now that the write pointer is definitely elsewhere, moves
-      // this file to the front on the LRU cache.
-      file_cache.move_to_front(it);
+void MegaTree::prefetchRegionCb(const IdType& file_id, NodeFile* node_file, const PrefetchRegion& region)
+{
+  std::vector<IdType> child_file_ids;
+  {
+    boost::mutex::scoped_lock file_lock(node_file->mutex);
+    for (uint8_t child = 0; child < 8; child++)
+    {
+      if (!node_file->hasChildFile(child))
+        continue;
+
+      // The root file has a single child file
+      IdType child_file_id = file_id.isRootFile() ? IdType(1L) : file_id.getChild(child);
+      if (child_file_id.getChildNr() != child)
+        continue;
+
+      // A query reads the nodes of a file when it expands their parents,
+      // which are one level above the file's nodes.
+      NodeGeometry geometry = getNodeGeometry(child_file_id);
+      if (ldexp(geometry.getSize(), 1 - (int)subtree_width) <= region.resolution)
+        continue;
+
+      bool outside = false;
+      for (unsigned k = 0; k < 3; k++)
+        outside = outside ||
+          geometry.getHi(k) <= region.mid[k] - region.size[k] / 2 ||
+          geometry.getLo(k) >= region.mid[k] + region.size[k] / 2;
+      if (!outside)
+        child_file_ids.push_back(child_file_id);
     }
+    node_file->removeUser();
   }
+  prefetchRegionFiles(child_file_ids, region);
 
+  boost::mutex::scoped_lock lock(background_mutex);
+  prefetches_in_flight--;
+  if (prefetches_in_flight == 0)
+    prefetch_done.notify_all();
+}
 
-  // The file wasn't found in the cache, so we load it from storage.
-  if (!file)
+
+void MegaTree::prefetchGrandchildFiles(const NodeHandle& parent, NodeHandle* children)
+{
+  // The grandchildren are in the file of the children, unless they start
+  // a new level of files.
+  IdType first_child_id = parent.getId().getChild(0);
+  if (getFileId(first_child_id.getChild(0)) == getFileId(first_child_id))
+    return;
+
+  std::vector<IdType> file_ids;
+  for (unsigned i = 0; i < 8; i++)
   {
-    // get file path
-    std::string relative_path, filename;
-    file_id.toPath(subfolder_depth, relative_path, filename);
-    boost::filesystem::path path = boost::filesystem::path(relative_path) / filename;
+    if (!children[i].isValid())
+      continue;
+    for (uint8_t j = 0; j < 8; j++)
+    {
+      if (!children[i].hasChild(j))
+        continue;
+      IdType file_id = getFileId(children[i].getId().getChild(j));
+      if (std::find(file_ids.begin(), file_ids.end(), file_id) == file_ids.end())
+        file_ids.push_back(file_id);
+    }
+  }
+  prefetch(file_ids);
+}
 
-    // create new nodefile
-    file = new NodeFile(path, node_allocator);
-    file->addUser();  // make sure file cannot get deleted in cache maintenance
 
-    // Async request to read the nodefile
-    storage->getAsync(path, boost::bind(&MegaTree::readNodeFileCb, this, file, _1));
+// Whether storage holds the file as it is in the cache
+static bool isStored(NodeFile* node_file, bool read_only)
+{
+  if (read_only)
+    return node_file->getNodeState() == LOADED;
+  boost::mutex::scoped_lock file_lock(node_file->mutex);
+  return node_file->getNodeState() == LOADED && !node_file->isModified();
+}
+
 
-    // add nodefile to cache
+static bool lowerLevel(const IdType& id1, const IdType& id2)
+{
+  return id1.level() < id2.level();
+}
+
+
+void MegaTree::saveWorkingSet()
+{
+  // The files of the shards take turns, as the shards don't know how
+  // their files rank against the files of the other shards.
+  std::vector<IdType> file_ids;
+  std::vector<IdType> shard_file_ids[FILE_CACHE_SHARDS];
+  size_t max_shard_files = 0;
+  for (unsigned i = 0; i < FILE_CACHE_SHARDS; i++)
+  {
+    FileCacheShard& shard = file_cache_shards[i];
+    boost::mutex::scoped_lock lock(shard.mutex);
+    for (PinnedFiles::iterator it = shard.pinned_files.begin(); it != shard.pinned_files.end(); it++)
+      if (isStored(it->second, read_only))
+        file_ids.push_back(it->first);
+    for (CacheIterator<IdType, NodeFile> it = shard.file_cache.iterate(); !it.finished(); it.next())
+      if (isStored(it.get(), read_only))
+        shard_file_ids[i].push_back(it.id());
+    max_shard_files = std::max(max_shard_files, shard_file_ids[i].size());
+  }
+  std::stable_sort(file_ids.begin(), file_ids.end(), lowerLevel);
+  for (size_t j = 0; j < max_shard_files; j++)
+    for (unsigned i = 0; i < FILE_CACHE_SHARDS; i++)
+      if (j < shard_file_ids[i].size())
+        file_ids.push_back(shard_file_ids[i][j]);
+
+  // One id per line
+  ByteVec data;
+  for (size_t i = 0; i < file_ids.size(); i++)
+  {
+    std::string id = file_ids[i].toString();
+    data.insert(data.end(), id.begin(), id.end());
+    data.push_back('\n');
+  }
+  storage->put("working_set.txt", data);
+  printf("Saved a working set of %zu node files\n", file_ids.size());
+}
+
+
+void MegaTree::warmCache()
+{
+  // Trees that never saved a working set start cold
+  if (!storage->exists("working_set.txt"))
+    return;
+
+  {
+    boost::mutex::scoped_lock lock(background_mutex);
+    prefetches_in_flight++;
+  }
+  storage->getAsync("working_set.txt", boost::bind(&MegaTree::readWorkingSetCb, this, _1));
+}
+
+
+void MegaTree::readWorkingSetCb(const ByteVec& data)
+{
+  // The ids start with a 0, followed by the children down the tree
+  boost::shared_ptr<WorkingSet> working_set(new WorkingSet);
+  IdType file_id;
+  bool in_id = false;
+  for (size_t i = 0; i < data.size(); i++)
+  {
+    if (data[i] == '\n')
+    {
+      if (in_id)
+        working_set->file_ids.push_back(file_id);
+      file_id = IdType();
+      in_id = false;
+    }
+    else if (data[i] < '0' || data[i] > '7')
     {
-      boost::mutex::scoped_lock lock(file_cache_mutex);
-      file_cache.push_front(file_id, file);
+      fprintf(stderr, "The working set of the tree is corrupt, not loading it\n");
+      working_set->file_ids.clear();
+      break;
     }
-    count_miss++;
+    else if (in_id)
+      file_id = file_id.getChild(data[i] - '0');
+    else
+      in_id = true;
   }
+  warmWorkingSet(working_set);
+}
 
-  return file;
+
+void MegaTree::warmWorkingSet(boost::shared_ptr<WorkingSet> working_set)
+{
+  while (working_set->next < working_set->file_ids.size())
+  {
+    uint64_t used_bytes = usedCacheBytes();
+    if (used_bytes > cacheBudget(used_bytes) * EVICTION_HIGH_WATERMARK)
+      break;
+    {
+      boost::mutex::scoped_lock lock(background_mutex);
+      if (stop_warm_up)
+        break;
+    }
+
+    size_t end = std::min(working_set->next + WORKING_SET_BATCH, working_set->file_ids.size());
+    std::vector<IdType> file_ids(working_set->file_ids.begin() + working_set->next,
+                                 working_set->file_ids.begin() + end);
+    working_set->next = end;
+
+    // The batch holds on to one more file than it loads, until all
+    // callbacks are registered.  The last file of the batch to get
+    // loaded goes on with the next batch.
+    std::vector<NodeFile*> files;
+    getNodeFiles(file_ids, files, true);
+    {
+      boost::mutex::scoped_lock lock(background_mutex);
+      working_set->loading = files.size() + 1;
+    }
+    for (size_t i = 0; i < files.size(); i++)
+      files[i]->whenLoaded(boost::bind(&MegaTree::workingSetFileCb, this, files[i], working_set));
+    if (!finishWorkingSetFile(working_set))
+      return;
+  }
+
+  boost::mutex::scoped_lock lock(background_mutex);
+  prefetches_in_flight--;
+  if (prefetches_in_flight == 0)
+    prefetch_done.notify_all();
+}
+
+
+void MegaTree::workingSetFileCb(NodeFile* node_file, boost::shared_ptr<WorkingSet> working_set)
+{
+  {
+    boost::mutex::scoped_lock file_lock(node_file->mutex);
+    node_file->removeUser();
+  }
+  if (finishWorkingSetFile(working_set))
+    warmWorkingSet(working_set);
+}
+
+
+bool MegaTree::finishWorkingSetFile(boost::shared_ptr<WorkingSet> working_set)
+{
+  boost::mutex::scoped_lock lock(background_mutex);
+  working_set->loading--;
+  return working_set->loading == 0;
+}
+
+
+NodeGeometry MegaTree::getNodeGeometry(const IdType& node_id)
+{
+  std::vector<uint8_t> path;
+  for (IdType id = node_id; !id.isRoot(); id = id.getParent())
+    path.push_back(id.getChildNr());
+
+  NodeGeometry geometry = root_geometry;
+  for (size_t i = path.size(); i > 0; i--)
+    geometry = geometry.getChild(path[i - 1]);
+  return geometry;
 }
 
 
-// Allow the node file to get deleted in cache maintenance
+// Allow the node file to get deleted in cache maintenance.  Read-only
+// trees only drop the atomic count of users, like releaseNode().
 void MegaTree::releaseNodeFile(NodeFile*& node_file)
 {
+  if (read_only)
+  {
+    node_file->removeUser();
+    return;
+  }
   boost::mutex::scoped_lock lock(node_file->mutex);
   node_file->removeUser();
 }
@@ -357,18 +879,29 @@ void MegaTree::createChildNode(NodeHandle& parent_node, uint8_t child, NodeHandl
   parent_node_file->waitUntilLoaded();
   assert(parent_node_file->getNodeState() == LOADED);
 
-  // Checks if the child file exists, without going to disk
+  // Checks if the child file exists, without going to disk.  Threads
+  // that add points under other nodes of the parent file may create
+  // child files at the same time, so the bits are read and set under
+  // the lock of the parent file.
   uint8_t which_child_file = child_file_id.getChildNr();
-  if (child_file_id.isRootFile() || parent_node_file->hasChildFile(which_child_file))
+  bool has_child_file = child_file_id.isRootFile();
+  if (!has_child_file)
+  {
+    boost::mutex::scoped_lock lock(parent_node_file->mutex);
+    has_child_file = parent_node_file->hasChildFile(which_child_file);
+  }
+  if (has_child_file)
   {
     child_file = getNodeFile(child_file_id);
     child_file->waitUntilLoaded();  // always blocking for creating nodes
   }
   else
   {
-    // Fast creation for non-existant node files.
+    // Fast creation for non-existant node files.  When another thread
+    // created the file in the meantime, this returns that file.
     child_file = createNodeFile(child_file_id);
     // tell parent file it has a new child file
+    boost::mutex::scoped_lock lock(parent_node_file->mutex);
     parent_node_file->setChildFile(which_child_file);
   }
   releaseNodeFile(parent_node_file);
@@ -376,15 +909,46 @@ void MegaTree::createChildNode(NodeHandle& parent_node, uint8_t child, NodeHandl
   // tell parent node it has a new child node
   parent_node.setChild(child);
 
-  // create new node and node handle
-  Node* child_node = child_file->createNode(getShortId(child_id));
+  // create new node and node handle.  Other threads may create nodes
+  // in the same file.
+  Node* child_node;
+  int64_t bytes;
+  int nodes;
+  {
+    boost::mutex::scoped_lock lock(child_file->mutex);
+    child_node = child_file->createNode(getShortId(child_id));
+    child_file->takeCacheDelta(bytes, nodes);
+  }
   child_node_handle.initialize(child_node, child_id, child_file, child_geometry);
-
-  current_cache_size++;
+  accountNodeFile(fileCacheShard(child_file_id), bytes, nodes);
 
   releaseNodeFile(child_file);  // we have a Node from this file, so unlock file
 }
 
+Node* MegaTree::readFileNode(NodeFile* file, const IdType& node_id, NodeHandle& handle)
+{
+  if (read_only && file->getNodeState() == LOADED)
+    return file->readNodeShared(getShortId(node_id), handle.localNode());
+
+  Node* node = NULL;
+  int64_t bytes;
+  int nodes;
+  {
+    boost::mutex::scoped_lock lock(file->mutex);
+
+    // The file doesn't change state while it is locked, but it may have
+    // gotten loaded in the meantime.  Once it is, shared reads must not
+    // add nodes to its node cache.
+    if (read_only && file->getNodeState() == LOADED)
+      return file->readNodeShared(getShortId(node_id), handle.localNode());
+    node = file->readNode(getShortId(node_id));
+    file->takeCacheDelta(bytes, nodes);  // nodes of lazily loaded files get decoded
+  }
+  accountNodeFile(fileCacheShard(getFileId(node_id)), bytes, nodes);
+  return node;
+}
+
+
 NodeHandle* MegaTree::getChildNode(const NodeHandle& parent_node, uint8_t child)
 {
   NodeHandle* nh = new NodeHandle;
@@ -404,12 +968,7 @@ void MegaTree::getChildNode(const NodeHandle& parent_node, uint8_t child, NodeHa
   // retrieve the child from the nodefile
   NodeFile* child_file = getNodeFile(child_file_id);
 
-  // unlock file after we got a node from the file
-  Node* child_node = NULL;
-  {
-    boost::mutex::scoped_lock lock(child_file->mutex);
-    child_node = child_file->readNode(getShortId(child_id));
-  }
+  Node* child_node = readFileNode(child_file, child_id, child_node_handle);
   child_node_handle.initialize(child_node, child_id, child_file, child_geometry);
 
   // DEBUGGING CODE
@@ -436,6 +995,11 @@ void MegaTree::releaseNode(NodeHandle& node_handle)
   {
     fprintf(stderr, "Trying to release a node_handle that doesn't have a node\n");
   }
+  else if (read_only && !node_handle.isModified())
+  {
+    // Nothing changed, so only the atomic count of users goes down
+    node_handle.getNodeFile()->removeUser();
+  }
   else
   {
 
@@ -454,122 +1018,607 @@ void MegaTree::releaseNode(NodeHandle& node_handle)
 
 void MegaTree::flushCache()
 {
-  boost::mutex::scoped_lock lock(file_cache_mutex);
   boost::condition condition;
   boost::mutex mutex;
 
   // iterate over all files, and write data
-  printf("Flushing %d files...\n", (int)file_cache.size());
+  printf("Flushing %d files...\n", (int)getCacheStats().num_files);
   unsigned remaining = 0;
-  for (CacheIterator<IdType, NodeFile> file_it = file_cache.iterate(); !file_it.finished(); file_it.next())
+  for (unsigned i = 0; i < FILE_CACHE_SHARDS; i++)
   {
-    //The file needs to be locked when it is written
-    boost::mutex::scoped_lock file_lock(file_it.get()->mutex);
-
-    if (file_it.get()->getNodeState() != LOADING && file_it.get()->isModified())
+    // Picks the files to write.  They are kept in use, so they stay in
+    // the cache after the shard is unlocked.  The files are clean from
+    // now on, so changes that come in while they are being written make
+    // them modified again.  Like the writes of the eviction thread, the
+    // writes count against the generation they start in, so a
+    // checkpoint that no longer sees the files as modified waits for them.
+    FileCacheShard& shard = file_cache_shards[i];
+    std::vector<NodeFile*> write_list;
+    std::vector<ByteVec> write_data;
+    unsigned generation;
     {
-      if (read_only)
+      boost::mutex::scoped_lock lock(shard.mutex);
+      generation = write_generation;
+      std::vector<NodeFile*> files;
+      for (CacheIterator<IdType, NodeFile> file_it = shard.file_cache.iterate(); !file_it.finished(); file_it.next())
+        files.push_back(file_it.get());
+      for (PinnedFiles::iterator pinned_it = shard.pinned_files.begin(); pinned_it != shard.pinned_files.end(); pinned_it++)
+        files.push_back(pinned_it->second);
+
+      for (size_t j = 0; j < files.size(); j++)
       {
-        fprintf(stderr, "You are trying to write node files of a read-only tree\n");
-        abort();
-      }
+        boost::mutex::scoped_lock file_lock(files[j]->mutex);
 
-      {
-        boost::mutex::scoped_lock remaining_lock(mutex);
-        remaining++;
+        // Files that are being evicted are already being written
+        if (files[j]->getNodeState() == LOADED && files[j]->isModified())
+        {
+          if (read_only)
+          {
+            fprintf(stderr, "You are trying to write node files of a read-only tree\n");
+            abort();
+          }
+          write_data.push_back(ByteVec());
+          files[j]->serialize(write_data.back());
+          files[j]->setWritten();
+          files[j]->addUser();
+          write_list.push_back(files[j]);
+          shard.write_bytes += write_data.back().size();
+          __sync_fetch_and_add(&writes_in_flight[generation], 1);
+        }
       }
+    }
 
-      // get data to write
-      ByteVec byte_data;
-      file_it.get()->serialize(byte_data);
-
-      // start asynchronous writing
-      storage->putAsync(file_it.get()->getPath(), byte_data,
-                        boost::bind(&MegaTree::flushNodeFileCb, this, file_it, boost::ref(mutex), boost::ref(condition), boost::ref(remaining)));
+    {
+      boost::mutex::scoped_lock remaining_lock(mutex);
+      remaining += write_list.size();
     }
+
+    // start asynchronous writing
+    for (size_t j = 0; j < write_list.size(); j++)
+      storage->putAsync(write_list[j]->getPath(), write_data[j],
+                        boost::bind(&MegaTree::flushNodeFileCb, this, &shard, write_list[j],
+                                    (uint64_t)write_data[j].size(), generation,
+                                    boost::ref(mutex), boost::ref(condition), boost::ref(remaining)));
   }
 
   // wait for async writing to finish
-  boost::mutex::scoped_lock remaining_lock(mutex);
-  if (remaining > 0)
-    condition.wait(remaining_lock);
+  {
+    boost::mutex::scoped_lock remaining_lock(mutex);
+    while (remaining > 0)
+      condition.wait(remaining_lock);
+  }
+
+  // and for the files that evictions and the eviction thread are writing
+  {
+    boost::mutex::scoped_lock lock(background_mutex);
+    while (writes_in_flight[0] + writes_in_flight[1] > 0)
+      write_done.wait(lock);
+  }
+
+  printf("Finished flushing %d files\n", (int)getCacheStats().num_files);
+}
+
+
+
+unsigned MegaTree::checkpoint(const CheckpointCallback& callback)
+{
+  if (read_only)
+  {
+    fprintf(stderr, "You are trying to checkpoint a read-only tree\n");
+    abort();
+  }
+
+  unsigned checkpoint_id;
+  {
+    boost::mutex::scoped_lock lock(background_mutex);
+    while (checkpoints_landed != checkpoints_started)
+      checkpoint_done.wait(lock);
+    checkpoint_id = ++checkpoints_started;
+    checkpoint_callback = callback;
+    checkpoint_scanning = true;
+  }
+
+  // Picks the modified files while all shards are locked, so no node
+  // gets used in the meantime.  The files are only marked here, and
+  // kept in use until they are written.
+  std::vector<std::pair<IdType, NodeFile*> > files;
+  for (unsigned i = 0; i < FILE_CACHE_SHARDS; i++)
+    file_cache_shards[i].mutex.lock();
+  for (unsigned i = 0; i < FILE_CACHE_SHARDS; i++)
+  {
+    FileCacheShard& shard = file_cache_shards[i];
+    for (CacheIterator<IdType, NodeFile> it = shard.file_cache.iterate(); !it.finished(); it.next())
+      files.push_back(std::make_pair(it.id(), it.get()));
+    for (PinnedFiles::iterator it = shard.pinned_files.begin(); it != shard.pinned_files.end(); it++)
+      files.push_back(*it);
+  }
+  size_t num_files = 0;
+  for (size_t i = 0; i < files.size(); i++)
+  {
+    NodeFile* file = files[i].second;
+    boost::mutex::scoped_lock file_lock(file->mutex);
+
+    // Files that are being evicted are already being written
+    if (file->getNodeState() == LOADED && file->isModified())
+    {
+      file->setCheckpointPending(true);
+      file->addUser();
+      files[num_files++] = files[i];
+    }
+  }
+  files.resize(num_files);
+
+  // The writes that evictions started until now are part of the checkpoint
+  checkpoint_generation = write_generation;
+  write_generation = 1 - write_generation;
+  for (unsigned i = 0; i < FILE_CACHE_SHARDS; i++)
+    file_cache_shards[i].mutex.unlock();
+
+  printf("Checkpoint %u writes %d files\n", checkpoint_id, (int)files.size());
+  {
+    boost::mutex::scoped_lock lock(background_mutex);
+    checkpoint_queue.swap(files);
+    checkpoint_files += num_files;
+    checkpoint_scanning = false;
+  }
+  for (unsigned i = 0; i < CHECKPOINT_WRITES && i < num_files; i++)
+    writeNextCheckpointFile();
+  checkCheckpoint();
+  return checkpoint_id;
+}
+
+
+bool MegaTree::checkpointLanded(unsigned checkpoint_id)
+{
+  boost::mutex::scoped_lock lock(background_mutex);
+  return checkpoints_landed >= checkpoint_id;
+}
+
+
+void MegaTree::waitForCheckpoint(unsigned checkpoint_id)
+{
+  boost::mutex::scoped_lock lock(background_mutex);
+  while (checkpoints_landed < checkpoint_id)
+    checkpoint_done.wait(lock);
+}
+
+
+bool MegaTree::writeCheckpointFile(const IdType& file_id, NodeFile* node_file)
+{
+  ByteVec data;
+  {
+    boost::mutex::scoped_lock file_lock(node_file->mutex);
+    if (!node_file->checkpointPending())
+      return false;
+    node_file->setCheckpointPending(false);
+    node_file->serialize(data);
+    node_file->setWritten();
+  }
+
+  FileCacheShard& shard = fileCacheShard(file_id);
+  {
+    boost::mutex::scoped_lock lock(shard.mutex);
+    shard.write_bytes += data.size();
+  }
+  {
+    boost::mutex::scoped_lock lock(background_mutex);
+    checkpoint_writes++;
+  }
+  storage->putAsync(node_file->getPath(), data,
+                    boost::bind(&MegaTree::checkpointFileCb, this, &shard, node_file, (uint64_t)data.size()));
+  return true;
+}
+
 
-  printf("Finished flushing %d files\n", (int)file_cache.size());
+// Keeps CHECKPOINT_WRITES files of the checkpoint on their way to
+// storage: every write that finishes starts the next one.
+void MegaTree::writeNextCheckpointFile()
+{
+  while (true)
+  {
+    std::pair<IdType, NodeFile*> file;
+    {
+      boost::mutex::scoped_lock lock(background_mutex);
+      if (checkpoint_queue.empty())
+        return;
+      file = checkpoint_queue.back();
+      checkpoint_queue.pop_back();
+    }
+
+    // Files that got used were written already
+    if (writeCheckpointFile(file.first, file.second))
+      return;
+  }
+}
+
+
+void MegaTree::checkpointFileCb(FileCacheShard* shard, NodeFile* node_file, uint64_t write_bytes)
+{
+  {
+    boost::mutex::scoped_lock file_lock(node_file->mutex);
+    node_file->removeUser();
+    __sync_fetch_and_add(&count_file_write, 1);
+  }
+  {
+    boost::mutex::scoped_lock lock(shard->mutex);
+    shard->write_bytes -= write_bytes;
+  }
+  {
+    boost::mutex::scoped_lock lock(background_mutex);
+    checkpoint_files--;
+  }
+  writeNextCheckpointFile();
+  checkCheckpoint();
+
+  // The destructor may be done with the tree as soon as the lock is
+  // released.
+  boost::mutex::scoped_lock lock(background_mutex);
+  checkpoint_writes--;
+  write_done.notify_all();
+}
+
+
+void MegaTree::finishWrite(unsigned generation)
+{
+  bool checkpoint_running;
+  {
+    boost::mutex::scoped_lock lock(background_mutex);
+    __sync_fetch_and_sub(&writes_in_flight[generation], 1);
+    checkpoint_running = checkpoints_landed != checkpoints_started;
+    write_done.notify_all();
+  }
+
+  // Without a checkpoint to land, the destructor may be done with the
+  // tree as soon as the lock is released.
+  if (checkpoint_running)
+    checkCheckpoint();
+}
+
+
+void MegaTree::checkCheckpoint()
+{
+  CheckpointCallback callback;
+  unsigned checkpoint_id;
+  {
+    boost::mutex::scoped_lock lock(background_mutex);
+    if (checkpoints_landed == checkpoints_started || checkpoint_scanning || checkpoint_landing ||
+        checkpoint_files > 0 || writes_in_flight[checkpoint_generation] > 0)
+      return;
+    checkpoint_id = checkpoints_started;
+    checkpoint_landing = true;
+    callback.swap(checkpoint_callback);
+  }
+
+  // The checkpoint lands once its callback returned, so the tree isn't
+  // destructed while it runs.
+  if (callback)
+    callback(checkpoint_id);
+
+  boost::mutex::scoped_lock lock(background_mutex);
+  checkpoints_landed = checkpoint_id;
+  checkpoint_landing = false;
+  checkpoint_done.notify_all();
 }
 
 
 
+// The memory that counts against the budget: files being evicted are
+// already on their way out.
+uint64_t MegaTree::usedCacheBytes()
+{
+  uint64_t used_bytes = 0;
+  for (unsigned i = 0; i < FILE_CACHE_SHARDS; i++)
+  {
+    FileCacheShard& shard = file_cache_shards[i];
+    boost::mutex::scoped_lock lock(shard.mutex);
+    used_bytes += shard.cache_bytes - shard.evicting_bytes + shard.write_bytes +
+      (shard.file_cache.size() + shard.pinned_files.size()) * CACHE_ENTRY_BYTES;
+  }
+  return used_bytes;
+}
+
+
 //manage the cache
-void MegaTree::cacheMaintenance()
+void MegaTree::cacheMaintenance(bool may_block)
+{
+  uint64_t used_bytes = usedCacheBytes();
+  uint64_t budget = cacheBudget(used_bytes, true);
+  if (used_bytes <= budget * EVICTION_HIGH_WATERMARK)
+    return;
+
+  // Over the budget, clean files can go right away, unless another
+  // thread is evicting already.
+  if (used_bytes > budget)
+  {
+    boost::mutex::scoped_try_lock eviction_lock(eviction_mutex);
+    if (eviction_lock)
+      evictBytes(used_bytes - budget, true);
+  }
+
+  {
+    boost::mutex::scoped_lock lock(background_mutex);
+    eviction_requested = true;
+    eviction_wakeup.notify_one();
+  }
+  if (!may_block)
+    return;
+
+  // Waits for the eviction thread to get rid of modified files.  The
+  // part of a shared cache the tree gets changes, so it is looked up
+  // again every time.
+  used_bytes = usedCacheBytes();
+  budget = cacheBudget(used_bytes);
+  while (used_bytes > budget)
+  {
+    boost::mutex::scoped_lock lock(background_mutex);
+    eviction_requested = true;
+    eviction_stuck = false;
+    eviction_wakeup.notify_one();
+    eviction_done.wait(lock);
+    if (eviction_stuck)
+      break;
+    lock.unlock();
+
+    used_bytes = usedCacheBytes();
+    budget = cacheBudget(used_bytes);
+  }
+}
+
+
+uint64_t MegaTree::cacheBudget(uint64_t used_bytes, bool evict_others)
+{
+  if (!shared_cache)
+    return max_cache_size;
+  return shared_cache->treeBudget(this, used_bytes, evict_others);
+}
+
+
+void MegaTree::requestEviction()
+{
+  boost::mutex::scoped_lock lock(background_mutex);
+  eviction_requested = true;
+  eviction_wakeup.notify_one();
+}
+
+
+// Evicts files from all shards.  Returns the number of bytes evicted.
+// Lock eviction_mutex before calling.
+int64_t MegaTree::evictBytes(int64_t bytes_to_evict, bool clean_only)
+{
+  int64_t shard_bytes[FILE_CACHE_SHARDS];
+  int64_t cache_bytes = 0;
+  for (unsigned i = 0; i < FILE_CACHE_SHARDS; i++)
+  {
+    FileCacheShard& shard = file_cache_shards[i];
+    boost::mutex::scoped_lock lock(shard.mutex);
+    shard_bytes[i] = shard.cache_bytes - shard.evicting_bytes +
+      (shard.file_cache.size() + shard.pinned_files.size()) * CACHE_ENTRY_BYTES;
+    cache_bytes += shard_bytes[i];
+  }
+
+  // Every shard evicts in its own eviction order, in proportion to its
+  // size, which approximates one eviction order over the whole cache.
+  // The second pass takes whatever is still needed from any shard.
+  int64_t bytes_evicted = 0;
+  for (unsigned pass = 0; pass < 2 && bytes_evicted < bytes_to_evict; pass++)
+  {
+    for (unsigned i = 0; i < FILE_CACHE_SHARDS && bytes_evicted < bytes_to_evict; i++)
+    {
+      unsigned s = (eviction_shard + i) % FILE_CACHE_SHARDS;
+      int64_t share = bytes_to_evict - bytes_evicted;
+      if (pass == 0 && cache_bytes > 0)
+        share = std::min<int64_t>(share, (int64_t)((double)bytes_to_evict * shard_bytes[s] / cache_bytes) + 1);
+      bytes_evicted += evictFromShard(file_cache_shards[s], share, clean_only);
+    }
+  }
+  eviction_shard = (eviction_shard + 1) % FILE_CACHE_SHARDS;
+  return bytes_evicted;
+}
+
+
+void MegaTree::evictionThread()
+{
+  boost::mutex::scoped_lock lock(background_mutex);
+  while (!stop_eviction)
+  {
+    if (!eviction_requested)
+    {
+      eviction_wakeup.wait(lock);
+      continue;
+    }
+    eviction_requested = false;
+    eviction_running = true;
+    lock.unlock();
+
+    int64_t bytes_evicted = 0;
+    uint64_t used_bytes = usedCacheBytes();
+    uint64_t budget = cacheBudget(used_bytes);
+    int64_t bytes_to_evict = (int64_t)used_bytes - (int64_t)(budget * EVICTION_LOW_WATERMARK);
+    if (bytes_to_evict > 0)
+    {
+      boost::mutex::scoped_lock eviction_lock(eviction_mutex);
+      bytes_evicted = evictBytes(bytes_to_evict, false);
+    }
+
+    // Gets the files that are up for eviction next ready to be dropped
+    if (!read_only)
+      writeBack((int64_t)(budget * (EVICTION_HIGH_WATERMARK - EVICTION_LOW_WATERMARK)));
+    used_bytes = usedCacheBytes();
+    bool stuck = bytes_evicted == 0 && used_bytes > budget;
+    cacheBudget(used_bytes);  // reports what is left
+
+    lock.lock();
+    eviction_stuck = stuck;
+    eviction_running = false;
+    eviction_done.notify_all();
+  }
+}
+
+
+void MegaTree::waitForEviction()
+{
+  // Files grow as nodes are added to them, which doesn't look at the
+  // cache, so it may be over the watermark without an eviction requested
+  cacheMaintenance(false);
+
+  boost::mutex::scoped_lock lock(background_mutex);
+  while (true)
+  {
+    if (eviction_requested || eviction_running)
+      eviction_done.wait(lock);
+    else if (writes_in_flight[0] + writes_in_flight[1] > 0)
+      write_done.wait(lock);
+    else
+      return;
+  }
+}
+
+
+void MegaTree::writeBack(int64_t bytes_to_scan)
+{
+  int64_t shard_bytes[FILE_CACHE_SHARDS];
+  int64_t cache_bytes = 0;
+  for (unsigned i = 0; i < FILE_CACHE_SHARDS; i++)
+  {
+    FileCacheShard& shard = file_cache_shards[i];
+    boost::mutex::scoped_lock lock(shard.mutex);
+    shard_bytes[i] = shard.cache_bytes - shard.evicting_bytes;
+    cache_bytes += shard_bytes[i];
+  }
+  if (cache_bytes <= 0)
+    return;
+
+  for (unsigned i = 0; i < FILE_CACHE_SHARDS; i++)
+    writeBackShard(file_cache_shards[i], (int64_t)((double)bytes_to_scan * shard_bytes[i] / cache_bytes) + 1);
+}
+
+
+// Writes the modified files among the first "bytes_to_scan" bytes in
+// the eviction order of one shard.  The files are marked as written
+// right away, and are kept in use until they are written, so they
+// don't get evicted and reloaded before storage has them.
+void MegaTree::writeBackShard(FileCacheShard& shard, int64_t bytes_to_scan)
 {
+  std::vector<NodeFile*> write_list;
+  std::vector<ByteVec> write_data;
+  unsigned generation;
+
+  {
+    boost::mutex::scoped_lock lock(shard.mutex);
+    generation = write_generation;
+    int64_t bytes_scanned = 0;
+    for (Cache<IdType, NodeFile>::iterator it = shard.file_cache.iterateVictims();
+         !it.finished() && bytes_scanned < bytes_to_scan; it.previous())
+    {
+      boost::mutex::scoped_try_lock file_lock(it.get()->mutex);
+      if (!file_lock)
+        continue;
+      bytes_scanned += it.get()->accountedBytes() + CACHE_ENTRY_BYTES;
+      if (it.get()->getNodeState() != LOADED || it.get()->users() > 0 || !it.get()->isModified())
+        continue;
+
+      write_data.push_back(ByteVec());
+      it.get()->serialize(write_data.back());
+      it.get()->setWritten();
+      it.get()->addUser();
+      write_list.push_back(it.get());
+      shard.write_bytes += write_data.back().size();
+      __sync_fetch_and_add(&writes_in_flight[generation], 1);
+    }
+  }
+  for (size_t i = 0; i < write_list.size(); i++)
+    storage->putAsync(write_list[i]->getPath(), write_data[i],
+                      boost::bind(&MegaTree::writeBackNodeFileCb, this, &shard, write_list[i],
+                                  (uint64_t)write_data[i].size(), generation));
+}
+
+
+// Evicts files in the eviction order of one shard, until
+// "bytes_to_evict" bytes are freed or being written.  With "clean_only",
+// modified files are skipped.  Returns the number of bytes evicted.
+int64_t MegaTree::evictFromShard(FileCacheShard& shard, int64_t bytes_to_evict, bool clean_only)
+{
+  int64_t bytes_evicted = 0;
+  std::vector<NodeFile*> delete_list;
+
   //A list of node files that we want to be written
   std::vector<CacheIterator<IdType, NodeFile> > write_list;
+  std::vector<ByteVec> write_data;
+  std::vector<uint64_t> evicting_bytes;
+  unsigned generation;
 
   {
-    // Locks the file cache
-    boost::mutex::scoped_lock lock(file_cache_mutex);
+    // Locks the shard of the file cache
+    boost::mutex::scoped_lock lock(shard.mutex);
+    generation = write_generation;
 
-    // Starts evicting at the back of the LRU cache.
-    Cache<IdType, NodeFile>::iterator it = file_cache.iterateBack();
-
-    // How many nodes we need to evict
-    int number_to_evict = current_cache_size - max_cache_size - current_write_size;
-    int number_evicted = 0;
+    // Starts evicting with the file the cache policy gives up first.
+    Cache<IdType, NodeFile>::iterator it = shard.file_cache.iterateVictims();
 
     //we want to remove nodes from the cache until we're under our overflow
-    while(!it.finished() && number_to_evict > number_evicted)
+    while(!it.finished() && bytes_to_evict > bytes_evicted)
     {
-      NodeFile* delete_file(NULL);
+      boost::mutex::scoped_try_lock file_lock(it.get()->mutex);
+      //if the file is unavailable for eviction, we'll just skip it
+      if(!file_lock || it.get()->getNodeState() != LOADED || it.get()->users() > 0 ||
+         (clean_only && it.get()->isModified()))
       {
-        boost::mutex::scoped_try_lock file_lock(it.get()->mutex);
-        //if the file is unavailable for eviction, we'll just skip it
-        if(!file_lock || it.get()->getNodeState() != LOADED || it.get()->users() > 0)
-        {
-          // skip file
-          it.previous();
-        }
-        else if(!it.get()->isModified())
+        // skip file
+        it.previous();
+      }
+      else if(shard.file_cache.spare(it))
+      {
+        // the cache policy gives the file a second chance
+      }
+      else if(!it.get()->isModified())
+      {
+        // immediately evict file
+        delete_list.push_back(it.get());  // postpone delete
+        shard.cache_bytes -= it.get()->accountedBytes();
+        shard.cache_size -= it.get()->accountedNodes();
+        bytes_evicted += it.get()->accountedBytes() + CACHE_ENTRY_BYTES;
+        Cache<IdType, NodeFile>::iterator evicted_it = it;
+        it.previous();
+        shard.file_cache.erase(evicted_it);
+      }
+      else
+      {
+        if (read_only)
         {
-          // immediately evict file
-          delete_file = it.get();  // postpone delete
-          current_cache_size -= it.get()->cacheSize();
-          number_evicted += it.get()->cacheSize();
-          Cache<IdType, NodeFile>::iterator evicted_it = it;
-          it.previous();
-          file_cache.erase(evicted_it);
+          fprintf(stderr, "You are trying to write node files of a read-only tree\n");
+          abort();
         }
-        else
-        {
-          if (read_only)
-          {
-            fprintf(stderr, "You are trying to write node files of a read-only tree\n");
-            abort();
-          }
 
-          // start evicting this file
-          it.get()->setNodeState(EVICTING);
-
-          // get data to write
-          ByteVec byte_data;
-          it.get()->serialize(byte_data);
-
-          // Start asynchronous writing
-          number_evicted += it.get()->cacheSize();
-          current_write_size += it.get()->cacheSize();
-          storage->putAsync(it.get()->getPath(), byte_data, boost::bind(&MegaTree::evictNodeFileCb, this, it));
-          it.previous();
-        }
+        // start evicting this file.  The file stays in the cache until
+        // it is written.
+        it.get()->setNodeState(EVICTING);
+
+        // get data to write
+        write_data.push_back(ByteVec());
+        it.get()->serialize(write_data.back());
+        write_list.push_back(it);
+
+        // The serialized file takes memory of its own until it is written
+        __sync_fetch_and_add(&writes_in_flight[generation], 1);
+        evicting_bytes.push_back(it.get()->accountedBytes() + CACHE_ENTRY_BYTES);
+        shard.evicting_bytes += evicting_bytes.back();
+        shard.write_bytes += write_data.back().size();
+        bytes_evicted += evicting_bytes.back();
+        it.previous();
       }
-      if (delete_file)
-        delete delete_file;
-    }
-
-    if(number_to_evict >= number_evicted && it.finished())
-    {
-      fprintf(stderr, "We are out of space in our cache but cannot evict any more\n");
-      abort();
     }
   }
+
+  // Start asynchronous writing, without holding up the shard
+  for (size_t i = 0; i < write_list.size(); i++)
+    storage->putAsync(write_list[i].get()->getPath(), write_data[i],
+                      boost::bind(&MegaTree::evictNodeFileCb, this, &shard, write_list[i],
+                                  evicting_bytes[i], (uint64_t)write_data[i].size(), generation));
+
+  for (size_t i = 0; i < delete_list.size(); i++)
+    delete delete_list[i];
+
+  return bytes_evicted;
 }
 
 
@@ -602,7 +1651,13 @@ void MegaTree::createRoot(NodeHandle &root_node_handle)
 
   root_node_handle.initialize(root_node, root_id, root_file, root_geometry);
 
-  current_cache_size++;
+  int64_t bytes;
+  int nodes;
+  {
+    boost::mutex::scoped_lock lock(root_file->mutex);
+    root_file->takeCacheDelta(bytes, nodes);
+  }
+  accountNodeFile(fileCacheShard(root_file_id), bytes, nodes);
   root_file->removeUser();
 }
 
@@ -616,12 +1671,7 @@ void MegaTree::getRoot(NodeHandle &root_node_handle)
   NodeFile* root_file = getNodeFile(root_file_id);
   root_file->waitUntilLoaded();    // always blocking
 
-  Node* root_node = NULL;
-  {
-    boost::mutex::scoped_lock lock(root_file->mutex);
-    root_node = root_file->readNode(getShortId(root_id));
-  }
-
+  Node* root_node = readFileNode(root_file, root_id, root_node_handle);
   root_node_handle.initialize(root_node, root_id, root_file, root_geometry);
   root_file->removeUser();
 }
@@ -635,27 +1685,44 @@ NodeHandle* MegaTree::getRoot()
 
 void MegaTree::dumpNodesInUse()
 {
-  boost::mutex::scoped_lock lock(file_cache_mutex);
-
   printf("Nodes in use:\n");
-  for (Cache<IdType, NodeFile>::ObjListIterator it(file_cache.list_.frontIterator()); !it.finished(); it.next())
+  for (unsigned i = 0; i < FILE_CACHE_SHARDS; i++)
   {
-    if (it.get().object->users() > 0) {
-      printf("    %3d %s\n", it.get().object->users(), it.get().id.toString().c_str());
+    FileCacheShard& shard = file_cache_shards[i];
+    boost::mutex::scoped_lock lock(shard.mutex);
+    for (CacheIterator<IdType, NodeFile> it = shard.file_cache.iterate(); !it.finished(); it.next())
+    {
+      if (it.get()->users() > 0) {
+        printf("    %3d %s\n", it.get()->users(), it.id().toString().c_str());
+      }
+    }
+    for (PinnedFiles::iterator it = shard.pinned_files.begin(); it != shard.pinned_files.end(); it++)
+    {
+      if (it->second->users() > 0) {
+        printf("    %3d %s (pinned)\n", it->second->users(), it->first.toString().c_str());
+      }
     }
   }
 }
 
 
 
-void MegaTree::flushNodeFileCb(CacheIterator<IdType, NodeFile> it, boost::mutex& mutex, boost::condition& condition, unsigned& remaining)
+void MegaTree::flushNodeFileCb(FileCacheShard* shard, NodeFile* node_file, uint64_t write_bytes, unsigned generation,
+                               boost::mutex& mutex, boost::condition& condition, unsigned& remaining)
 {
-  // Locks the node file
-  boost::mutex::scoped_lock file_lock(it.get()->mutex);
+  {
+    // Locks the node file
+    boost::mutex::scoped_lock file_lock(node_file->mutex);
 
-  // File is written
-  it.get()->setWritten();
-  count_file_write++;
+    // File is written, and may get evicted again
+    node_file->removeUser();
+    __sync_fetch_and_add(&count_file_write, 1);
+  }
+  {
+    boost::mutex::scoped_lock lock(shard->mutex);
+    shard->write_bytes -= write_bytes;
+  }
+  finishWrite(generation);
 
   // Locks the remaining count
   boost::mutex::scoped_lock lock(mutex);
@@ -666,12 +1733,35 @@ void MegaTree::flushNodeFileCb(CacheIterator<IdType, NodeFile> it, boost::mutex&
 
 
 
-void MegaTree::evictNodeFileCb(CacheIterator<IdType, NodeFile> it)
+void MegaTree::writeBackNodeFileCb(FileCacheShard* shard, NodeFile* node_file, uint64_t write_bytes,
+                                   unsigned generation)
+{
+  {
+    boost::mutex::scoped_lock file_lock(node_file->mutex);
+    node_file->removeUser();
+    __sync_fetch_and_add(&count_file_write, 1);
+  }
+  {
+    boost::mutex::scoped_lock lock(shard->mutex);
+    shard->write_bytes -= write_bytes;
+  }
+
+  // Evictions skip the file while it is being written, so they may have
+  // stopped short of the low watermark
+  cacheMaintenance(false);
+  finishWrite(generation);
+}
+
+
+
+void MegaTree::evictNodeFileCb(FileCacheShard* shard, CacheIterator<IdType, NodeFile> it,
+                               uint64_t evicting_bytes, uint64_t write_bytes, unsigned generation)
 {
   NodeFile* delete_file(NULL);
+  NodeFile* loaded_file(NULL);
   {
-    // Locks the cache
-    boost::mutex::scoped_lock lock(file_cache_mutex);
+    // Locks the shard of the cache
+    boost::mutex::scoped_lock lock(shard->mutex);
 
     // Locks the node file
     boost::mutex::scoped_lock file_lock(it.get()->mutex);
@@ -680,7 +1770,9 @@ void MegaTree::evictNodeFileCb(CacheIterator<IdType, NodeFile> it)
     // File is written
     assert(it.get()->isModified());
     it.get()->setWritten();
-    count_file_write++;
+    __sync_fetch_and_add(&count_file_write, 1);
+    shard->evicting_bytes -= evicting_bytes;
+    shard->write_bytes -= write_bytes;
 
 
     // File is no longer in use.  Removes it from the cache.
@@ -690,9 +1782,9 @@ void MegaTree::evictNodeFileCb(CacheIterator<IdType, NodeFile> it)
       delete_file = it.get();  // postpone delete
 
       // update file cache
-      current_cache_size -= it.get()->cacheSize();
-      current_write_size -= it.get()->cacheSize();
-      file_cache.erase(it);
+      shard->cache_bytes -= it.get()->accountedBytes();
+      shard->cache_size -= it.get()->accountedNodes();
+      shard->file_cache.erase(it);
     }
 
     // The file was requested again while we were writing it.  Returns the file to the loaded state.
@@ -700,28 +1792,75 @@ void MegaTree::evictNodeFileCb(CacheIterator<IdType, NodeFile> it)
     {
       assert(state == LOADING);
       it.get()->setNodeState(LOADED);
-
-      // update file cache
-      boost::mutex::scoped_lock lock(file_cache_mutex);
-      current_write_size -= it.get()->cacheSize();
+      it.get()->addUser();
+      loaded_file = it.get();
     }
   }
 
   if (delete_file)
     delete delete_file; // delete pointer outside of node file lock
+  if (loaded_file)
+    fileLoaded(loaded_file);
+  finishWrite(generation);
+}
+
+
+void MegaTree::fileLoaded(NodeFile* node_file)
+{
+  node_file->runLoadedCallbacks();
+  boost::mutex::scoped_lock lock(node_file->mutex);
+  node_file->removeUser();
+}
+
+
+
+void MegaTree::startReads(unsigned num_reads)
+{
+  boost::mutex::scoped_lock lock(background_mutex);
+  reads_in_flight += num_reads;
+}
 
+
+void MegaTree::finishRead()
+{
+  boost::mutex::scoped_lock lock(background_mutex);
+  reads_in_flight--;
+  if (reads_in_flight == 0)
+    read_done.notify_all();
 }
 
 
+void MegaTree::readNodeFileCb(FileCacheShard* shard, NodeFile* node_file, const ByteVec& buffer)
+{
+  int64_t bytes;
+  int nodes;
+  {
+    boost::mutex::scoped_lock lock(node_file->mutex);
+    node_file->deserialize(buffer);
+    node_file->takeCacheDelta(bytes, nodes);
+    node_file->addUser();
+  }
+  accountNodeFile(*shard, bytes, nodes);
+  fileLoaded(node_file);
+  cacheMaintenance(false);
+  finishRead();
+}
+
 
-void MegaTree::readNodeFileCb(NodeFile* node_file, const ByteVec& buffer)
+void MegaTree::readNodeFileBufferCb(FileCacheShard* shard, NodeFile* node_file, const ByteBufferPtr& buffer)
 {
+  int64_t bytes;
+  int nodes;
   {
     boost::mutex::scoped_lock lock(node_file->mutex);
     node_file->deserialize(buffer);
-    current_cache_size += node_file->cacheSize();
+    node_file->takeCacheDelta(bytes, nodes);
+    node_file->addUser();
   }
-  cacheMaintenance();
+  accountNodeFile(*shard, bytes, nodes);
+  fileLoaded(node_file);
+  cacheMaintenance(false);
+  finishRead();
 }
 
 
@@ -1,6 +1,8 @@
 #include <megatree/node_file.h>
+#include <megatree/short_id.h>
 #include <math.h>
 #include <algorithm>
+#include <map>
 #include <string.h>
 
 namespace megatree
@@ -12,9 +14,7 @@ void NodeFile::deserialize()
   is_modified = true;
 
   // signal conditions that are waiting for initialization
-  SpinLock::ScopedLock lock(node_state_mutex);
-  node_state = LOADED;
-  node_state_condition.notify_all();
+  setLoaded();
 }
 
 
@@ -22,45 +22,174 @@ void NodeFile::deserialize(const ByteVec &buffer)
 {
   //use_count = 0; only set use_count to 0 in constructor
   is_modified = false;
+  if (format_version == 12)
+  {
+    deserializeV12(&buffer[0], buffer.size());
+    return;
+  }
   unsigned offset = 0;
 
   // Reads the byte indicating which child node files exist.
   memcpy(&child_files, (void*)&buffer[offset], 1);
   offset += 1;
 
-  // Reads all the nodes
+  // Reads all the nodes.  Nodes that were handed out while the file
+  // was loading are already in the cache, and get overwritten.
+  node_cache.reserve(node_cache.size() + (buffer.size() - offset) / NODE_SIZE);
   while (offset < buffer.size())
   {
     ShortId short_id;
-    Node* node = node_allocator ? node_allocator->allocate() : new Node;
-    deserializeNode(node, short_id, buffer, offset);
+    memcpy((char *)&short_id, (void*)&buffer[offset + NODE_SIZE - SHORT_ID_SIZE], SHORT_ID_SIZE);
+    deserializeNode(node_cache.insert(short_id), short_id, &buffer[0], offset);
+  }
 
-    // add node to cache
-    NodeCache::iterator it = node_cache.find(short_id);
-    if (it == node_cache.end())
-    {
-      node_cache.insert(std::pair<ShortId, Node* >(short_id, node));
-    }
-    else
+  assert(buffer.size() == offset);
+
+  // signal conditions that are waiting for initialization
+  setLoaded();
+
+  //printf("Deserialized buffer %s with num nodes %d\n", path.string().c_str(), (int)node_cache.size());
+}
+
+
+void NodeFile::deserialize(const ByteBufferPtr& buffer)
+{
+  is_modified = false;
+  if (format_version == 12)
+  {
+    // Only indexed files can find their nodes without decoding.
+    if (!lazy_index.open(buffer->data(), buffer->size()))
     {
-      *(it->second) = *node;
-      node_allocator ? node_allocator->deAllocate(node) : delete node;
+      deserializeV12(buffer->data(), buffer->size());
+      return;
     }
+    num_lazy_nodes = lazy_index.numRecords();
   }
+  else
+  {
+    assert(buffer->size() >= 1 && (buffer->size() - 1) % NODE_SIZE == 0);
 
-  assert(buffer.size() == offset);
+    // Every node file is written sorted on short id (the node cache was
+    // an std::map before it became a ShortIdTable, and serialize() sorts
+    // explicitly), so readNode() finds the serialized nodes with a
+    // binary search.
+    num_lazy_nodes = (buffer->size() - 1) / NODE_SIZE;
+  }
+
+  // Reads the byte indicating which child node files exist.  The nodes
+  // are not decoded here.
+  memcpy(&child_files, (void*)buffer->data(), 1);
+  lazy_buffer = buffer;
+
+  // Fills in the nodes that were handed out while the file was loading.
+  for (NodeCache::Iterator it = node_cache.iterate(); !it.finished(); it.next())
+  {
+    unsigned offset;
+    if (findLazyNode(it.id(), offset))
+      decodeLazyNode(it.get(), offset);
+    else
+      num_lazy_nodes++;  // not in the file, but still in the cache
+  }
 
   // signal conditions that are waiting for initialization
-  SpinLock::ScopedLock lock(node_state_mutex);
-  node_state = LOADED;
-  node_state_condition.notify_all();
+  setLoaded();
+}
 
-  //printf("Deserialized buffer %s with num nodes %d\n", path.string().c_str(), (int)node_cache.size());
+
+bool NodeFile::findLazyNode(const ShortId& short_id, unsigned& offset) const
+{
+  assert(lazy_buffer);
+  const uint8_t* data = lazy_buffer->data();
+
+  if (format_version == 12)
+  {
+    size_t index;
+    if (!lazy_index.find(short_id, index))
+      return false;
+    offset = index;
+    return true;
+  }
+
+  // Binary search on the short id at the end of each serialized node.
+  unsigned begin = 0, end = (lazy_buffer->size() - 1) / NODE_SIZE;
+  while (begin < end)
+  {
+    unsigned middle = begin + (end - begin) / 2;
+    offset = 1 + middle * NODE_SIZE;
+    ShortId middle_id;
+    memcpy((char *)&middle_id, (void*)&data[offset + NODE_SIZE - SHORT_ID_SIZE], SHORT_ID_SIZE);
+    if (middle_id == short_id)
+      return true;
+    if (middle_id < short_id)
+      begin = middle + 1;
+    else
+      end = middle;
+  }
+  return false;
+}
+
+
+void NodeFile::decodeLazyNode(Node* node, unsigned offset) const
+{
+  if (format_version == 12)
+  {
+    NodeRecord record;
+    lazy_index.read(offset, record);
+    recordToNode(record, node);
+    return;
+  }
+
+  ShortId short_id;
+  deserializeNode(node, short_id, lazy_buffer->data(), offset);
+}
+
+
+void NodeFile::decodeAllLazyNodes()
+{
+  if (!lazy_buffer)
+    return;
+
+  const uint8_t* data = lazy_buffer->data();
+  unsigned offset = 1;
+  node_cache.reserve(num_lazy_nodes);
+  if (format_version == 12)
+  {
+    // Nodes that were decoded before may have been modified since.
+    std::vector<ShortId> short_ids;
+    std::vector<NodeRecord> records;
+    decodeNodeFile(data, lazy_buffer->size(), child_files, short_ids, records);
+    for (size_t i = 0; i < short_ids.size(); i++)
+      if (!node_cache.find(short_ids[i]))
+        recordToNode(records[i], node_cache.insert(short_ids[i]));
+    offset = lazy_buffer->size();
+  }
+  while (offset < lazy_buffer->size())
+  {
+    // Nodes that were decoded before may have been modified since.
+    ShortId short_id;
+    memcpy((char *)&short_id, (void*)&data[offset + NODE_SIZE - SHORT_ID_SIZE], SHORT_ID_SIZE);
+    if (node_cache.find(short_id))
+    {
+      offset += NODE_SIZE;
+      continue;
+    }
+    deserializeNode(node_cache.insert(short_id), short_id, data, offset);
+  }
+  assert(node_cache.size() == num_lazy_nodes);
+
+  lazy_buffer.reset();
+  num_lazy_nodes = 0;
 }
 
 
 void NodeFile::serialize(ByteVec& buffer)
 {
+  decodeAllLazyNodes();
+  if (format_version == 12)
+  {
+    serializeV12(buffer);
+    return;
+  }
   buffer.resize(1 + node_cache.size() * NODE_SIZE);
   unsigned offset = 0;
 
@@ -68,49 +197,79 @@ void NodeFile::serialize(ByteVec& buffer)
   memcpy(&buffer[offset], (char*)(&child_files), 1);
   offset += 1;
 
-  // write entire cache into buffer
-  for (NodeCache::const_iterator it=node_cache.begin(); it!=node_cache.end(); it++)
-    serializeNode(it->second, it->first, buffer, offset);
+  // write entire cache into buffer, sorted on short id
+  std::vector<NodeCache::Entry> entries;
+  node_cache.getSorted(entries);
+  for (size_t i = 0; i < entries.size(); i++)
+    serializeNode(entries[i].second, entries[i].first, buffer, offset);
 
   //printf("Serialized to buffer %s with num nodes %d\n", path.string().c_str(), (int)node_cache.size());
 }
 
+void NodeFile::deserializeV12(const uint8_t* data, size_t size)
+{
+  std::vector<ShortId> short_ids;
+  std::vector<NodeRecord> records;
+  if (!decodeNodeFile(data, size, child_files, short_ids, records))
+  {
+    fprintf(stderr, "Node file %s is corrupt\n", path.string().c_str());
+    abort();
+  }
+
+  // Copies all the nodes.  Nodes that were handed out while the file
+  // was loading are already in the cache, and get overwritten.
+  node_cache.reserve(node_cache.size() + short_ids.size());
+  for (size_t i = 0; i < short_ids.size(); i++)
+    recordToNode(records[i], node_cache.insert(short_ids[i]));
+
+  // signal conditions that are waiting for initialization
+  setLoaded();
+}
+
+
+void NodeFile::serializeV12(ByteVec& buffer)
+{
+  // The nodes go in the order of their short ids
+  std::vector<NodeCache::Entry> entries;
+  node_cache.getSorted(entries);
+  std::vector<ShortId> short_ids(entries.size());
+  std::vector<NodeRecord> records(entries.size());
+  for (size_t i = 0; i < entries.size(); i++)
+  {
+    short_ids[i] = entries[i].first;
+    nodeToRecord(entries[i].second, records[i]);
+  }
+
+  encodeNodeFile(child_files, subtree_width, root_file, short_ids, records, buffer, layout);
+}
+
+
 void NodeFile::serializeBytesize(ByteVec& buffer)
 {
   const static size_t STRIDE = 3 + 3;
+  assert(subtree_width > 0);
+  decodeAllLazyNodes();
   buffer.resize(1 + node_cache.size() * STRIDE);
   buffer[0] = child_files;
   size_t offset = 1;
 
-  for (NodeCache::const_iterator it = node_cache.begin(); it != node_cache.end(); ++it)
+  for (NodeCache::Iterator it = node_cache.iterate(); !it.finished(); it.next())
   {
-    // Determines the node's position from the id
-    //
-    // ID:  0123456789abcdefgh  (0 is high bit)
-    //  x:  0  3  6  9  c  f
-    //  y:   1  4  7  a  d  g
-    //  z:    2  5  8  b  e  h
-    uint8_t x=0, y=0, z=0;
-    for (int i = 7; i >=0; --i) {
-      int which = (it->first >> (i*3)) & 07;
-      x = (x << 1) | ((which & (1<<X_BIT)) ? 1 : 0);
-      y = (y << 1) | ((which & (1<<Y_BIT)) ? 1 : 0);
-      z = (z << 1) | ((which & (1<<Z_BIT)) ? 1 : 0);
+    // Determines the node's position from the id (see short_id.h), as
+    // one byte per axis.  Wide files lose their lowest bits.
+    uint32_t position[3] = {shortIdAxis(it.id(), X_BIT), shortIdAxis(it.id(), Y_BIT), shortIdAxis(it.id(), Z_BIT)};
+    for (unsigned i = 0; i < 3; i++)
+    {
+      if (subtree_width < 8)
+        buffer[offset + i] = position[i] << (8 - subtree_width);
+      else
+        buffer[offset + i] = position[i] >> (subtree_width - 8);
     }
 
-    // TODO: This assumes nodefiles with a width of 6, which is not true all the time.
-    x = x << 2;
-    y = y << 2;
-    z = z << 2;
-
-    buffer[offset + 0] = x;
-    buffer[offset + 1] = y;
-    buffer[offset + 2] = z;
-
     // Copies over the color
-    buffer[offset + 3] = it->second->color[0];
-    buffer[offset + 4] = it->second->color[1];
-    buffer[offset + 5] = it->second->color[2];
+    buffer[offset + 3] = it.get()->color[0];
+    buffer[offset + 4] = it.get()->color[1];
+    buffer[offset + 5] = it.get()->color[2];
 
     offset += STRIDE;
   }
@@ -120,48 +279,77 @@ void NodeFile::serializeBytesize(ByteVec& buffer)
 // use condition variable to wait for initialization
 void NodeFile::waitUntilLoaded()
 {
-  //TODO: Decide what to do with conditions here
-  //boost::mutex dummy_mutex;
-  //boost::mutex::scoped_lock dummy_lock(dummy_mutex);
-  while (true)
+  boost::mutex::scoped_lock lock(node_state_mutex);
+  while (node_state != LOADED)
+    node_state_condition.wait(lock);
+}
+
+void NodeFile::whenLoaded(const LoadedCallback& callback)
+{
   {
+    boost::mutex::scoped_lock lock(node_state_mutex);
+    if (node_state != LOADED)
     {
-      SpinLock::ScopedLock lock(node_state_mutex);
-      if(node_state == LOADED)
-        break;
-      node_state_condition.wait(node_state_mutex);
+      loaded_callbacks.push_back(callback);
+      return;
     }
-    //node_state_condition.wait(dummy_lock);
   }
+  callback();
+}
+
+void NodeFile::runLoadedCallbacks()
+{
+  std::vector<LoadedCallback> callbacks;
+  {
+    boost::mutex::scoped_lock lock(node_state_mutex);
+    if (node_state != LOADED)
+      return;
+    callbacks.swap(loaded_callbacks);
+  }
+  for (size_t i = 0; i < callbacks.size(); i++)
+    callbacks[i]();
+}
+
+void NodeFile::setLoaded()
+{
+  boost::mutex::scoped_lock lock(node_state_mutex);
+  __sync_synchronize();  // the nodes are in place before the file reads as loaded
+  node_state = LOADED;
+  node_state_condition.notify_all();
 }
 
 void NodeFile::setNodeState(NodeState state)
 {
-  SpinLock::ScopedLock lock(node_state_mutex);
+  boost::mutex::scoped_lock lock(node_state_mutex);
+  __sync_synchronize();
   node_state = state;
   node_state_condition.notify_all();
 }
 
+size_t NodeFile::memoryUsage() const
+{
+  size_t bytes = sizeof(NodeFile) + path.native().capacity();
+  bytes += node_cache.memoryUsage() + node_sums.memoryUsage();
+  if (lazy_buffer)
+    bytes += lazy_buffer->size();
+  return bytes;
+}
+
+
+void NodeFile::takeCacheDelta(int64_t& bytes, int& nodes)
+{
+  size_t new_bytes = memoryUsage();
+  unsigned new_nodes = cacheSize();
+  bytes = (int64_t)new_bytes - (int64_t)accounted_bytes;
+  nodes = (int)new_nodes - (int)accounted_nodes;
+  accounted_bytes = new_bytes;
+  accounted_nodes = new_nodes;
+}
+
+
 NodeFile::~NodeFile()
 {
-  // return nodes back to node_allocator
-  if (node_allocator) {
-    std::vector<Node*> allocated_nodes(node_cache.size());
-    size_t i = 0;
-    for (NodeCache::iterator it = node_cache.begin(); it != node_cache.end(); it++)
-    {
-      allocated_nodes[i++] = it->second;
-    }
-    assert(!allocated_nodes.empty());
-    assert(allocated_nodes[0] != NULL);
-    node_allocator->deallocateMany(allocated_nodes);
-  }
-  else {
-    for (NodeCache::iterator it = node_cache.begin(); it != node_cache.end(); it++)
-    {
-      delete it->second;
-    }
-  }
+  // The node blocks are freed by the node cache.
 
   // checks
   if (is_modified)
@@ -179,20 +367,30 @@ NodeFile::~NodeFile()
 Node* NodeFile::readNode(const ShortId& short_id)
 {
   // get the node from the cache
-  NodeCache::iterator it = node_cache.find(short_id);
-  if (it == node_cache.end())
+  Node* node = node_cache.find(short_id);
+  if (!node)
   {
-    SpinLock::ScopedLock lock(node_state_mutex);
+    boost::mutex::scoped_lock lock(node_state_mutex);
 
     assert(node_state != EVICTING);
 
     // allocate a Node object
     if (node_state == LOADING)
     {
-      Node* node = node_allocator ? node_allocator->allocate() : new Node;
+      node = node_cache.insert(short_id);
       node->reset();
-      node_cache.insert(std::pair<ShortId, Node* >(short_id, node));
-      use_count++;
+      addUser();
+
+      return node;
+    }
+
+    // decode the node from the buffer of a lazily loaded file
+    unsigned offset;
+    if (lazy_buffer && findLazyNode(short_id, offset))
+    {
+      node = node_cache.insert(short_id);
+      decodeLazyNode(node, offset);
+      addUser();
 
       return node;
     }
@@ -200,26 +398,48 @@ Node* NodeFile::readNode(const ShortId& short_id)
     // bad situation
     fprintf(stderr, "Could not find node with short_id %o in %s with %d nodes\n",
             short_id, path.string().c_str(), (int)node_cache.size());
-    /*
-    for (NodeCache::iterator jt = node_cache.begin(); jt != node_cache.end(); ++jt)
-    {
-      fprintf(stderr, "  Node  %8u: \n", jt->first);
-    }
-    */
     //abort();
     return NULL;
   }
 
-  use_count++;
+  addUser();
 
-  return it->second;
+  return node;
+}
+
+
+Node* NodeFile::readNodeShared(const ShortId& short_id, Node& copy)
+{
+  assert(getNodeState() == LOADED);
+
+  // Only looks up nodes, the node cache doesn't change
+  Node* node = node_cache.find(short_id);
+  if (!node)
+  {
+    unsigned offset;
+    if (!lazy_buffer || !findLazyNode(short_id, offset))
+    {
+      fprintf(stderr, "Could not find node with short_id %o in %s with %d nodes\n",
+              short_id, path.string().c_str(), (int)node_cache.size());
+      return NULL;
+    }
+    decodeLazyNode(&copy, offset);
+    node = &copy;
+  }
+
+  addUser();
+  return node;
 }
 
 void NodeFile::initializeFromChildren(const boost::filesystem::path &_path,
                                       std::vector<boost::shared_ptr<NodeFile> >& children)
 {
   assert(children.size() == 8);
+  assert(subtree_width > 0);
   node_cache.clear();
+  node_sums.clear();
+  lazy_buffer.reset();
+  num_lazy_nodes = 0;
   child_files = 0;
   path = _path;
 
@@ -237,36 +457,30 @@ void NodeFile::initializeFromChildren(const boost::filesystem::path &_path,
     if (children[i])
     {
       child_files |= (1 << i);
+      children[i]->decodeAllLazyNodes();
 
-      // Encodes the id element that came from the child nodefile's id and
-      // should prefix the short id of the parent nodes.
-      //
-      // TODO: This assumes that the node width is 6, an unreasonable
-      // assumption to make at this level.  This must be changed eventually.
-      ShortId short_id_prefix = i << (5 * 3);
-
-      for (NodeCache::iterator it = children[i]->node_cache.begin(); it != children[i]->node_cache.end(); ++it)
+      for (NodeCache::Iterator it = children[i]->node_cache.iterate(); !it.finished(); it.next())
       {
-        uint8_t which_child = it->first & 7;
+        uint8_t which_child = it.id() & 7;
 
-        // Determines the parent node for this node
-        ShortId parent_short_id = short_id_prefix + (it->first >> 3);
+        // Determines the parent node for this node.  The id of the child
+        // file becomes the first digit of the parent's short id.
+        ShortId parent_short_id = parentFileShortId(it.id(), i, subtree_width);
 
         // Puts the child into its parent's group.
         std::vector<Node*> &children = parent_groupings[parent_short_id];
         if (children.empty())
           children.resize(8, NULL);
-        children[which_child] = it->second;
+        children[which_child] = it.get();
       }
     }
   }
 
   // Condenses the groups of child nodes into a parent node.
+  node_cache.reserve(parent_groupings.size());
   for (ParentGrouping::iterator it = parent_groupings.begin(); it != parent_groupings.end(); ++it)
   {
-    Node *parent_node = new Node;
-    parent_node->copyFromChildNodes(&it->second[0]);
-    node_cache.insert(std::make_pair(it->first, parent_node));
+    node_cache.insert(it->first)->copyFromChildNodes(&it->second[0]);
   }
 }
 
@@ -274,12 +488,23 @@ void NodeFile::initializeFromChildren(const boost::filesystem::path &_path,
 void NodeFile::initializeRootNodeFile(const boost::filesystem::path &_path, NodeFile& child)
 {
   path = _path;  // A formality.  If pretty much has to be "f"
+  assert(subtree_width > 0);
 
   node_cache.clear();
+  node_sums.clear();
+  lazy_buffer.reset();
+  num_lazy_nodes = 0;
   path = _path;
+  root_file = true;
   child_files = 0x02;
-
-  NodeCache last_level = child.node_cache;
+  child.decodeAllLazyNodes();
+
+  // The nodes of the level that was condensed last.  These point into
+  // the child's node cache at first, and into our own afterwards.
+  typedef std::map<ShortId, Node*> LevelNodes;
+  LevelNodes last_level;
+  for (NodeCache::Iterator it = child.node_cache.iterate(); !it.finished(); it.next())
+    last_level[it.id()] = it.get();
   bool condensing_f1 = true;
 
   while (true)
@@ -290,20 +515,15 @@ void NodeFile::initializeRootNodeFile(const boost::filesystem::path &_path, Node
     typedef std::map<ShortId, std::vector<Node*> > ParentGrouping;
     ParentGrouping parent_groupings;  // parent short id  ->  8 child nodes
 
-    // The nodes from f1 need a "1" prefixed to their short_ids.
-    //
-    // TODO: This assumes that the node width is 6, an unreasonable
-    // assumption to make at this level.  This must be changed eventually.
-    ShortId short_id_prefix = 0;
-    if (condensing_f1)
-      short_id_prefix = 1 << (5 * 3);
-
-    for (NodeCache::iterator it = last_level.begin(); it != last_level.end(); ++it)
+    for (LevelNodes::iterator it = last_level.begin(); it != last_level.end(); ++it)
     {
       uint8_t which_child = it->first & 7;
 
-      // Determines the parent node for this node
-      ShortId parent_short_id = short_id_prefix + (it->first >> 3);
+      // Determines the parent node for this node.  The nodes from f1
+      // need a "1" prefixed to their short_ids.
+      ShortId parent_short_id = it->first >> 3;
+      if (condensing_f1)
+        parent_short_id = parentFileShortId(it->first, 1, subtree_width);
 
       // Puts the child into its parent's group.
       std::vector<Node*> &children = parent_groupings[parent_short_id];
@@ -314,20 +534,17 @@ void NodeFile::initializeRootNodeFile(const boost::filesystem::path &_path, Node
       printf("child %o is %u of %o\n", it->first, which_child, parent_short_id);
     }
 
-    //     2. Condenses the groups of child nodes into parent nodes.
+    //     2. Condenses the groups of child nodes into parent nodes,
+    //        which are inserted into nodefile f
 
     last_level.clear();
     for (ParentGrouping::iterator it = parent_groupings.begin(); it != parent_groupings.end(); ++it)
     {
-      Node *parent_node = new Node;
+      Node *parent_node = node_cache.insert(it->first);
       parent_node->copyFromChildNodes(&it->second[0]);
       last_level.insert(std::make_pair(it->first, parent_node));
     }
 
-    //     3. Inserts the parent nodes into nodefile f
-
-    node_cache.insert(last_level.begin(), last_level.end());
-
     condensing_f1 = false;
 
     // Checks if we've reached the root.
@@ -337,18 +554,35 @@ void NodeFile::initializeRootNodeFile(const boost::filesystem::path &_path, Node
 }
 
 
+NodeSums* NodeFile::getNodeSums(const ShortId& short_id, const Node* node)
+{
+  NodeSums* sums = node_sums.find(short_id);
+  if (sums && node->matchesSums(*sums))
+    return sums;
+  return NULL;
+}
+
+
+void NodeFile::setNodeSums(const ShortId& short_id, const NodeSums& sums)
+{
+  *node_sums.insert(short_id) = sums;
+}
+
+
 // Create a new node.
 Node* NodeFile::createNode(const ShortId& short_id)
 {
   //printf("Create node with short_id %d in %s/%s \n", short_id, folder.string().c_str(), filename.c_str());
   //assert(node_cache.find(short_id) == node_cache.end());
 
-  // Creates a new node object and adds it to the cache
-  Node* node = node_allocator ? node_allocator->allocate() : new Node;
+  // The file gets modified, so it can't depend on the lazy buffer anymore.
+  decodeAllLazyNodes();
+
+  // Creates a new node object in the cache
+  Node* node = node_cache.insert(short_id);
   node->reset();
-  node_cache.insert(std::pair<ShortId, Node* >(short_id, node));
 
-  use_count++;
+  addUser();
   is_modified = true;
   return node;
 }
@@ -360,7 +594,7 @@ void NodeFile::releaseNode(Node* node, const ShortId& short_id, bool modified)
   //assert(node_cache.find(short_id) != node_cache.end());
 
   is_modified = is_modified || modified;
-  use_count--;
+  removeUser();
 }
 
 
@@ -382,7 +616,7 @@ void NodeFile::serializeNode(const Node* node, const ShortId& short_id, ByteVec&
 
 
 // read node from buffer
-void NodeFile::deserializeNode(Node* node, ShortId& short_id, const ByteVec& buffer, unsigned& offset)
+void NodeFile::deserializeNode(Node* node, ShortId& short_id, const uint8_t* buffer, unsigned& offset)
 {
   memcpy((char *)node->point, (void*)&buffer[offset], POINT_SIZE);
   offset += POINT_SIZE;
@@ -397,5 +631,23 @@ void NodeFile::deserializeNode(Node* node, ShortId& short_id, const ByteVec& buf
 }
 
 
+void NodeFile::nodeToRecord(const Node* node, NodeRecord& record)
+{
+  memcpy(record.point, node->point, POINT_SIZE);
+  memcpy(record.color, node->color, COLOR_SIZE);
+  record.children = node->children;
+  record.count = node->count;
+}
+
+
+void NodeFile::recordToNode(const NodeRecord& record, Node* node)
+{
+  memcpy(node->point, record.point, POINT_SIZE);
+  memcpy(node->color, record.color, COLOR_SIZE);
+  node->children = record.children;
+  node->count = record.count;
+}
+
+
 
 }
@@ -8,6 +8,7 @@ int main(int argc, char** argv)
   std::vector<boost::shared_ptr<NodeFile> > children;
 
   std::string broken_file = "f1611111131";
+  const unsigned subtree_width = 6;
 
   children.resize(8);
   for(int i = 0; i < 8; ++i)
@@ -19,13 +20,13 @@ int main(int argc, char** argv)
     storage->get(child_file, bytes);
     if(!bytes.empty())
     {
-      children[i].reset(new NodeFile(child_file));
+      children[i].reset(new NodeFile(child_file, 11, subtree_width));
       children[i]->deserialize(bytes);
       printf("Deserialize %d with %d nodes\n", i, children[i]->cacheSize());
     }
   }
 
-  NodeFile broken_node_file(broken_file);
+  NodeFile broken_node_file(broken_file, 11, subtree_width);
   broken_node_file.initializeFromChildren(broken_file, children);
   printf("Cache size of reconstructed file %d\n", broken_node_file.cacheSize());
 
@@ -0,0 +1,143 @@
+#include <megatree/shared_cache.h>
+#include <megatree/megatree.h>
+
+#include <algorithm>
+
+
+namespace megatree
+{
+
+void SharedCache::attach(MegaTree* tree, double weight)
+{
+  assert(weight > 0);
+  boost::mutex::scoped_lock lock(mutex);
+  Member member;
+  member.tree = tree;
+  member.weight = weight;
+  member.used_bytes = 0;
+  members.push_back(member);
+}
+
+
+void SharedCache::detach(MegaTree* tree)
+{
+  boost::mutex::scoped_lock lock(mutex);
+  for (size_t i = 0; i < members.size(); i++)
+  {
+    if (members[i].tree == tree)
+    {
+      members.erase(members.begin() + i);
+      return;
+    }
+  }
+}
+
+
+uint64_t SharedCache::treeBudget(MegaTree* tree, uint64_t used_bytes, bool evict_others)
+{
+  boost::mutex::scoped_lock lock(mutex);
+  size_t self = members.size();
+  for (size_t i = 0; i < members.size(); i++)
+  {
+    if (members[i].tree == tree)
+    {
+      members[i].used_bytes = used_bytes;
+      self = i;
+    }
+  }
+  if (self == members.size())
+    return budget;  // not attached (anymore)
+
+  std::vector<uint64_t> budgets;
+  computeBudgets(budgets);
+
+  // Trees that are idle don't check their budget by themselves
+  for (size_t i = 0; i < members.size() && evict_others; i++)
+    if (i != self && members[i].used_bytes > budgets[i] * EVICTION_HIGH_WATERMARK)
+      members[i].tree->requestEviction();
+
+  return budgets[self];
+}
+
+
+// Every tree is entitled to a share of the budget in proportion to its
+// weight.  The trees that use less than that leave the rest of their
+// share to the other trees (max-min fairness), which raises the level
+// of the shares until the budget is used up.  The trees within their
+// share keep what they use, and while the trees together are under the
+// budget, any of them may also take the memory that is left over.  The
+// trees over their share get their share.
+void SharedCache::computeBudgets(std::vector<uint64_t>& budgets) const
+{
+  size_t num_members = members.size();
+  uint64_t total_bytes = 0;
+  double total_weight = 0;
+  for (size_t i = 0; i < num_members; i++)
+  {
+    total_bytes += members[i].used_bytes;
+    total_weight += members[i].weight;
+  }
+
+  // Finds the level of the shares, per unit of weight
+  std::vector<bool> satisfied(num_members, false);
+  double remaining_budget = budget;
+  double remaining_weight = total_weight;
+  unsigned num_satisfied = 0;
+  bool changed = true;
+  while (changed && num_satisfied < num_members)
+  {
+    changed = false;
+    for (size_t i = 0; i < num_members; i++)
+    {
+      if (satisfied[i] || members[i].used_bytes > remaining_budget * members[i].weight / remaining_weight)
+        continue;
+      satisfied[i] = true;
+      remaining_budget -= members[i].used_bytes;
+      remaining_weight -= members[i].weight;
+      num_satisfied++;
+      changed = true;
+    }
+  }
+  // Once every tree is within its share, the shares stay where they
+  // start, so a tree within its share doesn't make room for the others
+  double level = num_satisfied < num_members ? remaining_budget / remaining_weight : budget / total_weight;
+
+  uint64_t left_over = total_bytes < budget ? budget - total_bytes : 0;
+  budgets.resize(num_members);
+  for (size_t i = 0; i < num_members; i++)
+  {
+    budgets[i] = (uint64_t)(level * members[i].weight);
+    if (satisfied[i])
+      budgets[i] = std::max(budgets[i], members[i].used_bytes + left_over);
+  }
+}
+
+
+std::vector<SharedCache::TreeUsage> SharedCache::getUsage()
+{
+  boost::mutex::scoped_lock lock(mutex);
+  std::vector<uint64_t> budgets;
+  computeBudgets(budgets);
+
+  std::vector<TreeUsage> usage(members.size());
+  for (size_t i = 0; i < members.size(); i++)
+  {
+    usage[i].tree = members[i].tree;
+    usage[i].weight = members[i].weight;
+    usage[i].used_bytes = members[i].used_bytes;
+    usage[i].budget = budgets[i];
+  }
+  return usage;
+}
+
+
+uint64_t SharedCache::usedBytes()
+{
+  boost::mutex::scoped_lock lock(mutex);
+  uint64_t used_bytes = 0;
+  for (size_t i = 0; i < members.size(); i++)
+    used_bytes += members[i].used_bytes;
+  return used_bytes;
+}
+
+}
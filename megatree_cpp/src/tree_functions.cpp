@@ -1,5 +1,7 @@
 #include "megatree/tree_functions.h"
 #include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <algorithm>
 #include <megatree/common.h>  // For the timers
 
 
@@ -22,6 +24,39 @@ void dumpTimers()
   */
 }
 
+// Re-computes the summary of "node" from all its children.
+static void copySummary(MegaTree& tree, NodeHandle& node, NodeFile* children_file)
+{
+  NodeSums sums;
+  {
+    MegaTree::ChildIterator it(tree, node, children_file);
+    node.copyFromChildNodes(it.getAllChildren(), sums);
+  }
+  boost::mutex::scoped_lock lock(node.getNodeFile()->mutex);
+  node.getNodeFile()->setNodeSums(tree.getShortId(node.getId()), sums);
+}
+
+
+void updateSummary(MegaTree& tree, NodeHandle& node, uint8_t child,
+                   const Node& old_child, const Node& new_child, NodeFile* children_file)
+{
+  NodeFile* file = node.getNodeFile();
+  ShortId short_id = tree.getShortId(node.getId());
+  {
+    boost::mutex::scoped_lock lock(file->mutex);
+    NodeSums* sums = file->getNodeSums(short_id, node.getNode());
+    if (sums)
+    {
+      node.updateChildNode(child, old_child, new_child, *sums);
+      return;
+    }
+  }
+
+  // The sums are not known yet, so all children are read once.
+  copySummary(tree, node, children_file);
+}
+
+
 void addPointRecursive(MegaTree& tree, NodeHandle& node, 
                        const double* pt, const double* color,
                        double point_accuracy)
@@ -75,13 +110,15 @@ void addPointRecursive(MegaTree& tree, NodeHandle& node,
   }
 
   // recursion to add point to child
+  Node old_child = *new_child_node.getNode();
   addPointRecursive(tree, new_child_node, pt, color, point_accuracy);
+  Node child = *new_child_node.getNode();
+  NodeFile* children_file = new_child_node.getNodeFile();
 
+  // Re-computes the summary point.  The child is released after, so its
+  // file can't get evicted while the summary may read it.
+  updateSummary(tree, node, new_child, old_child, child, children_file);
   tree.releaseNode(new_child_node);
-
-  // Re-computes the summary point.
-  MegaTree::ChildIterator it(tree, node, new_child_node.getNodeFile());
-  node.copyFromChildNodes(it.getAllChildren());
 }
 
 
@@ -89,17 +126,24 @@ void addPointRecursive(MegaTree& tree, NodeHandle& node,
 
 
 
-void addPoint(MegaTree& tree, const std::vector<double>& pt, const std::vector<double>& col)
+static bool checkTreeBounds(MegaTree& tree, const double* pt)
 {
-  // check tree bounds
   if (!tree.getRootGeometry().contains(pt))
   {
     fprintf(stderr, "Point (%lf, %lf, %lf) is out of tree bounds (%lf, %lf, %lf)--(%lf, %lf, %lf)\n",
             pt[0], pt[1], pt[2],
             tree.getRootGeometry().getLo(0), tree.getRootGeometry().getLo(1), tree.getRootGeometry().getLo(2),
             tree.getRootGeometry().getHi(0), tree.getRootGeometry().getHi(1), tree.getRootGeometry().getHi(2));
-    return;
+    return false;
   }
+  return true;
+}
+
+
+void addPoint(MegaTree& tree, const std::vector<double>& pt, const std::vector<double>& col)
+{
+  if (!checkTreeBounds(tree, &pt[0]))
+    return;
 
   NodeHandle root;
   tree.getRoot(root);
@@ -113,6 +157,321 @@ void addPoint(MegaTree& tree, const std::vector<double>& pt, const std::vector<d
 
 
 
+// Levels of the octree the Morton keys of addPoints() tell apart
+static const unsigned MORTON_LEVELS = 21;
+
+
+// The path of "pt" from the root down, with the child of the root in
+// the highest bits, so sorting by the key sorts the points in Morton
+// order.  The children are the ones the tree descends into, also for
+// points on the edge of a cell.  Below MORTON_LEVELS the points are not
+// sorted anymore.
+static uint64_t mortonKey(const NodeGeometry& root, const double* pt)
+{
+  NodeGeometry geometry = root;
+  uint64_t key = 0;
+  for (unsigned level = 0; level < MORTON_LEVELS; level++)
+  {
+    uint8_t child = geometry.whichChild(pt);
+    key = key << 3 | child;
+    geometry = geometry.getChild(child);
+  }
+  return key;
+}
+
+
+void sortMortonOrder(const NodeGeometry& root, const std::vector<double>& pts, std::vector<size_t>& order)
+{
+  std::vector<std::pair<uint64_t, size_t> > keys(order.size());
+  for (size_t i = 0; i < order.size(); i++)
+    keys[i] = std::make_pair(mortonKey(root, &pts[3 * order[i]]), order[i]);
+  std::sort(keys.begin(), keys.end());
+  for (size_t i = 0; i < keys.size(); i++)
+    order[i] = keys[i].second;
+}
+
+
+// A batch of points, sorted in Morton order
+struct PointBatch
+{
+  PointBatch(const std::vector<double>& _pts, const std::vector<double>& _colors)
+    : pts(_pts), colors(_colors), black(3, 0)
+  {}
+
+  const double* point(size_t i) const { return &pts[3 * order[i]]; }
+  const double* color(size_t i) const { return colors.empty() ? &black[0] : &colors[3 * order[i]]; }
+
+  const std::vector<double>& pts;
+  const std::vector<double>& colors;
+  std::vector<double> black;
+  std::vector<size_t> order;  // Indices of the points, in Morton order
+};
+
+
+// Adds points [begin, end) of the batch to "node", which contains
+// them all.  The points that go to the same child come one after the
+// other, so every child is descended into once for all of them.  This
+// gives the same tree as adding the points one by one in this order.
+static void addSortedPoints(MegaTree& tree, NodeHandle& node, const PointBatch& batch, size_t begin, size_t end)
+{
+  double point_accuracy = tree.getMinCellSize();
+  if (end - begin == 1)
+  {
+    addPointRecursive(tree, node, batch.point(begin), batch.color(begin), point_accuracy);
+    return;
+  }
+
+  double node_cell_size = node.getNodeGeometry().getSize();
+
+  // The first point goes into an empty node
+  if (node.isEmpty() && point_accuracy >= node_cell_size / BITS_D)
+  {
+    node.setPoint(batch.point(begin), batch.color(begin));
+    begin++;
+  }
+
+  // reached maximum resultion of the tree
+  if (node_cell_size < tree.getMinCellSize())
+  {
+    for (size_t i = begin; i < end; i++)
+      node.addPoint(batch.point(i), batch.color(i));
+    return;
+  }
+
+  // this node is a leaf, and we need to copy the original point one level down
+  if (!node.isEmpty() && node.isLeaf())
+  {
+    uint8_t original_child = node.getChildForNodePoint();
+    NodeHandle new_leaf;
+    tree.createChildNode(node, original_child, new_leaf);
+    node.getNode()->copyToChildNode(original_child, new_leaf.getNode());
+    tree.releaseNode(new_leaf);
+  }
+
+  // Recurses on the runs of points that go to the same child.  Below
+  // the levels of the Morton keys a child may get several runs.
+  size_t run_begin = begin;
+  while (run_begin < end)
+  {
+    uint8_t new_child = node.getNodeGeometry().whichChild(batch.point(run_begin));
+    size_t run_end = run_begin + 1;
+    while (run_end < end && node.getNodeGeometry().whichChild(batch.point(run_end)) == new_child)
+      run_end++;
+
+    NodeHandle new_child_node;
+    if (node.hasChild(new_child))
+    {
+      tree.getChildNode(node, new_child, new_child_node);
+      new_child_node.waitUntilLoaded();
+    }
+    else
+      tree.createChildNode(node, new_child, new_child_node);
+
+    Node old_child = *new_child_node.getNode();
+    addSortedPoints(tree, new_child_node, batch, run_begin, run_end);
+    updateSummary(tree, node, new_child, old_child, *new_child_node.getNode(), new_child_node.getNodeFile());
+    tree.releaseNode(new_child_node);
+
+    run_begin = run_end;
+  }
+}
+
+
+// A node that addPoints() descends to before the threads start.  The
+// subtrees of the nodes that have points are handed out to the threads.
+struct InsertSubtree
+{
+  NodeHandle* node;
+  int first_child;  // Index of the first child subtree, or -1 if the node isn't split
+  size_t begin, end;  // Points of the batch to add to the node
+};
+
+// The batch is split until there are this many subtrees per thread, so
+// the threads that get small subtrees can pick up more of them.
+static const unsigned SUBTREES_PER_THREAD = 4;
+
+
+// Splits the points of "subtree" over its children.  Like in
+// addSortedPoints(), an empty node takes the first point, and a leaf
+// passes its point down.
+static void splitSubtree(MegaTree& tree, std::vector<InsertSubtree>& subtrees, size_t index, PointBatch& batch)
+{
+  NodeHandle* node = subtrees[index].node;
+  if (node->isEmpty() && tree.getMinCellSize() >= node->getNodeGeometry().getSize() / BITS_D)
+  {
+    node->setPoint(batch.point(subtrees[index].begin), batch.color(subtrees[index].begin));
+    subtrees[index].begin++;
+  }
+  if (!node->isEmpty() && node->isLeaf())
+  {
+    uint8_t original_child = node->getChildForNodePoint();
+    NodeHandle new_leaf;
+    tree.createChildNode(*node, original_child, new_leaf);
+    node->getNode()->copyToChildNode(original_child, new_leaf.getNode());
+    tree.releaseNode(new_leaf);
+  }
+
+  // The points stay in Morton order within every child
+  size_t begin = subtrees[index].begin, end = subtrees[index].end;
+  std::vector<size_t> child_points[8];
+  for (size_t i = begin; i < end; i++)
+    child_points[node->getNodeGeometry().whichChild(batch.point(i))].push_back(batch.order[i]);
+
+  subtrees[index].first_child = subtrees.size();
+  subtrees[index].begin = subtrees[index].end = end;
+  for (uint8_t child = 0; child < 8; child++)
+  {
+    if (child_points[child].empty())
+      continue;
+
+    InsertSubtree child_subtree;
+    if (node->hasChild(child))
+    {
+      child_subtree.node = tree.getChildNode(*node, child);
+      child_subtree.node->waitUntilLoaded();
+    }
+    else
+      child_subtree.node = tree.createChildNode(*node, child);
+    child_subtree.first_child = -1;
+    child_subtree.begin = begin;
+    child_subtree.end = begin + child_points[child].size();
+    std::copy(child_points[child].begin(), child_points[child].end(), batch.order.begin() + begin);
+    begin = child_subtree.end;
+    subtrees.push_back(child_subtree);
+  }
+}
+
+
+static void addPointsWorker(MegaTree& tree, std::vector<InsertSubtree>& subtrees, const std::vector<size_t>& order,
+                            size_t& next, boost::mutex& mutex, const PointBatch& batch)
+{
+  while (true)
+  {
+    InsertSubtree* subtree;
+    {
+      boost::mutex::scoped_lock lock(mutex);
+      if (next == order.size())
+        return;
+      subtree = &subtrees[order[next++]];
+    }
+
+    addSortedPoints(tree, *subtree->node, batch, subtree->begin, subtree->end);
+  }
+}
+
+
+static bool largerSubtree(const std::vector<InsertSubtree>* subtrees, size_t a, size_t b)
+{
+  return (*subtrees)[a].end - (*subtrees)[a].begin > (*subtrees)[b].end - (*subtrees)[b].begin;
+}
+
+
+void addPoints(MegaTree& tree, const std::vector<double>& pts, const std::vector<double>& colors,
+               unsigned num_threads)
+{
+  assert(pts.size() % 3 == 0);
+  assert(colors.empty() || colors.size() == pts.size());
+  if (num_threads == 0)
+    num_threads = 1;
+
+  PointBatch batch(pts, colors);
+  for (size_t p = 0; p < pts.size() / 3; p++)
+    if (checkTreeBounds(tree, &pts[3 * p]))
+      batch.order.push_back(p);
+  if (batch.order.empty())
+    return;
+  sortMortonOrder(tree.getRootGeometry(), pts, batch.order);
+
+  std::vector<InsertSubtree> subtrees(1);
+  subtrees[0].node = tree.getRoot();
+  subtrees[0].first_child = -1;
+  subtrees[0].begin = 0;
+  subtrees[0].end = batch.order.size();
+
+  // Splits the largest subtree until there are enough subtrees for the
+  // threads.  Subtrees with one point, and subtrees at the resolution of
+  // the tree, can't be split.
+  std::vector<bool> can_split(1, true);
+  while (num_threads > 1 && subtrees.size() < SUBTREES_PER_THREAD * num_threads)
+  {
+    size_t largest = subtrees.size();
+    for (size_t i = 0; i < subtrees.size(); i++)
+    {
+      if (can_split[i] && (largest == subtrees.size() || largerSubtree(&subtrees, i, largest)))
+        largest = i;
+    }
+    if (largest == subtrees.size())
+      break;
+    if (subtrees[largest].end - subtrees[largest].begin < 2 ||
+        subtrees[largest].node->getNodeGeometry().getSize() < tree.getMinCellSize())
+    {
+      can_split[largest] = false;
+      continue;
+    }
+
+    splitSubtree(tree, subtrees, largest, batch);
+    can_split[largest] = false;
+    can_split.resize(subtrees.size(), true);
+  }
+
+  // The threads take the largest subtrees first
+  std::vector<size_t> order;
+  for (size_t i = 0; i < subtrees.size(); i++)
+    if (subtrees[i].end > subtrees[i].begin)
+      order.push_back(i);
+  std::sort(order.begin(), order.end(), boost::bind(&largerSubtree, &subtrees, _1, _2));
+
+  size_t next = 0;
+  boost::mutex mutex;
+  if (num_threads == 1)
+    addPointsWorker(tree, subtrees, order, next, mutex, batch);
+  else
+  {
+    boost::thread_group threads;
+    for (unsigned i = 0; i < std::min<size_t>(num_threads, order.size()); i++)
+      threads.create_thread(boost::bind(&addPointsWorker, boost::ref(tree), boost::ref(subtrees), boost::cref(order),
+                                        boost::ref(next), boost::ref(mutex), boost::cref(batch)));
+    threads.join_all();
+  }
+
+  // Updates the nodes above the subtrees.  Several children of these
+  // nodes changed, so their summaries are computed from all children
+  // again.  Subtrees come after their parent, so the children of a node
+  // are done before the node itself.
+  for (size_t i = subtrees.size(); i-- > 0; )
+  {
+    InsertSubtree& subtree = subtrees[i];
+    if (subtree.first_child >= 0)
+      copySummary(tree, *subtree.node, subtrees[subtree.first_child].node->getNodeFile());
+  }
+  for (size_t i = 0; i < subtrees.size(); i++)
+  {
+    tree.releaseNode(*subtrees[i].node);
+    delete subtrees[i].node;
+  }
+}
+
+
+void BatchInserter::addPoint(const std::vector<double>& pt, const std::vector<double>& color)
+{
+  pts.insert(pts.end(), pt.begin(), pt.begin() + 3);
+  colors.insert(colors.end(), color.begin(), color.begin() + 3);
+  if (pts.size() >= 3 * batch_size)
+    flush();
+}
+
+
+void BatchInserter::flush()
+{
+  if (pts.empty())
+    return;
+  addPoints(tree, pts, colors, num_threads);
+  pts.clear();
+  colors.clear();
+}
+
+
+
 void TreeFastCache::addPoint(std::vector<double> &pt, const std::vector<double>& col)
 {
   // go through nodes to find closest node
@@ -348,126 +707,110 @@ void numChildren(MegaTree& tree, NodeHandle& node, unsigned count_cutoff, unsign
   }
 }
 
-static int process_queue_size = 0;  // TODO: For debugging, remove eventually
-void getAllPointsRecursiveAsync(MegaTree &tree, NodeHandle& node, double resolution,
-                                std::vector<double> &results, std::vector<double> &colors, megatree::List<NodeHandle*>& nodes_to_load)
+AsyncTraversal::AsyncTraversal(MegaTree& _tree, unsigned _max_loading)
+  : tree(_tree), max_loading(_max_loading), loading(0)
 {
-  //printf("Get all points recursive for node %s with frame offset %f %f %f\n",
-  //       node.getId().toString().c_str(), frame_offset[0], frame_offset[1], frame_offset[2]);
+  assert(max_loading > 0);
+}
 
-  assert(!node.isEmpty());
 
-  // we hit a leaf
-  if (node.isLeaf() || node.getNodeGeometry().getSize() <= resolution) 
+void AsyncTraversal::run(const Visitor& visitor, unsigned root_state)
+{
+  Task root = {new NodeHandle, root_state};
+  tree.getRoot(*root.node);
+  ready.push_back(root);
+
+  while (true)
   {
-    double point[3];
-    node.getPoint(point);
-    results.push_back(point[0]);
-    results.push_back(point[1]);
-    results.push_back(point[2]);
+    Task task;
+    {
+      boost::mutex::scoped_lock lock(mutex);
+      while ((ready.empty() && loading > 0) || loading >= max_loading)
+        loaded.wait(lock);
+      if (ready.empty())
+        break;
+      task = ready.back();
+      ready.pop_back();
+    }
 
-    double color[3];
-    node.getColor(color);
-    colors.push_back(color[0]);
-    colors.push_back(color[1]);
-    colors.push_back(color[2]);
+    if (visitor(*task.node, task.state) && !task.node->isLeaf())
+      expand(*task.node, task.state);
+    tree.releaseNode(*task.node);
+    delete task.node;
   }
+}
 
-  // need to descend further
-  else 
+
+void AsyncTraversal::expand(NodeHandle& node, unsigned state)
+{
+  for (uint8_t i = 0; i < 8; ++i)
   {
-    for(int i = 0; i < 8; ++i)
+    if (!node.hasChild(i))
+      continue;
+
+    Task task = {new NodeHandle, state};
+    tree.getChildNode(node, i, *task.node);
+    if (task.node->isValid())
     {
-      if(node.hasChild(i))
+      boost::mutex::scoped_lock lock(mutex);
+      ready.push_back(task);
+    }
+    else
+    {
+      // The node holds on to its file until the callback ran
       {
-        megatree::NodeHandle* child = new megatree::NodeHandle;
-        tree.getChildNode(node, i, *child);
-
-        //if the child isn't valid, we'll push it onto our nodes to load list
-        if(!child->isValid())
-        {
-          nodes_to_load.push_back(child);
-          process_queue_size++;
-        }
-        else
-        {
-          getAllPointsRecursiveAsync(tree, *child, resolution, results, colors, nodes_to_load);
-          tree.releaseNode(*child);
-          delete child;
-        }
+        boost::mutex::scoped_lock lock(mutex);
+        loading++;
       }
+      task.node->whenLoaded(boost::bind(&AsyncTraversal::nodeLoaded, this, task));
     }
   }
 }
 
-void queryRangeRecursiveAsync(MegaTree &tree, NodeHandle& node, 
-                              const double* range_mid, const double* range_size, double resolution,
-                              std::vector<double> &results, std::vector<double> &colors, megatree::List<NodeHandle*>& nodes_to_load)
+
+// Runs on the thread that loaded the file
+void AsyncTraversal::nodeLoaded(const Task& task)
 {
-  /*
-     printf("Query recursive for node %s with %f points frame offset %f %f %f, range mid %f %f %f and size %f %f %f\n",
-     node.getId().toString().c_str(), node.getCount(), frame_offset[0], frame_offset[1], frame_offset[2],
-     range_mid[0], range_mid[1], range_mid[2], range_size[0], range_size[1], range_size[2]); 
-     */
+  boost::mutex::scoped_lock lock(mutex);
+  ready.push_back(task);
+  loading--;
+  loaded.notify_one();
+}
 
-  // If the query range is outside of the node.
+
+static bool rangeQueryVisit(MegaTree* tree, const double* range_mid, const double* range_size, double resolution,
+                            std::vector<double>* results, std::vector<double>* colors,
+                            NodeHandle& node, unsigned& /*state*/)
+{
   if (nodeOutsideRange(node.getNodeGeometry(), range_mid, range_size))
+    return false;
+  if (!node.isLeaf() && node.getNodeGeometry().getSize() > resolution)
+    return true;
+
+  // The points of nodes inside the range are all in the range
+  if (!nodeInsideRange(node.getNodeGeometry(), range_mid, range_size))
   {
-    // Completely outside.  Stop
-  }
-  else if (nodeInsideRange(node.getNodeGeometry(), range_mid, range_size)) 
-  {
-    // Completely inside
-    getAllPointsRecursiveAsync(tree, node, resolution, results, colors, nodes_to_load);
+    queryRangeIntersecting(*tree, node, range_mid, range_size, *results, *colors);
+    return false;
   }
 
-  // Partially intersecting
-  else 
-  { 
-    // node is leaf
-    if (node.isLeaf() || node.getNodeGeometry().getSize() <= resolution)
-    {  
-      queryRangeIntersecting(tree, node, range_mid, range_size, results, colors);
-    }
-    // node is not a leaf
-    else   
-    {
-      // recurse to child if we can
-      for(int i = 0; i < 8; ++i)
-      {
-        if(node.hasChild(i))
-        {
-          megatree::NodeHandle* child = new megatree::NodeHandle;
-          tree.getChildNode(node, i, *child);
-
-          //if the child isn't valid, we'll push it onto our nodes to load list
-          if(!child->isValid())
-          {
-            nodes_to_load.push_back(child);
-            process_queue_size++;
-          }
-          else
-          {
-            queryRangeRecursiveAsync(tree, *child, range_mid, range_size, resolution, results, colors, nodes_to_load);
-            tree.releaseNode(*child);
-            delete child;
-          }
-        }
-      }
-    }
-  }
+  double point[3];
+  node.getPoint(point);
+  results->push_back(point[0]);
+  results->push_back(point[1]);
+  results->push_back(point[2]);
+
+  double color[3];
+  node.getColor(color);
+  colors->push_back(color[0]);
+  colors->push_back(color[1]);
+  colors->push_back(color[2]);
+  return false;
 }
 
+
 void rangeQueryLoop(MegaTree& tree, std::vector<double> lo, std::vector<double> hi, double resolution, std::vector<double>& results, std::vector<double>& colors)
 {
-  megatree::List<NodeHandle*> process_queue;
-
-  megatree::NodeHandle* root = new megatree::NodeHandle;
-  tree.getRoot(*root);
-  assert(root->isValid());
-  process_queue.push_back(root);
-  process_queue_size = 1;
-
   double range_mid[3];
   range_mid[0] = (hi[0] + lo[0])/2;
   range_mid[1] = (hi[1] + lo[1])/2;
@@ -477,29 +820,8 @@ void rangeQueryLoop(MegaTree& tree, std::vector<double> lo, std::vector<double>
   range_size[1] = hi[1] - lo[1];
   range_size[2] = hi[2] - lo[2];
 
-  while(!process_queue.empty())
-  {
-    megatree::NodeHandle* node_to_process = process_queue.front();
-
-    //if the node isn't valid yet, we'll just move it to the back of the queue.
-    if(!node_to_process->isValid())
-    {
-      process_queue.moveToBack(process_queue.getFrontPointer());
-      node_to_process = NULL;
-      //printf("%d\n", process_queue_size);
-    }
-    else
-    {
-      megatree::List<NodeHandle*> nodes_to_load;
-      queryRangeRecursiveAsync(tree, *node_to_process, range_mid, range_size, resolution, results, colors, nodes_to_load);
-      process_queue.pop_front();
-      process_queue_size--;
-      tree.releaseNode(*node_to_process);
-      delete node_to_process;
-      process_queue.spliceToBack(nodes_to_load);
-      //printf("#%d\n", process_queue_size);
-    }
-  }
+  AsyncTraversal traversal(tree);
+  traversal.run(boost::bind(&rangeQueryVisit, &tree, range_mid, range_size, resolution, &results, &colors, _1, _2));
 }
 
 
@@ -1,11 +1,14 @@
 #include <gtest/gtest.h>
 #include <cmath>
+#include <set>
+#include <boost/thread.hpp>
 
 #include <megatree/megatree.h>
 #include <megatree/allocator.h>
 #include <megatree/storage_factory.h>
 #include <megatree/node_file.h>
 #include <megatree/tree_functions.h>
+#include <megatree/compress.h>
 
 using namespace megatree;
 
@@ -25,6 +28,27 @@ static const double point_precision = 0.001;
   EXPECT_NEAR(c, v[2], tolerance); 
 
 
+// The "i"th point of a grid that is "width" points wide and deep, with
+// "spacing" between the points, starting at "offset" in every direction
+static void gridPoint(size_t i, size_t width, double spacing, double offset, std::vector<double>& pt)
+{
+  pt[0] = i % width * spacing + offset;
+  pt[1] = i / width % width * spacing + offset;
+  pt[2] = i / width / width * spacing + offset;
+}
+
+// Adds the first "num_points" points of the grid
+static void addGrid(MegaTree& tree, size_t num_points, size_t width, double spacing, double offset = 0)
+{
+  std::vector<double> pt(3);
+  for (size_t i = 0; i < num_points; ++i)
+  {
+    gridPoint(i, width, spacing, offset, pt);
+    addPoint(tree, pt);
+  }
+}
+
+
 
 TEST(MegaTreeBasics, NodeGeometry)
 {
@@ -116,6 +140,146 @@ TEST(MegaTreeBasics, Node)
 }
 
 
+TEST(MegaTreeBasics, NodeSums)
+{
+  double center[] = {0, 0, 0};
+  NodeGeometry ng(center, 1.0);
+
+  // A parent with three children
+  Node children[8];
+  Node* child_nodes[8] = {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL};
+  for (unsigned i = 1; i < 8; i += 3)
+  {
+    double pt[] = {0.1 * i - 0.4, 0.3, -0.2};
+    double col[] = {10.0 * i, 100, 250};
+    children[i].setPoint(ng, pt, col, i);
+    child_nodes[i] = &children[i];
+  }
+  Node parent;
+  NodeSums sums;
+  parent.copyFromChildNodes(child_nodes, sums);
+  EXPECT_TRUE(parent.matchesSums(sums));
+
+  // Changes one child, and adds another
+  for (unsigned i = 4; i < 7; i += 2)
+  {
+    Node old_child = children[i];
+    double pt[] = {0.37, -0.11, 0.05 * i};
+    double col[] = {3, 7.0 * i, 11};
+    children[i].setPoint(ng, pt, col, 1000 + i);
+    child_nodes[i] = &children[i];
+    parent.updateChildNode(i, old_child, children[i], sums);
+
+    // Same as computing the parent from scratch
+    Node expected;
+    expected.copyFromChildNodes(child_nodes);
+    EXPECT_TRUE(parent == expected);
+    EXPECT_TRUE(parent.matchesSums(sums));
+  }
+
+  // Sums from before a change don't match anymore
+  NodeSums old_sums = sums;
+  Node old_child = children[1];
+  double pt[] = {-0.3, -0.3, -0.3};
+  double col[] = {0, 0, 0};
+  children[1].setPoint(ng, pt, col, 50);
+  parent.updateChildNode(1, old_child, children[1], sums);
+  EXPECT_FALSE(parent.matchesSums(old_sums));
+}
+
+
+TEST(MegaTreeBasics, Allocator)
+{
+  // Grows a chunk at a time, and never runs dry
+  Allocator<Node> allocator(100);
+  EXPECT_EQ(allocator.footprint(), 0u);
+  std::vector<Node*> nodes;
+  allocator.allocateMany(250, nodes);
+  EXPECT_EQ(allocator.footprint(), 300 * sizeof(Node));
+  std::set<Node*> unique(nodes.begin(), nodes.end());
+  EXPECT_EQ(unique.size(), 250u);
+
+  // Freed objects get recycled before the allocator grows
+  allocator.deallocateMany(nodes);
+  EXPECT_TRUE(nodes.empty());
+  allocator.allocateMany(250, nodes);
+  EXPECT_EQ(allocator.footprint(), 300 * sizeof(Node));
+  for (size_t i = 0; i < nodes.size(); i++)
+    EXPECT_TRUE(unique.count(nodes[i]));
+  allocator.deallocateMany(nodes);
+}
+
+
+TEST(MegaTreeBasics, AllocatorHugePages)
+{
+  for (int mode = TRANSPARENT_HUGE_PAGES; mode <= EXPLICIT_HUGE_PAGES; mode++)
+  {
+    // Chunks are rounded up to whole huge pages, even without huge page support
+    setHugePageMode(HugePageMode(mode));
+    Allocator<Node> allocator(100);
+    std::vector<Node*> nodes;
+    allocator.allocateMany(1000, nodes);
+    setHugePageMode(NO_HUGE_PAGES);
+
+    EXPECT_EQ(allocator.footprint(), HUGE_PAGE_SIZE);
+    EXPECT_EQ((uintptr_t)*std::min_element(nodes.begin(), nodes.end()) % HUGE_PAGE_SIZE, 0u);
+    for (size_t i = 0; i < nodes.size(); i++)
+      nodes[i]->setChild(i % 8);
+    for (size_t i = 0; i < nodes.size(); i++)
+      EXPECT_TRUE(nodes[i]->hasChild(i % 8));
+    allocator.deallocateMany(nodes);
+  }
+}
+
+
+static void allocateAndFree(Allocator<Node>* allocator, std::vector<Node*>* from_other_thread, unsigned seed)
+{
+  for (size_t i = 0; i < from_other_thread->size(); i++)
+    allocator->deAllocate((*from_other_thread)[i]);
+
+  std::vector<Node*> nodes;
+  for (unsigned round = 0; round < 100; round++)
+  {
+    allocator->allocateMany(100 + (round * seed) % 300, nodes);
+    for (size_t i = 0; i < nodes.size(); i++)
+      nodes[i]->setChild(seed % 8);
+    for (size_t i = 0; i < nodes.size(); i++)
+      EXPECT_TRUE(nodes[i]->hasChild(seed % 8));
+    for (size_t i = 0; i < nodes.size(); i++)
+      *nodes[i] = Node();
+    allocator->deallocateMany(nodes);
+  }
+  allocator->allocateMany(200, *from_other_thread);
+}
+
+
+TEST(MegaTreeBasics, AllocatorThreads)
+{
+  Allocator<Node> allocator(64);
+  std::vector<std::vector<Node*> > nodes(4);
+  allocator.allocateMany(1000, nodes[0]);
+
+  // Each thread frees the objects of the one before it
+  for (unsigned round = 0; round < 3; round++)
+  {
+    boost::thread_group threads;
+    for (unsigned i = 0; i < nodes.size(); i++)
+      threads.create_thread(boost::bind(&allocateAndFree, &allocator, &nodes[i], i + 1));
+    threads.join_all();
+    std::rotate(nodes.begin(), nodes.begin() + 1, nodes.end());
+  }
+
+  // The threads returned their magazines, and no object is handed out twice
+  std::set<Node*> unique;
+  for (unsigned i = 0; i < nodes.size(); i++)
+    unique.insert(nodes[i].begin(), nodes[i].end());
+  EXPECT_EQ(unique.size(), 4 * 200u);
+  EXPECT_LE(allocator.capacity(), 6000u);
+  for (unsigned i = 0; i < nodes.size(); i++)
+    allocator.deallocateMany(nodes[i]);
+}
+
+
 TEST(MegaTreeBasics, OctreeLevel)
 {
   EXPECT_EQ(1, IdType(1).level());
@@ -318,13 +482,395 @@ TEST(MegaTreeBasics, TestDiskAccess)
 
   //test to make sure we can load from disk
   boost::shared_ptr<Storage> storage3(openStorage(tree1_path->getPath()));
-  MegaTree tree3(storage3, 10000, true);
+  MegaTree tree3(storage3, 10 * 1024 * 1024, true);
 
   EXPECT_TRUE(tree1 == tree3);
   EXPECT_TRUE(tree2 == tree3);
 
 }
 
+TEST(MegaTreeBasics, TestCompressedDiskAccess)
+{
+  std::vector<double> tree_center(3, 0);
+  double tree_size = 1000000;
+
+  boost::shared_ptr<TempDir> tree1_path(createTempDir("tree1", true));
+  boost::shared_ptr<Storage> storage1(openStorage(tree1_path->getPath()));
+  MegaTree tree1(storage1, tree_center, tree_size, 3, 1, 10 * 1024 * 1024, MIN_CELL_SIZE, "zlib");
+
+  boost::shared_ptr<TempDir> tree2_path(createTempDir("tree2", true));
+  boost::shared_ptr<Storage> storage2(openStorage(tree2_path->getPath()));
+  MegaTree tree2(storage2, tree_center, tree_size, 3, 1);
+
+  // Adds a grid of points
+  const double STEP = 1;
+  const size_t WIDTH = 4;
+  std::vector<double> pt(3, 0.0f);
+  for (size_t i = 0; i < WIDTH; ++i)
+  {
+    for (size_t j = 0; j < WIDTH; ++j)
+    {
+      for (size_t k = 0; k < WIDTH; ++k)
+      {
+        pt[0] = STEP * i;
+        pt[1] = STEP * j;
+        pt[2] = STEP * k;
+        addPoint(tree1, pt);
+        addPoint(tree2, pt);
+      }
+    }
+  }
+
+  tree1.flushCache();
+  tree2.flushCache();
+
+  // The root file on disk is compressed.
+  ByteVec compressed, uncompressed;
+  storage1->get("f", compressed);
+  storage2->get("f", uncompressed);
+  EXPECT_EQ(ZLIB_COMPRESSION, compressed[0]);
+  EXPECT_LT(compressed.size(), uncompressed.size());
+
+  // Loads the compressed tree back from disk
+  boost::shared_ptr<Storage> storage3(openStorage(tree1_path->getPath()));
+  MegaTree tree3(storage3, 10 * 1024 * 1024, true);
+  EXPECT_TRUE(tree2 == tree3);
+}
+
+TEST(MegaTreeBasics, TestIndexedDiskAccess)
+{
+  std::vector<double> tree_center(3, 0);
+  double tree_size = 1000000;
+
+  boost::shared_ptr<TempDir> tree1_path(createTempDir("tree1", true));
+  boost::shared_ptr<Storage> storage1(openStorage(tree1_path->getPath()));
+  MegaTree tree1(storage1, tree_center, tree_size, 3, 1, 10 * 1024 * 1024, MIN_CELL_SIZE, "none", "indexed");
+
+  boost::shared_ptr<TempDir> tree2_path(createTempDir("tree2", true));
+  boost::shared_ptr<Storage> storage2(openStorage(tree2_path->getPath()));
+  MegaTree tree2(storage2, tree_center, tree_size, 3, 1);
+
+  // Adds a grid of points
+  const double STEP = 1;
+  const size_t WIDTH = 4;
+  std::vector<double> pt(3, 0.0f);
+  for (size_t i = 0; i < WIDTH; ++i)
+  {
+    for (size_t j = 0; j < WIDTH; ++j)
+    {
+      for (size_t k = 0; k < WIDTH; ++k)
+      {
+        pt[0] = STEP * i;
+        pt[1] = STEP * j;
+        pt[2] = STEP * k;
+        addPoint(tree1, pt);
+        addPoint(tree2, pt);
+      }
+    }
+  }
+
+  tree1.flushCache();
+  tree2.flushCache();
+
+  ByteVec indexed;
+  storage1->get("f", indexed);
+  EXPECT_TRUE(indexed[2] & NODE_FILE_INDEXED);
+
+  // Loads the indexed tree back from disk, lazily
+  boost::shared_ptr<Storage> storage3(openStorage(tree1_path->getPath()));
+  MegaTree tree3(storage3, 10 * 1024 * 1024, true);
+  EXPECT_TRUE(tree2 == tree3);
+}
+
+static void queryAll(MegaTree* tree, size_t* num_points)
+{
+  std::vector<double> lo(3, -10), hi(3, 10), result, colors;
+  for (unsigned i = 0; i < 5; i++)
+  {
+    result.clear();
+    colors.clear();
+    queryRange(*tree, lo, hi, point_precision, result, colors);
+  }
+  *num_points = result.size() / 3;
+}
+
+
+TEST(MegaTreeBasics, ConcurrentQueries)
+{
+  std::vector<double> tree_center(3, 0);
+  double tree_size = 1000000;
+
+  boost::shared_ptr<TempDir> tree_path(createTempDir("tree1", true));
+  {
+    boost::shared_ptr<Storage> storage(openStorage(tree_path->getPath()));
+    MegaTree tree(storage, tree_center, tree_size, 2, 1);
+
+    // Adds a grid of points, spread over many small files
+    addGrid(tree, 8 * 8 * 8, 8, 1.0);
+  }
+
+  // Threads load the same files, through different shards of the file cache
+  boost::shared_ptr<Storage> storage(openStorage(tree_path->getPath()));
+  MegaTree tree(storage, 10 * 1024 * 1024, true);
+  std::vector<size_t> num_points(4, 0);
+  boost::thread_group threads;
+  for (unsigned i = 0; i < num_points.size(); i++)
+    threads.create_thread(boost::bind(&queryAll, &tree, &num_points[i]));
+  threads.join_all();
+  for (unsigned i = 0; i < num_points.size(); i++)
+    EXPECT_EQ(num_points[i], 8u * 8u * 8u);
+}
+
+
+TEST(MegaTreeBasics, ReadOnlySharedReads)
+{
+  std::vector<double> tree_center(3, 0);
+  double tree_size = 1000000;
+
+  boost::shared_ptr<TempDir> tree_path(createTempDir("tree1", true));
+  {
+    boost::shared_ptr<Storage> storage(openStorage(tree_path->getPath()));
+    MegaTree tree(storage, tree_center, tree_size, 2, 1);
+    addGrid(tree, 4 * 4 * 4, 4, 1.0);
+  }
+
+  boost::shared_ptr<Storage> storage(openStorage(tree_path->getPath()));
+  MegaTree tree(storage, 10 * 1024 * 1024, true);
+  size_t num_points;
+  queryAll(&tree, &num_points);
+  EXPECT_EQ(num_points, 4u * 4u * 4u);
+
+  // Once the files are loaded, the threads read them without locking them
+  std::vector<size_t> concurrent_points(8, 0);
+  boost::thread_group threads;
+  for (unsigned i = 0; i < concurrent_points.size(); i++)
+    threads.create_thread(boost::bind(&queryAll, &tree, &concurrent_points[i]));
+  threads.join_all();
+  for (unsigned i = 0; i < concurrent_points.size(); i++)
+    EXPECT_EQ(concurrent_points[i], 4u * 4u * 4u);
+
+  // A copy of a handle keeps its own copy of a node that was read into the handle
+  NodeHandle root;
+  tree.getRoot(root);
+  NodeHandle copy(root);
+  EXPECT_EQ(copy.getCount(), 4u * 4u * 4u);
+  EXPECT_TRUE(copy == root);
+  tree.releaseNode(root);
+  copy.invalidate();
+}
+
+
+TEST(MegaTreeBasics, CacheStats)
+{
+  std::vector<double> tree_center(3, 0);
+  double tree_size = 1000000;
+  const uint64_t budget = 1024 * 1024;
+
+  boost::shared_ptr<TempDir> tree_path(createTempDir("tree1", true));
+  boost::shared_ptr<Storage> storage(openStorage(tree_path->getPath()));
+  MegaTree tree(storage, tree_center, tree_size, 2, 1, budget);
+  CacheStats empty = tree.getCacheStats();
+  EXPECT_EQ(empty.budget, budget);
+
+  // Many small files, taking more memory than the budget
+  std::vector<double> pt(3, 0.0f);
+  for (size_t i = 0; i < 20000; ++i)
+  {
+    gridPoint(i, 100, 3.7, 0, pt);
+    addPoint(tree, pt);
+
+    CacheStats stats = tree.getCacheStats();
+    ASSERT_GT(stats.node_bytes, empty.node_bytes);
+    ASSERT_GE(stats.num_nodes, 1u);
+    ASSERT_EQ(stats.entry_bytes % stats.num_files, 0u);
+    ASSERT_LE(stats.total() - stats.evicting_bytes, budget + budget / 10);
+  }
+  EXPECT_GT(tree.getCacheStats().num_nodes, 0u);
+
+  tree.flushCache();
+  CacheStats flushed = tree.getCacheStats();
+  EXPECT_EQ(flushed.write_bytes, 0u);
+  EXPECT_EQ(flushed.evicting_bytes, 0u);
+}
+
+
+TEST(MegaTreeBasics, PinnedLevels)
+{
+  std::vector<double> tree_center(3, 0);
+  double tree_size = 1000000;
+  const uint64_t budget = 256 * 1024;
+
+  // Keeps the root file and its child files, with a cache that is much
+  // smaller than the tree
+  boost::shared_ptr<TempDir> tree_path(createTempDir("tree1", true));
+  unsigned num_pinned_files;
+  {
+    boost::shared_ptr<Storage> storage(openStorage(tree_path->getPath()));
+    MegaTree tree(storage, tree_center, tree_size, 2, 1, budget, MIN_CELL_SIZE, "none", "compact",
+                  LRU_CACHE_POLICY, 2);
+    addGrid(tree, 5000, 20, 0.9, -9);
+    CacheStats stats = tree.getCacheStats();
+    num_pinned_files = stats.num_pinned_files;
+    EXPECT_GT(num_pinned_files, 1u);
+    EXPECT_LE(num_pinned_files, 9u);
+    EXPECT_LT(stats.num_files, 1000u);
+
+    // The pinned files are written too
+    tree.flushCache();
+    EXPECT_EQ(tree.getCacheStats().num_pinned_files, num_pinned_files);
+  }
+
+  boost::shared_ptr<Storage> storage(openStorage(tree_path->getPath()));
+  MegaTree tree(storage, budget, true, LRU_CACHE_POLICY, 2);
+  size_t num_points;
+  queryAll(&tree, &num_points);
+  EXPECT_EQ(num_points, 5000u);
+  EXPECT_EQ(tree.getCacheStats().num_pinned_files, num_pinned_files);
+
+  // Reading the pinned files again doesn't load them
+  tree.resetCount();
+  NodeHandle root;
+  tree.getRoot(root);
+  tree.releaseNode(root);
+  EXPECT_EQ(tree.getMissCount(), 0u);
+  EXPECT_EQ(tree.getHitCount(), 1u);
+}
+
+
+TEST(MegaTreeBasics, BackgroundEviction)
+{
+  std::vector<double> tree_center(3, 0);
+  double tree_size = 1000000;
+  const uint64_t budget = 1024 * 1024;
+
+  boost::shared_ptr<TempDir> tree_path(createTempDir("tree1", true));
+  boost::shared_ptr<Storage> storage(openStorage(tree_path->getPath()));
+  MegaTree tree(storage, tree_center, tree_size, 2, 1, budget);
+  addGrid(tree, 20000, 100, 3.7);
+
+  // The eviction thread brings the cache under the high watermark on its own
+  tree.waitForEviction();
+  CacheStats stats = tree.getCacheStats();
+  EXPECT_LE(stats.total() - stats.evicting_bytes, budget * EVICTION_HIGH_WATERMARK);
+
+  tree.flushCache();
+  EXPECT_EQ(tree.getCacheStats().write_bytes, 0u);
+  NodeHandle root;
+  tree.getRoot(root);
+  EXPECT_EQ(root.getCount(), 20000u);
+  tree.releaseNode(root);
+}
+
+
+TEST(MegaTreeBasics, Prefetch)
+{
+  std::vector<double> tree_center(3, 0);
+  double tree_size = 1000000;
+
+  boost::shared_ptr<TempDir> tree_path(createTempDir("tree1", true));
+  {
+    boost::shared_ptr<Storage> storage(openStorage(tree_path->getPath()));
+    MegaTree tree(storage, tree_center, tree_size, 2, 1, 10 * 1024 * 1024);
+    addGrid(tree, 5000, 20, 0.9, -9);
+  }
+
+  // Prefetching a file loads it once
+  boost::shared_ptr<Storage> storage(openStorage(tree_path->getPath()));
+  {
+    MegaTree tree(storage, 10 * 1024 * 1024, true);
+    std::vector<IdType> file_ids(1, tree.getFileId(IdType(1L)));
+    tree.prefetch(file_ids);
+    tree.prefetch(file_ids);
+    tree.waitForPrefetches();
+    EXPECT_EQ(tree.getMissCount(), 1u);
+    EXPECT_EQ(tree.getHitCount(), 0u);
+  }
+
+  // A query finds all the files of a prefetched region in the cache
+  std::vector<double> lo(3, -5), hi(3, 5), results, colors;
+  size_t num_points;
+  {
+    MegaTree tree(storage, 10 * 1024 * 1024, true);
+    tree.prefetch(lo, hi, 0.1);
+    tree.waitForPrefetches();
+    EXPECT_GT(tree.getMissCount(), 1u);
+
+    tree.resetCount();
+    queryRange(tree, lo, hi, 0.1, results, colors);
+    EXPECT_EQ(tree.getMissCount(), 0u);
+    num_points = results.size() / 3;
+    EXPECT_GT(num_points, 0u);
+  }
+
+  // So does a query with automatic prefetching
+  {
+    MegaTree tree(storage, 10 * 1024 * 1024, true);
+    tree.setAutoPrefetch(true);
+    results.clear();
+    colors.clear();
+    queryRange(tree, lo, hi, 0.1, results, colors);
+    EXPECT_EQ(results.size() / 3, num_points);
+  }
+}
+
+
+static bool countNode(unsigned* num_nodes, unsigned* max_depth, NodeHandle& node, unsigned& depth)
+{
+  (*num_nodes)++;
+  *max_depth = std::max(*max_depth, depth);
+  EXPECT_EQ(depth, node.getId().level() - 1);
+  depth++;
+  return true;
+}
+
+
+TEST(MegaTreeBasics, AsyncTraversal)
+{
+  std::vector<double> tree_center(3, 0);
+  double tree_size = 1000000;
+
+  boost::shared_ptr<TempDir> tree_path(createTempDir("tree1", true));
+  {
+    boost::shared_ptr<Storage> storage(openStorage(tree_path->getPath()));
+    MegaTree tree(storage, tree_center, tree_size, 2, 1, 10 * 1024 * 1024);
+    addGrid(tree, 5000, 20, 0.9, -9);
+  }
+
+  // The asynchronous query finds the same points, from a cold cache
+  boost::shared_ptr<Storage> storage(openStorage(tree_path->getPath()));
+  std::vector<double> lo(3, -5), hi(3, 5);
+  for (unsigned r = 0; r < 3; r++)
+  {
+    double resolution = r == 0 ? 0.001 : r * 2.0;
+    std::vector<double> results, colors, async_results, async_colors;
+    {
+      MegaTree tree(storage, 10 * 1024 * 1024, true);
+      queryRange(tree, lo, hi, resolution, results, colors);
+    }
+    MegaTree tree(storage, 10 * 1024 * 1024, true);
+    rangeQueryLoop(tree, lo, hi, resolution, async_results, async_colors);
+    EXPECT_EQ(async_colors.size(), async_results.size());
+
+    std::multiset<std::vector<double> > points, async_points;
+    for (size_t i = 0; i < results.size(); i += 3)
+      points.insert(std::vector<double>(results.begin() + i, results.begin() + i + 3));
+    for (size_t i = 0; i < async_results.size(); i += 3)
+      async_points.insert(std::vector<double>(async_results.begin() + i, async_results.begin() + i + 3));
+    EXPECT_GT(points.size(), 0u);
+    EXPECT_TRUE(points == async_points);
+  }
+
+  // Visits every node once, with the state of the parent, and only a
+  // few files loading at a time
+  MegaTree tree(storage, 10 * 1024 * 1024, true);
+  unsigned num_nodes = 0, max_depth = 0;
+  AsyncTraversal traversal(tree, 2);
+  traversal.run(boost::bind(&countNode, &num_nodes, &max_depth, _1, _2));
+  EXPECT_GT(num_nodes, 5000u);
+  EXPECT_GT(max_depth, 10u);
+}
+
+
 TEST(MegaTreeBasics, ColorSanityCheck)
 {
   std::vector<double> tree_center(3, 0);
@@ -352,7 +898,7 @@ TEST(MegaTreeBasics, ColorSanityCheck)
   // Writes the tree to disk, and loads it as tree2.
   tree.flushCache();
   boost::shared_ptr<Storage> storage2(openStorage(tree_path->getPath()));
-  MegaTree tree2(storage2, 10000, true);
+  MegaTree tree2(storage2, 10 * 1024 * 1024, true);
   NodeHandle root2;
   tree2.getRoot(root2);
   root2.getColor(col);
@@ -394,6 +940,362 @@ TEST(MegaTreeBasics, ColorsAggregateProperly)
 }
 
 
+TEST(MegaTreeBasics, SharedCache)
+{
+  std::vector<double> tree_center(3, 0);
+  double tree_size = 1000000;
+
+  // Two trees with the same grid of points, spread over many small files
+  boost::shared_ptr<TempDir> tree_paths[2] = {createTempDir("tree1", true), createTempDir("tree2", true)};
+  for (unsigned t = 0; t < 2; t++)
+  {
+    boost::shared_ptr<Storage> storage(openStorage(tree_paths[t]->getPath()));
+    MegaTree tree(storage, tree_center, tree_size, 2, 1);
+    addGrid(tree, 8 * 8 * 8, 8, 1.0);
+  }
+
+  // The memory a tree takes once it is loaded
+  uint64_t tree_bytes;
+  size_t num_points;
+  {
+    boost::shared_ptr<Storage> storage(openStorage(tree_paths[0]->getPath()));
+    MegaTree tree(storage, 10 * 1024 * 1024, true);
+    queryAll(&tree, &num_points);
+    tree_bytes = tree.getCacheStats().total();
+  }
+
+  // The cache fits one and a half trees, and the second tree weighs twice as much
+  boost::shared_ptr<SharedCache> cache(new SharedCache(tree_bytes * 3 / 2));
+  boost::shared_ptr<Storage> storage1(openStorage(tree_paths[0]->getPath()));
+  boost::shared_ptr<Storage> storage2(openStorage(tree_paths[1]->getPath()));
+  MegaTree tree1(storage1, cache, true);
+  MegaTree tree2(storage2, cache, true, 2.0);
+
+  // While the second tree is idle, the first one takes what it needs
+  queryAll(&tree1, &num_points);
+  EXPECT_EQ(num_points, 8u * 8u * 8u);
+  EXPECT_GT(tree1.getCacheStats().total(), tree_bytes * 3 / 4);
+
+  // Once both trees are busy, the first one gives up memory, towards its
+  // share of a third.  The loads of the second tree wake up the eviction
+  // thread of the first one.
+  queryAll(&tree2, &num_points);
+  EXPECT_EQ(num_points, 8u * 8u * 8u);
+  tree2.waitForPrefetches();
+  tree1.waitForEviction();
+  EXPECT_LE(tree1.getCacheStats().total(), tree_bytes * 2 / 3);
+  EXPECT_GT(tree2.getCacheStats().total(), tree_bytes * 3 / 4);
+
+  CacheStats stats1 = tree1.getCacheStats();
+  std::vector<SharedCache::TreeUsage> usage = cache->getUsage();
+  ASSERT_EQ(usage.size(), 2u);
+  EXPECT_EQ(usage[0].tree, &tree1);
+  EXPECT_EQ(usage[1].weight, 2.0);
+  EXPECT_EQ(stats1.budget, usage[0].budget);
+
+  // The first tree still finds all of its points
+  queryAll(&tree1, &num_points);
+  EXPECT_EQ(num_points, 8u * 8u * 8u);
+}
+
+static void recordCheckpoint(unsigned* landed, unsigned checkpoint)
+{
+  *landed = checkpoint;
+}
+
+
+TEST(MegaTreeBasics, Checkpoint)
+{
+  std::vector<double> tree_center(3, 0);
+  double tree_size = 1000000;
+
+  boost::shared_ptr<TempDir> tree_path(createTempDir("tree1", true));
+  boost::shared_ptr<Storage> storage(openStorage(tree_path->getPath()));
+  MegaTree tree(storage, tree_center, tree_size, 2, 1);
+  addGrid(tree, 500, 8, 1.0);
+
+  // Points keep coming in while the checkpoint is written
+  unsigned landed = 0;
+  unsigned checkpoint = tree.checkpoint(boost::bind(&recordCheckpoint, &landed, _1));
+  std::vector<double> pt(3, 0.0f);
+  for (size_t i = 0; i < 500; ++i)
+  {
+    gridPoint(i, 8, 1.0, 0, pt);
+    pt[0] += 0.5;
+    addPoint(tree, pt);
+  }
+  tree.waitForCheckpoint(checkpoint);
+  EXPECT_TRUE(tree.checkpointLanded(checkpoint));
+  EXPECT_EQ(landed, checkpoint);
+
+  // Storage has the tree as it was when the checkpoint started
+  {
+    boost::shared_ptr<Storage> storage2(openStorage(tree_path->getPath()));
+    MegaTree tree2(storage2, 10 * 1024 * 1024, true);
+    EXPECT_EQ(tree2.getNumPoints(), 500u);
+    size_t num_points;
+    queryAll(&tree2, &num_points);
+    EXPECT_EQ(num_points, 500u);
+  }
+
+  // The next checkpoint has the rest
+  tree.waitForCheckpoint(tree.checkpoint());
+  boost::shared_ptr<Storage> storage3(openStorage(tree_path->getPath()));
+  MegaTree tree3(storage3, 10 * 1024 * 1024, true);
+  EXPECT_EQ(tree3.getNumPoints(), 1000u);
+}
+
+TEST(MegaTreeBasics, WorkingSet)
+{
+  std::vector<double> tree_center(3, 0);
+  double tree_size = 1000000;
+
+  boost::shared_ptr<TempDir> tree_path(createTempDir("tree1", true));
+  boost::shared_ptr<Storage> storage(openStorage(tree_path->getPath()));
+  {
+    MegaTree tree(storage, tree_center, tree_size, 2, 1, 10 * 1024 * 1024);
+    addGrid(tree, 5000, 20, 0.9, -9);
+  }
+
+  // Without a saved working set, the cache starts out empty
+  std::vector<double> lo(3, -5), hi(3, 5), results, colors;
+  unsigned num_files;
+  {
+    MegaTree tree(storage, 10 * 1024 * 1024, true);
+    tree.waitForPrefetches();
+    EXPECT_EQ(tree.getMissCount(), 0u);
+
+    tree.setSaveWorkingSet(true);
+    queryRange(tree, lo, hi, 0.1, results, colors);
+    num_files = tree.getMissCount();
+    EXPECT_GT(num_files, 1u);
+  }
+
+  // The next tree loads the files the last one used, and the same query
+  // finds them in the cache
+  MegaTree tree(storage, 10 * 1024 * 1024, true);
+  tree.waitForPrefetches();
+  EXPECT_EQ(tree.getMissCount(), num_files);
+  EXPECT_EQ(tree.getCacheStats().num_files, num_files);
+
+  tree.resetCount();
+  std::vector<double> warm_results;
+  queryRange(tree, lo, hi, 0.1, warm_results, colors);
+  EXPECT_EQ(tree.getMissCount(), 0u);
+  EXPECT_EQ(warm_results.size(), results.size());
+}
+
+// Storage that calls back before getAsync() and putAsync() return
+class ImmediateStorage : public Storage
+{
+public:
+  void getAsync(const boost::filesystem::path &path, GetCallback callback)
+  {
+    callback(files[path.string()]);
+  }
+
+  void putAsync(const boost::filesystem::path &path, const ByteVec &data, PutCallback callback)
+  {
+    files[path.string()] = data;
+    callback();
+  }
+
+  bool exists(const boost::filesystem::path &path) { return files.count(path.string()) > 0; }
+
+  std::string getType() { return "immediate"; }
+
+  std::map<std::string, ByteVec> files;
+};
+
+
+TEST(MegaTreeBasics, StorageBatches)
+{
+  // The batch calls don't miss reads and writes that finish right away
+  ImmediateStorage storage;
+  std::vector<boost::filesystem::path> paths;
+  std::vector<ByteVec> data;
+  for (unsigned i = 0; i < 3; i++)
+  {
+    paths.push_back(boost::filesystem::path("f") / std::string(1, '0' + i));
+    data.push_back(ByteVec(i + 1, i));
+  }
+  storage.putBatch(paths, data);
+
+  std::vector<ByteVec> results;
+  storage.getBatch(paths, results);
+  EXPECT_TRUE(results == data);
+
+  ByteVec result;
+  storage.get(paths[1], result);
+  EXPECT_TRUE(result == data[1]);
+}
+
+
+TEST(MegaTreeBasics, Shutdown)
+{
+  std::vector<double> tree_center(3, 0);
+  double tree_size = 1000000;
+
+  // The files that are being evicted when the tree is destructed are
+  // written before it returns
+  boost::shared_ptr<TempDir> tree_path(createTempDir("tree1", true));
+  boost::shared_ptr<Storage> storage(openStorage(tree_path->getPath()));
+  {
+    MegaTree tree(storage, tree_center, tree_size, 2, 1, 200 * 1024);
+    addGrid(tree, 5000, 20, 0.9, -9);
+  }
+
+  MegaTree tree(storage, 10 * 1024 * 1024, true);
+  EXPECT_EQ(tree.getNumPoints(), 5000u);
+  size_t num_points;
+  queryAll(&tree, &num_points);
+  EXPECT_EQ(num_points, 5000u);
+}
+
+// Adds the points one by one, in the order addPoints() adds them
+static void addPointsSorted(MegaTree& tree, const std::vector<double>& pts, const std::vector<double>& colors)
+{
+  std::vector<size_t> order(pts.size() / 3);
+  for (size_t i = 0; i < order.size(); i++)
+    order[i] = i;
+  sortMortonOrder(tree.getRootGeometry(), pts, order);
+
+  std::vector<double> pt(3), color(3);
+  for (size_t i = 0; i < order.size(); i++)
+  {
+    pt.assign(pts.begin() + 3 * order[i], pts.begin() + 3 * order[i] + 3);
+    color.assign(colors.begin() + 3 * order[i], colors.begin() + 3 * order[i] + 3);
+    addPoint(tree, pt, color);
+  }
+}
+
+
+TEST(MegaTreeBasics, ParallelAddPoints)
+{
+  std::vector<double> tree_center(3, 0);
+  double tree_size = 1000000;
+
+  boost::shared_ptr<TempDir> tree1_path(createTempDir("tree1", true));
+  boost::shared_ptr<Storage> storage1(openStorage(tree1_path->getPath()));
+  MegaTree tree1(storage1, tree_center, tree_size, 2, 1);
+
+  boost::shared_ptr<TempDir> tree2_path(createTempDir("tree2", true));
+  boost::shared_ptr<Storage> storage2(openStorage(tree2_path->getPath()));
+  MegaTree tree2(storage2, tree_center, tree_size, 2, 1, 200 * 1024);
+
+  // Two batches, so the second one goes into a tree that has leaves,
+  // summaries and evicted files already.  The tree ends up with the same
+  // nodes as a tree where the points got added one by one, in the same
+  // order.
+  srand(7);
+  for (unsigned batch = 0; batch < 2; batch++)
+  {
+    std::vector<double> pts, colors;
+    for (size_t i = 0; i < 3000; ++i)
+    {
+      for (unsigned j = 0; j < 3; j++)
+      {
+        pts.push_back((rand() % 2000) * 0.01 - 10);
+        colors.push_back(rand() % 256);
+      }
+    }
+    addPointsSorted(tree1, pts, colors);
+    addPoints(tree2, pts, colors, 4);
+  }
+
+  EXPECT_EQ(tree2.getNumPoints(), 6000u);
+  EXPECT_TRUE(tree1 == tree2);
+  size_t num_points1, num_points2;
+  queryAll(&tree1, &num_points1);
+  queryAll(&tree2, &num_points2);
+  EXPECT_EQ(num_points1, num_points2);
+}
+
+TEST(MegaTreeBasics, ParallelAddPointsOnCellEdges)
+{
+  // A root whose cells don't have round edges
+  std::vector<double> tree_center(3);
+  tree_center[0] = 0.1;
+  tree_center[1] = -0.37;
+  tree_center[2] = 3.3;
+  double tree_size = 77.7;
+
+  boost::shared_ptr<TempDir> tree1_path(createTempDir("tree1", true));
+  boost::shared_ptr<Storage> storage1(openStorage(tree1_path->getPath()));
+  MegaTree tree1(storage1, tree_center, tree_size, 2, 1);
+
+  boost::shared_ptr<TempDir> tree2_path(createTempDir("tree2", true));
+  boost::shared_ptr<Storage> storage2(openStorage(tree2_path->getPath()));
+  MegaTree tree2(storage2, tree_center, tree_size, 2, 1);
+
+  // Points on the low edges of cells, down to the depth the Morton order
+  // tells apart, go to the same children in the sort as in the tree
+  srand(13);
+  std::vector<double> pts, colors;
+  for (size_t i = 0; i < 3000; ++i)
+  {
+    NodeGeometry cell = tree1.getRootGeometry();
+    unsigned depth = 1 + rand() % 21;
+    for (unsigned d = 0; d < depth; d++)
+      cell = cell.getChild(rand() % 8);
+    for (unsigned j = 0; j < 3; j++)
+    {
+      pts.push_back(cell.getLo(j));
+      colors.push_back(rand() % 256);
+    }
+  }
+  addPointsSorted(tree1, pts, colors);
+  addPoints(tree2, pts, colors, 4);
+
+  EXPECT_EQ(tree2.getNumPoints(), 3000u);
+  EXPECT_TRUE(tree1 == tree2);
+}
+
+TEST(MegaTreeBasics, BatchInserter)
+{
+  std::vector<double> tree_center(3, 0);
+  double tree_size = 1000000;
+
+  boost::shared_ptr<TempDir> tree1_path(createTempDir("tree1", true));
+  boost::shared_ptr<Storage> storage1(openStorage(tree1_path->getPath()));
+  MegaTree tree1(storage1, tree_center, tree_size, 2, 1);
+
+  boost::shared_ptr<TempDir> tree2_path(createTempDir("tree2", true));
+  boost::shared_ptr<Storage> storage2(openStorage(tree2_path->getPath()));
+  MegaTree tree2(storage2, tree_center, tree_size, 2, 1);
+
+  // Batches that go into a tree that has points already give the same
+  // tree as adding the points of every batch one by one
+  const size_t BATCH_SIZE = 700;
+  srand(11);
+  {
+    BatchInserter inserter(tree2, BATCH_SIZE);
+    std::vector<double> pt(3, 0.0f), color(3, 0.0f);
+    std::vector<double> pts, colors;
+    for (size_t i = 0; i < 5000; ++i)
+    {
+      for (unsigned j = 0; j < 3; j++)
+      {
+        pt[j] = (rand() % 2000) * 0.01 - 10;
+        color[j] = rand() % 256;
+      }
+      inserter.addPoint(pt, color);
+
+      pts.insert(pts.end(), pt.begin(), pt.end());
+      colors.insert(colors.end(), color.begin(), color.end());
+      if (pts.size() == 3 * BATCH_SIZE || i == 4999)
+      {
+        addPointsSorted(tree1, pts, colors);
+        pts.clear();
+        colors.clear();
+      }
+    }
+  }
+
+  EXPECT_EQ(tree2.getNumPoints(), 5000u);
+  EXPECT_TRUE(tree1 == tree2);
+}
+
 // Run all the tests that were declared with TEST()
 int main(int argc, char **argv){
   testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,127 @@
+#include <gtest/gtest.h>
+#include <set>
+
+#include <megatree/cache.h>
+
+using namespace megatree;
+
+static int object;
+
+
+// Uses an object, and evicts objects until the cache holds at most
+// "capacity" objects.  Returns true on a hit.
+static bool access(Cache<int, int>& cache, int id, size_t capacity)
+{
+  Cache<int, int>::iterator it = cache.find(id);
+  if (!it.finished())
+  {
+    cache.touch(it);
+    return true;
+  }
+
+  cache.insert(id, &object);
+  while (cache.size() > capacity)
+  {
+    Cache<int, int>::iterator victim = cache.iterateVictims();
+    while (cache.spare(victim));
+    cache.erase(victim);
+  }
+  return false;
+}
+
+
+TEST(MegaTreeCache, Iterate)
+{
+  for (int policy = LRU_CACHE_POLICY; policy <= TWO_QUEUE_CACHE_POLICY; policy++)
+  {
+    Cache<int, int> cache((CachePolicy)policy);
+    for (int i = 0; i < 100; i++)
+      access(cache, i % 30 * 7 % 100, 20);
+    EXPECT_EQ(cache.size(), 20u);
+
+    // Both iterations visit every object once
+    std::set<int> ids, victims;
+    for (Cache<int, int>::iterator it = cache.iterate(); !it.finished(); it.next())
+      EXPECT_TRUE(ids.insert(it.id()).second);
+    for (Cache<int, int>::iterator it = cache.iterateVictims(); !it.finished(); it.previous())
+      EXPECT_TRUE(victims.insert(it.id()).second);
+    EXPECT_EQ(ids.size(), cache.size());
+    EXPECT_TRUE(ids == victims);
+    for (std::set<int>::iterator it = ids.begin(); it != ids.end(); it++)
+      EXPECT_FALSE(cache.find(*it).finished());
+  }
+}
+
+
+TEST(MegaTreeCache, Policies)
+{
+  EXPECT_EQ(parseCachePolicy("2q"), TWO_QUEUE_CACHE_POLICY);
+  EXPECT_EQ(cachePolicyName(CLOCK_CACHE_POLICY), "clock");
+
+  // LRU evicts the least recently used object
+  Cache<int, int> lru(LRU_CACHE_POLICY);
+  access(lru, 1, 3);
+  access(lru, 2, 3);
+  access(lru, 3, 3);
+  EXPECT_TRUE(access(lru, 1, 3));
+  access(lru, 4, 3);
+  EXPECT_TRUE(lru.find(2).finished());
+  EXPECT_FALSE(lru.find(1).finished());
+
+  // CLOCK gives the used object a second chance
+  Cache<int, int> clock(CLOCK_CACHE_POLICY);
+  access(clock, 1, 3);
+  access(clock, 2, 3);
+  access(clock, 3, 3);
+  EXPECT_TRUE(access(clock, 1, 3));
+  Cache<int, int>::iterator victim = clock.iterateVictims();
+  EXPECT_EQ(victim.id(), 1);
+  EXPECT_TRUE(clock.spare(victim));
+  EXPECT_EQ(victim.id(), 2);
+  EXPECT_FALSE(clock.spare(victim));
+  access(clock, 4, 3);
+  EXPECT_TRUE(clock.find(2).finished());
+  EXPECT_FALSE(clock.find(1).finished());
+}
+
+
+TEST(MegaTreeCache, ScanResistance)
+{
+  const size_t capacity = 100;
+  for (int policy = LRU_CACHE_POLICY; policy <= TWO_QUEUE_CACHE_POLICY; policy++)
+  {
+    Cache<int, int> cache((CachePolicy)policy);
+
+    // A hot set that is used over and over, among other objects
+    for (int round = 0; round < 5; round++)
+    {
+      for (int i = 0; i < 30; i++)
+        access(cache, i, capacity);
+      for (int i = 0; i < 100; i++)
+        access(cache, 100 + round * 100 + i, capacity);
+    }
+
+    // A scan over many more objects, using each one a few times in a row
+    for (int i = 10000; i < 11000; i++)
+      for (int j = 0; j < 4; j++)
+        access(cache, i, capacity);
+
+    unsigned hot = 0;
+    for (int i = 0; i < 30; i++)
+      hot += !cache.find(i).finished();
+    if (policy == TWO_QUEUE_CACHE_POLICY)
+    {
+      EXPECT_EQ(hot, 30u);
+    }
+    if (policy == LRU_CACHE_POLICY)
+    {
+      EXPECT_EQ(hot, 0u);
+    }
+  }
+}
+
+
+int main(int argc, char **argv){
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -52,7 +52,7 @@ TEST(LongId, Subtree)
   unsigned subtree_width = 5;
   unsigned subfolder_depth = 8;
   boost::shared_ptr<Storage> storage(openStorage(tree_path->getPath()));
-  MegaTree tree(storage, center, tree_size, subtree_width, subfolder_depth, 10000000);
+  MegaTree tree(storage, center, tree_size, subtree_width, subfolder_depth, 1024 * 1024 * 1024);
 
   id = IdType(01);
   root = tree.getFileId(id);
@@ -0,0 +1,360 @@
+#include <gtest/gtest.h>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <megatree/node_file.h>
+#include <megatree/node_file_format.h>
+#include <megatree/short_id.h>
+
+using namespace megatree;
+
+
+// Fills a node file with nodes on the given short ids, and returns
+// copies of the nodes.
+static void fillNodeFile(NodeFile& file, const std::vector<ShortId>& short_ids, std::vector<Node>& nodes)
+{
+  double center[] = {0, 0, 0};
+  NodeGeometry geometry(center, 10.0);
+
+  file.deserialize();
+  nodes.clear();
+  for (size_t i = 0; i < short_ids.size(); i++)
+  {
+    double pt[] = {-4.0 + i * 0.01, 1.0, 3.0 - i * 0.001};
+    double col[] = {double(i % 256), 100, 200};
+    Node* node = file.createNode(short_ids[i]);
+    node->setPoint(geometry, pt, col, i % 10 == 0 ? Count(1) << (i % 64) : i + 1);
+    node->setChild(i % 8);
+    nodes.push_back(*node);
+    file.releaseNode(node, short_ids[i], true);
+  }
+}
+
+
+static void expectSameNodes(NodeFile& file, const std::vector<ShortId>& short_ids, const std::vector<Node>& nodes)
+{
+  EXPECT_EQ(file.cacheSize(), short_ids.size());
+  for (size_t i = 0; i < short_ids.size(); i++)
+  {
+    Node* node = file.readNode(short_ids[i]);
+    ASSERT_TRUE(node);
+    EXPECT_TRUE(*node == nodes[i]);
+    EXPECT_EQ(node->getCount(), nodes[i].getCount());
+    file.releaseNode(node, short_ids[i], false);
+  }
+}
+
+
+static void countCall(unsigned* calls)
+{
+  (*calls)++;
+}
+
+
+TEST(MegaTreeNodeFile, WhenLoaded)
+{
+  NodeFile file("f", 12, 3);
+  ByteVec buffer;
+  {
+    NodeFile source("f", 12, 3);
+    std::vector<ShortId> short_ids(1, 012);
+    std::vector<Node> nodes;
+    fillNodeFile(source, short_ids, nodes);
+    source.serialize(buffer);
+    source.setWritten();
+  }
+
+  // The callbacks wait for the file, like the waiting thread
+  unsigned calls = 0;
+  file.whenLoaded(boost::bind(&countCall, &calls));
+  boost::thread waiter(boost::bind(&NodeFile::waitUntilLoaded, &file));
+  file.runLoadedCallbacks();
+  EXPECT_EQ(calls, 0u);
+  EXPECT_FALSE(waiter.timed_join(boost::posix_time::milliseconds(10)));
+
+  file.deserialize(buffer);
+  waiter.join();
+  EXPECT_EQ(calls, 0u);
+  file.runLoadedCallbacks();
+  EXPECT_EQ(calls, 1u);
+  file.runLoadedCallbacks();
+  EXPECT_EQ(calls, 1u);
+
+  // Once the file is loaded, callbacks run right away
+  file.whenLoaded(boost::bind(&countCall, &calls));
+  EXPECT_EQ(calls, 2u);
+}
+
+
+TEST(MegaTreeNodeFile, ShortIdTrie)
+{
+  std::vector<ShortId> short_ids, decoded;
+  short_ids.push_back(0);
+  short_ids.push_back(07);
+  short_ids.push_back(0123);
+  short_ids.push_back(0124);
+  short_ids.push_back(0777);
+
+  ByteVec buffer(1, 0);
+  encodeShortIds(short_ids, 3, false, buffer);
+  EXPECT_NE(decodeShortIds(&buffer[0], buffer.size(), decoded), 0u);
+  EXPECT_EQ(decoded, short_ids);
+
+  // The root file holds the root node and its descendants
+  short_ids.clear();
+  short_ids.push_back(1);
+  short_ids.push_back(013);
+  short_ids.push_back(017);
+  short_ids.push_back(0170);
+  short_ids.push_back(0175);
+
+  buffer.assign(1, 0);
+  encodeShortIds(short_ids, 0, true, buffer);
+  EXPECT_NE(decodeShortIds(&buffer[0], buffer.size(), decoded), 0u);
+  EXPECT_EQ(decoded, short_ids);
+
+  // An empty node file
+  short_ids.clear();
+  buffer.assign(1, 0);
+  encodeShortIds(short_ids, 4, false, buffer);
+  EXPECT_NE(decodeShortIds(&buffer[0], buffer.size(), decoded), 0u);
+  EXPECT_TRUE(decoded.empty());
+}
+
+
+TEST(MegaTreeNodeFile, SerializeVersions)
+{
+  std::vector<ShortId> short_ids;
+  for (ShortId id = 3; id < 010000; id += 37)
+    short_ids.push_back(id);
+
+  size_t v11_size = 0;
+  for (unsigned version = 11; version <= 12; version++)
+  {
+    NodeFile file("f123", version, 4);
+    std::vector<Node> nodes;
+    fillNodeFile(file, short_ids, nodes);
+    file.setChildFile(5);
+
+    ByteVec buffer;
+    file.serialize(buffer);
+    file.setWritten();
+    if (version == 11)
+      v11_size = buffer.size();
+    else
+      EXPECT_LT(buffer.size(), v11_size * 2 / 3);
+
+    NodeFile copy("f123", version, 4);
+    copy.deserialize(buffer);
+    EXPECT_TRUE(copy.hasChildFile(5));
+    EXPECT_FALSE(copy.hasChildFile(4));
+    expectSameNodes(copy, short_ids, nodes);
+
+    // The same, lazily from a shared buffer
+    NodeFile lazy_copy("f123", version, 4);
+    lazy_copy.deserialize(ByteBufferPtr(new ByteVecBuffer(buffer)));
+    expectSameNodes(lazy_copy, short_ids, nodes);
+  }
+}
+
+
+TEST(MegaTreeNodeFile, SerializeRootFile)
+{
+  // The top three levels of a tree
+  std::vector<ShortId> short_ids;
+  short_ids.push_back(1);
+  for (ShortId id = 010; id < 020; id += 3)
+    short_ids.push_back(id);
+  for (ShortId id = 0100; id < 0200; id++)
+    if ((id >> 3) % 3 == 2)
+      short_ids.push_back(id);
+
+  NodeFile file("f", 12, 3, true);
+  std::vector<Node> nodes;
+  fillNodeFile(file, short_ids, nodes);
+
+  ByteVec buffer;
+  file.serialize(buffer);
+  file.setWritten();
+
+  NodeFile copy("f", 12, 3, true);
+  copy.deserialize(buffer);
+  expectSameNodes(copy, short_ids, nodes);
+}
+
+
+TEST(MegaTreeNodeFile, Residuals)
+{
+  // Nodes on a plane through the node file are well predicted by their parents
+  std::vector<ShortId> short_ids;
+  std::vector<NodeRecord> records;
+  for (ShortId id = 0; id < 01000; id++)
+  {
+    if (((id >> Z_BIT) & 0111) != 0101)
+      continue;
+    NodeRecord record;
+    record.point[0] = 32768 + id % 7;
+    record.point[1] = 32768 - id % 5;
+    record.point[2] = 26214 + id % 3;
+    record.color[0] = record.color[1] = 100;
+    record.color[2] = 50 + id % 3;
+    record.children = id & 0xff;
+    record.count = id % 5 + 1;
+    short_ids.push_back(id);
+    records.push_back(record);
+  }
+
+  ByteVec buffer;
+  encodeNodeFile(3, 3, false, short_ids, records, buffer);
+  EXPECT_TRUE(buffer[2] & NODE_FILE_RESIDUALS);
+
+  uint8_t child_files;
+  std::vector<ShortId> decoded_ids;
+  std::vector<NodeRecord> decoded;
+  ASSERT_TRUE(decodeNodeFile(&buffer[0], buffer.size(), child_files, decoded_ids, decoded));
+  EXPECT_EQ(child_files, 3);
+  EXPECT_EQ(decoded_ids, short_ids);
+  ASSERT_EQ(decoded.size(), records.size());
+  for (size_t i = 0; i < records.size(); i++)
+  {
+    for (unsigned k = 0; k < 3; k++)
+    {
+      EXPECT_EQ(decoded[i].point[k], records[i].point[k]);
+      EXPECT_EQ(decoded[i].color[k], records[i].color[k]);
+    }
+    EXPECT_EQ(decoded[i].children, records[i].children);
+    EXPECT_EQ(decoded[i].count, records[i].count);
+  }
+
+  // A cut off file is detected
+  EXPECT_FALSE(decodeNodeFile(&buffer[0], buffer.size() / 2, child_files, decoded_ids, decoded));
+}
+
+
+TEST(MegaTreeNodeFile, IndexedLayout)
+{
+  std::vector<ShortId> short_ids;
+  for (ShortId id = 5; id < 010000; id += 29)
+    short_ids.push_back(id);
+
+  NodeFile file("f123", 12, 4, false, INDEXED_NODE_LAYOUT);
+  std::vector<Node> nodes;
+  fillNodeFile(file, short_ids, nodes);
+  file.setChildFile(2);
+
+  ByteVec buffer;
+  file.serialize(buffer);
+  file.setWritten();
+  EXPECT_TRUE(buffer[2] & NODE_FILE_INDEXED);
+
+  // Single nodes are found without decoding the file
+  IndexedNodeFileReader reader;
+  ASSERT_TRUE(reader.open(&buffer[0], buffer.size()));
+  EXPECT_EQ(reader.numRecords(), short_ids.size());
+  size_t index;
+  for (size_t i = 0; i < short_ids.size(); i++)
+  {
+    ASSERT_TRUE(reader.find(short_ids[i], index));
+    EXPECT_EQ(index, i);
+    EXPECT_FALSE(reader.find(short_ids[i] + 1, index));
+  }
+  EXPECT_FALSE(reader.find(010000 + short_ids[0], index));
+
+  NodeFile lazy_copy("f123", 12, 4);
+  lazy_copy.deserialize(ByteBufferPtr(new ByteVecBuffer(buffer)));
+  EXPECT_TRUE(lazy_copy.hasChildFile(2));
+  expectSameNodes(lazy_copy, short_ids, nodes);
+
+  NodeFile copy("f123", 12, 4);
+  copy.deserialize(buffer);
+  expectSameNodes(copy, short_ids, nodes);
+
+  // The root file holds nodes on several levels
+  short_ids.clear();
+  short_ids.push_back(1);
+  for (ShortId id = 010; id < 020; id += 2)
+    short_ids.push_back(id);
+  for (ShortId id = 0100; id < 0200; id += 3)
+    if ((id >> 3) % 2 == 0)
+      short_ids.push_back(id);
+
+  NodeFile root("f", 12, 3, true, INDEXED_NODE_LAYOUT);
+  fillNodeFile(root, short_ids, nodes);
+  root.serialize(buffer);
+  root.setWritten();
+
+  NodeFile lazy_root("f", 12, 3, true);
+  lazy_root.deserialize(ByteBufferPtr(new ByteVecBuffer(buffer)));
+  expectSameNodes(lazy_root, short_ids, nodes);
+  ASSERT_TRUE(reader.open(&buffer[0], buffer.size()));
+  EXPECT_FALSE(reader.find(011, index));
+  EXPECT_FALSE(reader.find(01000, index));
+}
+
+
+TEST(MegaTreeNodeFile, ShortIdAxis)
+{
+  // x digits 1 0 1, y digits 0 1 1, z digits 1 1 0
+  ShortId short_id = (05 << 6) | (03 << 3) | 06;
+  EXPECT_EQ(shortIdAxis(short_id, X_BIT), 05u);
+  EXPECT_EQ(shortIdAxis(short_id, Y_BIT), 03u);
+  EXPECT_EQ(shortIdAxis(short_id, Z_BIT), 06u);
+  EXPECT_EQ(shortIdAxis(07777777777, X_BIT), 01777u);
+
+  EXPECT_EQ(rootFileDepth(1), 0u);
+  EXPECT_EQ(rootFileDepth(017), 1u);
+  EXPECT_EQ(rootFileDepth(01234), 3u);
+  EXPECT_EQ(parentFileShortId(0123, 4, 3), 0412u);
+}
+
+
+TEST(MegaTreeNodeFile, InitializeFromChildren)
+{
+  for (unsigned width = 2; width <= 8; width += 3)
+  {
+    // Two child files with the same nodes
+    std::vector<ShortId> short_ids;
+    for (ShortId id = 0; id < (1u << (3 * width)); id += (1u << (3 * width)) / 300 + 1)
+      short_ids.push_back(id);
+
+    std::vector<boost::shared_ptr<NodeFile> > children(8);
+    std::vector<Node> nodes;
+    for (unsigned i = 2; i < 8; i += 5)
+    {
+      children[i].reset(new NodeFile("f12", 12, width));
+      fillNodeFile(*children[i], short_ids, nodes);
+      children[i]->setWritten();
+    }
+
+    NodeFile parent("f1", 12, width);
+    parent.initializeFromChildren("f1", children);
+    parent.setWritten();
+    EXPECT_TRUE(parent.hasChildFile(2));
+    EXPECT_TRUE(parent.hasChildFile(7));
+    EXPECT_FALSE(parent.hasChildFile(3));
+
+    // The parent of every node, in both files
+    for (size_t i = 0; i < short_ids.size(); i++)
+    {
+      for (unsigned child = 2; child < 8; child += 5)
+      {
+        ShortId parent_id = parentFileShortId(short_ids[i], child, width);
+        Node* node = parent.readNode(parent_id);
+        ASSERT_TRUE(node);
+        EXPECT_TRUE(node->hasChild(short_ids[i] & 7));
+        parent.releaseNode(node, parent_id, false);
+      }
+    }
+
+    ByteVec bytesize;
+    parent.serializeBytesize(bytesize);
+    EXPECT_EQ(bytesize.size(), 1 + parent.cacheSize() * 6);
+  }
+}
+
+
+int main(int argc, char **argv){
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
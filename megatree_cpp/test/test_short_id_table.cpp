@@ -0,0 +1,92 @@
+#include <gtest/gtest.h>
+#include <vector>
+#include <algorithm>
+
+#include <megatree/short_id_table.h>
+
+using namespace megatree;
+
+
+TEST(MegaTreeShortIdTable, InsertAndFind)
+{
+  ShortIdTable<int> table;
+  EXPECT_TRUE(table.empty());
+  EXPECT_FALSE(table.find(3));
+
+  *table.insert(3) = 30;
+  *table.insert(017) = 150;
+  EXPECT_EQ(table.size(), 2u);
+  EXPECT_EQ(*table.find(3), 30);
+  EXPECT_EQ(*table.find(017), 150);
+  EXPECT_FALSE(table.find(4));
+
+  // inserting an existing id returns the existing object
+  EXPECT_EQ(*table.insert(3), 30);
+  EXPECT_EQ(table.size(), 2u);
+}
+
+
+TEST(MegaTreeShortIdTable, PointersStayValid)
+{
+  ShortIdTable<int> table;
+  int* first = table.insert(1000);
+  *first = 42;
+
+  // grow the table well past its first block and hash table size
+  for (ShortId id = 0; id < 5000; id++)
+    if (id != 1000)
+      *table.insert(id) = id;
+
+  EXPECT_EQ(table.size(), 5000u);
+  EXPECT_EQ(first, table.find(1000));
+  EXPECT_EQ(*first, 42);
+  for (ShortId id = 0; id < 5000; id++)
+  {
+    if (id != 1000)
+    {
+      EXPECT_EQ(*table.find(id), (int)id);
+    }
+  }
+}
+
+
+TEST(MegaTreeShortIdTable, IterateAndSort)
+{
+  std::vector<ShortId> ids;
+  for (ShortId id = 0; id < 300; id++)
+    ids.push_back(id * 7);
+  std::random_shuffle(ids.begin(), ids.end());
+
+  ShortIdTable<int> table;
+  table.reserve(ids.size());
+  for (size_t i = 0; i < ids.size(); i++)
+    *table.insert(ids[i]) = i;
+
+  // iteration follows insertion order
+  size_t i = 0;
+  for (ShortIdTable<int>::Iterator it = table.iterate(); !it.finished(); it.next(), i++)
+  {
+    EXPECT_EQ(it.id(), ids[i]);
+    EXPECT_EQ(*it.get(), (int)i);
+  }
+  EXPECT_EQ(i, ids.size());
+
+  std::vector<ShortIdTable<int>::Entry> entries;
+  table.getSorted(entries);
+  ASSERT_EQ(entries.size(), ids.size());
+  for (size_t i = 0; i < entries.size(); i++)
+  {
+    EXPECT_EQ(entries[i].first, i * 7);
+    EXPECT_EQ(entries[i].second, table.find(i * 7));
+  }
+
+  table.clear();
+  EXPECT_TRUE(table.empty());
+  EXPECT_FALSE(table.find(7));
+}
+
+
+int main(int argc, char **argv){
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -17,7 +17,8 @@ using namespace megatree;
 static unsigned long total_points = 0;
 static Tictoc overall_timer;
 
-void importTxt(MegaTree &tree, const boost::filesystem::path &path, unsigned long max_intensity, unsigned int *skip = NULL)
+void importTxt(MegaTree &tree, const boost::filesystem::path &path, unsigned long max_intensity,
+               size_t batch_size, unsigned num_threads, unsigned int *skip = NULL)
 {
   printf("Loading pts file: %s\n", path.string().c_str());
   std::ifstream fin;
@@ -31,8 +32,8 @@ void importTxt(MegaTree &tree, const boost::filesystem::path &path, unsigned lon
   std::vector<double> point(3, 0.0);
   std::vector<double> color(3, 0.0);
 
-  // construct fast adding structure
-  TreeFastCache tree_cache(tree);
+  // Adds the points in batches
+  BatchInserter inserter(tree, batch_size, num_threads);
 
   while (!fin.eof())
   {
@@ -56,7 +57,7 @@ void importTxt(MegaTree &tree, const boost::filesystem::path &path, unsigned lon
       printf("%8.1f   %s\n", overall_timer.toc(), tree.toString().c_str());
       tree.resetCount();
     }
-    tree_cache.addPoint(point, color);
+    inserter.addPoint(point, color);
 
     ++total_points;
     /*
@@ -69,16 +70,19 @@ void importTxt(MegaTree &tree, const boost::filesystem::path &path, unsigned lon
     
     ++i;
   }
+  inserter.flush();
   printf("%s\n", tree.toString().c_str());
   tree.resetCount();
 }
 
 
 struct arguments_t {
-  int cache_size;
+  uint64_t cache_size;
   char* tree;
   unsigned int skip;
   unsigned long max_intensity;
+  size_t batch_size;
+  unsigned num_threads;
   std::vector<std::string> las_filenames;
 };
 
@@ -102,6 +106,12 @@ static int parse_opt(int key, char *arg, struct argp_state *state)
   case 'i':
     arguments->max_intensity = atol(arg);
     break;
+  case 'b':
+    arguments->batch_size = parseNumberSuffixed(arg);
+    break;
+  case 'j':
+    arguments->num_threads = atoi(arg);
+    break;
   case ARGP_KEY_ARG:
     arguments->las_filenames.push_back(arg);
     break;
@@ -114,23 +124,27 @@ int main (int argc, char** argv)
 {
   // Default command line arguments
   struct arguments_t arguments;
-  arguments.cache_size = 3000000;
+  arguments.cache_size = 1024 * 1024 * 1024;
   arguments.max_intensity = 255;  // 16384
   arguments.skip = 0;
+  arguments.batch_size = BatchInserter::DEFAULT_BATCH_SIZE;
+  arguments.num_threads = 1;
   arguments.tree = 0;
   
   // Parses command line options
   struct argp_option options[] = {
-    {"cache-size", 'c', "SIZE",   0,     "Cache size"},
+    {"cache-size", 'c', "SIZE",   0,     "Memory budget of the cache, in bytes"},
     {"tree",       't', "TREE",   0,     "Path to tree"},
     {"skip",       's', "SKIP",   0,     "Number of points to skip"},
     {"max-intensity",  'i', "INTENSITY",  0,     "Maximum intensity value"},
+    {"batch-size", 'b', "POINTS", 0,     "Number of points that get added at once"},
+    {"threads",    'j', "THREADS", 0,     "Number of threads that add points"},
     { 0 }
   };
   struct argp argp = { options, parse_opt };
   int parse_ok = argp_parse(&argp, argc, argv, 0, 0, &arguments);
   printf("Arguments parsed: %d\n", parse_ok);
-  printf("Cache size: %d\n", arguments.cache_size);
+  printf("Cache size: %llu bytes\n", (unsigned long long)arguments.cache_size);
   printf("Tree: %s\n", arguments.tree);
   if (arguments.skip > 0)
     printf("Skipping %u points\n", arguments.skip);
@@ -143,6 +157,7 @@ int main (int argc, char** argv)
 
   boost::shared_ptr<Storage> storage(openStorage(arguments.tree));
   MegaTree tree(storage, arguments.cache_size, false);
+  tree.setSaveWorkingSet(true);  // The next import starts with the files this one used
 
   overall_timer.tic();
   
@@ -153,7 +168,8 @@ int main (int argc, char** argv)
     printf("Importing %s into tree\n", las_path.string().c_str());
 
     Tictoc one_file_timer;
-    importTxt(tree, las_path, arguments.max_intensity, &arguments.skip);
+    importTxt(tree, las_path, arguments.max_intensity, arguments.batch_size, arguments.num_threads,
+              &arguments.skip);
     float t = one_file_timer.toc();
     printf("Flushing %s...\n", las_path.string().c_str());
     tree.flushCache();
@@ -1,14 +1,29 @@
 #ifndef MEGATREE_COMPRESS_H
 #define MEGATREE_COMPRESS_H
 
+#include <string>
 #include <megatree/storage.h>
 
 namespace megatree
 {
 
+  // Codecs for compressing the stored data.  Compressed data starts
+  // with the codec that was used, so extract() doesn't need to be told.
+  enum CompressionCodec
+  {
+    NO_COMPRESSION = 0,
+    ZLIB_COMPRESSION = 1
+  };
+
+  // Converts between codecs and their names in metadata.ini
+  CompressionCodec parseCompressionCodec(const std::string& name);
+  std::string compressionCodecName(CompressionCodec codec);
+
+  // Copies "num" bits from position "src_pos" of src to position "dest_pos" of dest.
   void bitcpy(uint64_t& dest, uint64_t src, unsigned dest_pos, unsigned src_pos, unsigned num);
 
-  void compress(const ByteVec& data, ByteVec& res);
+  void compress(const ByteVec& data, ByteVec& res, CompressionCodec codec);
+  void compress(const ByteVec& data, ByteVec& res);  // zlib
   void extract(const ByteVec& data, ByteVec& res);
 
 
@@ -0,0 +1,51 @@
+#ifndef MEGATREE_COMPRESSED_STORAGE_H_
+#define MEGATREE_COMPRESSED_STORAGE_H_
+
+#include <megatree/storage.h>
+#include <megatree/compress.h>
+#include <megatree/function_caller.h>
+
+namespace megatree {
+
+// Storage that compresses the data before handing it to another
+// storage, and extracts it again when it is read back.  The tree's
+// metadata files are passed through as they are.
+//
+// Extracting runs in the callback of the wrapped storage, on its worker
+// threads.  Compressing runs on a thread pool of its own, before the
+// compressed data is handed to the wrapped storage.
+class CompressedStorage : public Storage
+{
+public:
+  CompressedStorage(boost::shared_ptr<Storage> _storage, CompressionCodec _codec)
+    : storage(_storage), codec(_codec), function_caller(2) {}
+  ~CompressedStorage() {}
+
+  virtual void get(const boost::filesystem::path &path, ByteVec &result);
+  virtual void getBatch(const std::vector<boost::filesystem::path> &paths, std::vector<ByteVec> &results);
+  virtual void putBatch(const std::vector<boost::filesystem::path> &paths, std::vector<ByteVec> &data);
+
+  virtual void getAsync(const boost::filesystem::path &path, GetCallback callback);
+  virtual void getBatchAsync(const std::vector<boost::filesystem::path> &paths, const std::vector<GetCallback> &callbacks);
+  virtual void putAsync(const boost::filesystem::path &path, const ByteVec& data, PutCallback callback);
+  virtual bool exists(const boost::filesystem::path &path) { return storage->exists(path); }
+
+  virtual std::string getType() {return std::string("CompressedStorage(") + storage->getType() + ")"; };
+
+private:
+  boost::shared_ptr<Storage> storage;
+  CompressionCodec codec;
+  FunctionCaller function_caller;
+
+  static bool isCompressed(const boost::filesystem::path &path)
+  {
+    return !(path == "metadata.ini" || path == "views.ini" || path == "working_set.txt");
+  }
+
+  void extractCb(GetCallback callback, const ByteVec& data);
+  void compressFunction(const boost::filesystem::path &path, const ByteVec &data, PutCallback callback);
+};
+
+}
+
+#endif
@@ -22,13 +22,16 @@ public:
   virtual void putBatch(const std::vector<boost::filesystem::path> &paths, std::vector<ByteVec> &data);
   
   virtual void getAsync(const boost::filesystem::path &path, GetCallback callback);
+  virtual void getBufferAsync(const boost::filesystem::path &path, GetBufferCallback callback);
   virtual void putAsync(const boost::filesystem::path &path, const ByteVec& data, PutCallback callback);
+  virtual bool exists(const boost::filesystem::path &path);
   
   virtual std::string getType() {return std::string("DiskStorage"); };
 private:
   boost::filesystem::path root;
   FunctionCaller function_caller;
   void readerFunction(const boost::filesystem::path &path, GetCallback callback);
+  void bufferReaderFunction(const boost::filesystem::path &path, GetBufferCallback callback);
   void writerFunction(const boost::filesystem::path &path, const ByteVec &data, PutCallback callback);
 };
 
@@ -39,7 +39,9 @@ public:
   virtual void putBatch(const std::vector<boost::filesystem::path> &paths, std::vector<ByteVec> &data);
 
   virtual void getAsync(const boost::filesystem::path &path, GetCallback callback);
+  virtual void getBatchAsync(const std::vector<boost::filesystem::path> &paths, const std::vector<GetCallback> &callbacks);
   virtual void putAsync(const boost::filesystem::path &path, const ByteVec& data, PutCallback callback);
+  virtual bool exists(const boost::filesystem::path &path);
   
   virtual std::string getType() {return std::string("HBaseStorage"); };
 
@@ -5,6 +5,7 @@
 #include <megatree/tree_common.h>
 #include <boost/filesystem.hpp>
 #include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/condition.hpp>
 #include <boost/bind.hpp>
@@ -12,6 +13,33 @@
 namespace megatree {
 
 
+// Read-only view on the contents of a stored file.  Storages hand these
+// out when the caller wants to hold on to the data without copying it,
+// for instance a file that is mapped into memory.
+class ByteBuffer
+{
+public:
+  virtual ~ByteBuffer() {}
+  virtual const uint8_t* data() const = 0;
+  virtual size_t size() const = 0;
+};
+typedef boost::shared_ptr<const ByteBuffer> ByteBufferPtr;
+
+
+// Byte buffer that owns its data.
+class ByteVecBuffer : public ByteBuffer
+{
+public:
+  ByteVecBuffer() {}
+  ByteVecBuffer(const ByteVec& _bytes) : bytes(_bytes) {}
+
+  const uint8_t* data() const { return bytes.empty() ? NULL : &bytes[0]; }
+  size_t size() const { return bytes.size(); }
+
+  ByteVec bytes;
+};
+
+
 
 class Storage
 {
@@ -36,16 +64,18 @@ public:
   {
     results.resize(paths.size());
     unsigned remaining = paths.size();
+    boost::mutex get_mutex;
     boost::condition get_condition;
 
     // Async call to retrieve data
     for (size_t i = 0; i < paths.size(); ++i)
-      getAsync(paths[i], boost::bind(&Storage::getDataCb, this, boost::ref(get_condition), boost::ref(remaining), _1, boost::ref(results[i])));
+      getAsync(paths[i], boost::bind(&Storage::getDataCb, this, boost::ref(get_mutex), boost::ref(get_condition),
+                                     boost::ref(remaining), _1, boost::ref(results[i])));
 
     // Wait for all data to arrive
-    boost::mutex get_mutex;
     boost::mutex::scoped_lock lock(get_mutex);
-    get_condition.wait(get_mutex);
+    while (remaining > 0)
+      get_condition.wait(lock);
   }
 
   virtual void put(const boost::filesystem::path &path, const ByteVec &data)
@@ -61,16 +91,18 @@ public:
   {
     assert(paths.size() == data.size());
     unsigned remaining = paths.size();
+    boost::mutex put_mutex;
     boost::condition put_condition;
 
     // Async call to send data
     for (size_t i = 0; i < paths.size(); ++i)
-      putAsync(paths[i], data[i], boost::bind(&Storage::putDataCb, this, boost::ref(put_condition), boost::ref(remaining)));
+      putAsync(paths[i], data[i], boost::bind(&Storage::putDataCb, this, boost::ref(put_mutex), boost::ref(put_condition),
+                                              boost::ref(remaining)));
 
     // Wait for all data to be sent
-    boost::mutex put_mutex;
     boost::mutex::scoped_lock lock(put_mutex);
-    put_condition.wait(put_mutex);
+    while (remaining > 0)
+      put_condition.wait(lock);
   }
 
 
@@ -78,8 +110,40 @@ public:
   virtual void getAsync(const boost::filesystem::path &path, GetCallback callback) = 0;
 
 
+  // Retrieves a file as a shared byte buffer.  Storages that can avoid
+  // copying the data override this, the default copies the data that
+  // getAsync() returns.
+  typedef boost::function<void(const ByteBufferPtr&)> GetBufferCallback;
+  virtual void getBufferAsync(const boost::filesystem::path &path, GetBufferCallback callback)
+  {
+    getAsync(path, boost::bind(&Storage::getBufferCb, callback, _1));
+  }
+
+
+  // Retrieves a batch of files, calling callbacks[i] with the data of
+  // paths[i].  Storages that read a batch of files faster than the same
+  // files one by one override these, the defaults issue the reads one
+  // at a time.
+  virtual void getBatchAsync(const std::vector<boost::filesystem::path> &paths, const std::vector<GetCallback> &callbacks)
+  {
+    assert(paths.size() == callbacks.size());
+    for (size_t i = 0; i < paths.size(); ++i)
+      getAsync(paths[i], callbacks[i]);
+  }
+
+  virtual void getBufferBatchAsync(const std::vector<boost::filesystem::path> &paths, const std::vector<GetBufferCallback> &callbacks)
+  {
+    assert(paths.size() == callbacks.size());
+    for (size_t i = 0; i < paths.size(); ++i)
+      getBufferAsync(paths[i], callbacks[i]);
+  }
+
+
   typedef boost::function<void(void)> PutCallback;
   virtual void putAsync(const boost::filesystem::path &path, const ByteVec &data, PutCallback callback) = 0;
+
+  // Whether the file is in the storage.  Reading a file that isn't is an error.
+  virtual bool exists(const boost::filesystem::path &path) = 0;
   
   virtual std::string getType() = 0;
 
@@ -87,19 +151,26 @@ protected:
   Storage() {}
   
 private:
-  void getDataCb(boost::condition& get_condition, unsigned& remaining, const ByteVec& data_in, ByteVec& data)
+  static void getBufferCb(GetBufferCallback callback, const ByteVec& data)
+  {
+    callback(ByteBufferPtr(new ByteVecBuffer(data)));
+  }
+
+  void getDataCb(boost::mutex& get_mutex, boost::condition& get_condition, unsigned& remaining,
+                 const ByteVec& data_in, ByteVec& data)
   {
-    remaining--;
     data = data_in;
-    
+
+    boost::mutex::scoped_lock lock(get_mutex);
+    remaining--;
     if (remaining == 0)
       get_condition.notify_one();
   }
 
-  void putDataCb(boost::condition& put_condition, unsigned& remaining)
+  void putDataCb(boost::mutex& put_mutex, boost::condition& put_condition, unsigned& remaining)
   {
+    boost::mutex::scoped_lock lock(put_mutex);
     remaining--;
-    
     if (remaining == 0)
       put_condition.notify_one();
   }
@@ -15,6 +15,7 @@ public:
   virtual void get(const boost::filesystem::path &path, ByteVec &result);
   virtual void getBatch(const std::vector<boost::filesystem::path> &paths, std::vector<ByteVec> &results);
   virtual void getAsync(const boost::filesystem::path &path, GetCallback callback);
+  virtual bool exists(const boost::filesystem::path &path) { return storage->exists(path); }
 
   // type
   virtual std::string getType() {return std::string("VizStorage"); };
@@ -29,9 +30,15 @@ public:
 private:
   boost::filesystem::path tree;
   boost::shared_ptr<Storage> storage;
-  unsigned subtree_width;
+  unsigned subtree_width, version;
+
+  // Converted nodes take 3 bytes for position, 3 for color
+  const static size_t STRIDE = 3 + 3;
 
   void convert(const ByteVec& data_in, ByteVec& data_out);
+  void convertV12(const ByteVec& data_in, ByteVec& data_out);
+  // "levels" is the depth of the node below the top of its file
+  void convertNode(ShortId short_id, unsigned levels, const uint8_t* color, uint8_t children, uint8_t* res);
   void convertCb(const boost::filesystem::path &path, GetCallback cb, const ByteVec& data);
 };
 
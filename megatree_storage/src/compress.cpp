@@ -0,0 +1,136 @@
+#include <megatree/compress.h>
+#include <megatree/node_file_format.h>  // for the varint functions
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+namespace megatree
+{
+
+// Compressed data looks like:  [codec] [varint uncompressed size] [payload]
+
+
+CompressionCodec parseCompressionCodec(const std::string& name)
+{
+  if (name == "none")
+    return NO_COMPRESSION;
+  if (name == "zlib")
+    return ZLIB_COMPRESSION;
+
+  fprintf(stderr, "Unknown compression codec: %s\n", name.c_str());
+  abort();
+}
+
+
+std::string compressionCodecName(CompressionCodec codec)
+{
+  switch (codec)
+  {
+  case NO_COMPRESSION:
+    return "none";
+  case ZLIB_COMPRESSION:
+    return "zlib";
+  }
+  fprintf(stderr, "Unknown compression codec: %d\n", (int)codec);
+  abort();
+}
+
+
+void bitcpy(uint64_t& dest, uint64_t src, unsigned dest_pos, unsigned src_pos, unsigned num)
+{
+  assert(dest_pos + num <= 64 && src_pos + num <= 64);
+  if (num == 0)
+    return;
+
+  uint64_t mask = (num == 64) ? ~uint64_t(0) : ((uint64_t(1) << num) - 1);
+  uint64_t bits = (src >> src_pos) & mask;
+  dest = (dest & ~(mask << dest_pos)) | (bits << dest_pos);
+}
+
+
+void compress(const ByteVec& data, ByteVec& res, CompressionCodec codec)
+{
+  size_t header = 0;
+  res.resize(1 + MAX_VARINT_SIZE);
+  res[header++] = codec;
+  writeVarint(data.size(), &res[0], header);
+
+  switch (codec)
+  {
+  case NO_COMPRESSION:
+    res.resize(header + data.size());
+    if (!data.empty())
+      memcpy(&res[header], &data[0], data.size());
+    break;
+
+  case ZLIB_COMPRESSION:
+    {
+      uLongf size = compressBound(data.size());
+      res.resize(header + size);
+      int ret = compress2(&res[header], &size, data.empty() ? NULL : &data[0], data.size(), Z_BEST_SPEED);
+      if (ret != Z_OK)
+      {
+        fprintf(stderr, "zlib failed to compress %zu bytes: %d\n", data.size(), ret);
+        abort();
+      }
+      res.resize(header + size);
+    }
+    break;
+
+  default:
+    fprintf(stderr, "Unknown compression codec: %d\n", (int)codec);
+    abort();
+  }
+}
+
+
+void compress(const ByteVec& data, ByteVec& res)
+{
+  compress(data, res, ZLIB_COMPRESSION);
+}
+
+
+void extract(const ByteVec& data, ByteVec& res)
+{
+  if (data.empty())
+  {
+    fprintf(stderr, "Can not extract empty data\n");
+    abort();
+  }
+
+  size_t header = 1;
+  uint64_t size = readVarint(&data[0], data.size(), header);
+  res.resize(size);
+
+  switch (data[0])
+  {
+  case NO_COMPRESSION:
+    if (header + size != data.size())
+    {
+      fprintf(stderr, "Uncompressed data has %zu bytes instead of %zu\n", data.size() - header, (size_t)size);
+      abort();
+    }
+    if (size > 0)
+      memcpy(&res[0], &data[header], size);
+    break;
+
+  case ZLIB_COMPRESSION:
+    {
+      uLongf extracted_size = size;
+      int ret = uncompress(size ? &res[0] : NULL, &extracted_size, &data[header], data.size() - header);
+      if (ret != Z_OK || extracted_size != size)
+      {
+        fprintf(stderr, "zlib failed to extract %zu bytes: %d\n", (size_t)size, ret);
+        abort();
+      }
+    }
+    break;
+
+  default:
+    fprintf(stderr, "Unknown compression codec: %d\n", (int)data[0]);
+    abort();
+  }
+}
+
+}
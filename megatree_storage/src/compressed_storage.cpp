@@ -0,0 +1,96 @@
+#include <megatree/compressed_storage.h>
+
+
+namespace megatree {
+
+
+void CompressedStorage::get(const boost::filesystem::path &path, ByteVec &result)
+{
+  if (!isCompressed(path))
+  {
+    storage->get(path, result);
+    return;
+  }
+
+  ByteVec compressed;
+  storage->get(path, compressed);
+  extract(compressed, result);
+}
+
+void CompressedStorage::getBatch(const std::vector<boost::filesystem::path> &paths, std::vector<ByteVec> &results)
+{
+  std::vector<ByteVec> compressed;
+  storage->getBatch(paths, compressed);
+
+  results.resize(compressed.size());
+  for (size_t i = 0; i < compressed.size(); ++i)
+  {
+    if (isCompressed(paths[i]))
+      extract(compressed[i], results[i]);
+    else
+      results[i].swap(compressed[i]);
+  }
+}
+
+void CompressedStorage::putBatch(const std::vector<boost::filesystem::path> &paths, std::vector<ByteVec> &data)
+{
+  assert(paths.size() == data.size());
+  std::vector<ByteVec> compressed(data.size());
+  for (size_t i = 0; i < data.size(); ++i)
+  {
+    if (isCompressed(paths[i]))
+      compress(data[i], compressed[i], codec);
+    else
+      compressed[i] = data[i];
+  }
+  storage->putBatch(paths, compressed);
+}
+
+
+void CompressedStorage::extractCb(GetCallback callback, const ByteVec& data)
+{
+  ByteVec result;
+  extract(data, result);
+  callback(result);
+}
+
+void CompressedStorage::getAsync(const boost::filesystem::path &path, GetCallback callback)
+{
+  if (isCompressed(path))
+    storage->getAsync(path, boost::bind(&CompressedStorage::extractCb, this, callback, _1));
+  else
+    storage->getAsync(path, callback);
+}
+
+void CompressedStorage::getBatchAsync(const std::vector<boost::filesystem::path> &paths, const std::vector<GetCallback> &callbacks)
+{
+  assert(paths.size() == callbacks.size());
+  std::vector<GetCallback> extract_callbacks(callbacks.size());
+  for (size_t i = 0; i < paths.size(); ++i)
+  {
+    if (isCompressed(paths[i]))
+      extract_callbacks[i] = boost::bind(&CompressedStorage::extractCb, this, callbacks[i], _1);
+    else
+      extract_callbacks[i] = callbacks[i];
+  }
+  storage->getBatchAsync(paths, extract_callbacks);
+}
+
+
+void CompressedStorage::compressFunction(const boost::filesystem::path &path, const ByteVec &data, PutCallback callback)
+{
+  ByteVec compressed;
+  compress(data, compressed, codec);
+  storage->putAsync(path, compressed, callback);
+}
+
+void CompressedStorage::putAsync(const boost::filesystem::path &path, const ByteVec &data, PutCallback callback)
+{
+  if (isCompressed(path))
+    function_caller.addFunction(boost::bind(&CompressedStorage::compressFunction, this, path, data, callback));
+  else
+    storage->putAsync(path, data, callback);
+}
+
+
+}
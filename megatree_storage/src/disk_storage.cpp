@@ -6,6 +6,26 @@
 
 namespace megatree {
 
+// Files smaller than this are copied into memory instead of mapped.
+// Every mapping costs a page and a kernel mapping entry, which is
+// wasteful for the many small node files near the leaves.
+static const size_t MIN_MAPPED_FILE_SIZE = 16 * 1024;
+
+
+// Byte buffer that keeps a file mapped into memory
+class MappedFileBuffer : public ByteBuffer
+{
+public:
+  MappedFileBuffer(const boost::filesystem::path &path)
+    : file(path.string())
+  {}
+
+  const uint8_t* data() const { return (const uint8_t*)file.data(); }
+  size_t size() const { return file.size(); }
+
+private:
+  boost::iostreams::mapped_file_source file;
+};
 
 
 
@@ -72,6 +92,28 @@ void DiskStorage::getAsync(const boost::filesystem::path &path, GetCallback call
 }
 
 
+void DiskStorage::bufferReaderFunction(const boost::filesystem::path &path, GetBufferCallback callback)
+{
+  assert(boost::filesystem::exists(root / path));
+
+  if (boost::filesystem::file_size(root / path) < MIN_MAPPED_FILE_SIZE)
+  {
+    boost::shared_ptr<ByteVecBuffer> buffer(new ByteVecBuffer);
+    get(path, buffer->bytes);
+    callback(buffer);
+  }
+  else
+  {
+    callback(ByteBufferPtr(new MappedFileBuffer(root / path)));
+  }
+}
+
+void DiskStorage::getBufferAsync(const boost::filesystem::path &path, GetBufferCallback callback)
+{
+  function_caller.addFunction(boost::bind(&DiskStorage::bufferReaderFunction, this, path, callback));
+}
+
+
 void DiskStorage::writerFunction(const boost::filesystem::path &path, const ByteVec &data, PutCallback callback)
 {
   put(path, data);
@@ -84,5 +126,11 @@ void DiskStorage::putAsync(const boost::filesystem::path &path, const ByteVec &d
 }
 
 
+bool DiskStorage::exists(const boost::filesystem::path &path)
+{
+  return boost::filesystem::exists(root / path);
+}
+
+
 
 }
@@ -206,6 +206,17 @@ void HbaseStorage::getAsync(const boost::filesystem::path &path, GetCallback cal
   read_queue_cond.notify_one();
 }
 
+// Queues the whole batch at once, so the read threads take it in as
+// few requests to HBase as possible.
+void HbaseStorage::getBatchAsync(const std::vector<boost::filesystem::path> &paths, const std::vector<GetCallback> &callbacks)
+{
+  assert(paths.size() == callbacks.size());
+  boost::mutex::scoped_lock lock(read_queue_mutex);
+  for (size_t i = 0; i < paths.size(); ++i)
+    read_queue.push_back(ReadData(paths[i], callbacks[i]));
+  read_queue_cond.notify_all();
+}
+
 void HbaseStorage::putAsync(const boost::filesystem::path &path, const ByteVec& data, PutCallback callback)
 {
   boost::mutex::scoped_lock lock(write_queue_mutex);
@@ -214,6 +225,15 @@ void HbaseStorage::putAsync(const boost::filesystem::path &path, const ByteVec&
 }
 
 
+bool HbaseStorage::exists(const boost::filesystem::path &path)
+{
+  boost::mutex::scoped_lock lock(socket_mutex);
+  std::vector<TRowResult> results;
+  client->getRow(results, table, path.string());
+  return !results.empty();
+}
+
+
 void HbaseStorage::asyncReadThread()
 {
   boost::shared_ptr<apache::thrift::transport::TSocket> thread_socket;
@@ -1,6 +1,9 @@
 #include <megatree/viz_storage.h>
 #include <megatree/storage_factory.h>
 #include <megatree/metadata.h>
+#include <megatree/node_file_format.h>
+#include <megatree/short_id.h>
+#include <megatree/compressed_storage.h>
 
 
 namespace megatree
@@ -15,6 +18,11 @@ namespace megatree
     MetaData metadata;
     metadata.deserialize(data);
     subtree_width = metadata.subtree_width;
+    version = metadata.version;
+
+    // extracts compressed node files before converting them
+    if (metadata.compression != "none")
+      storage.reset(new CompressedStorage(storage, parseCompressionCodec(metadata.compression)));
   }
 
   void VizStorage::get(const boost::filesystem::path &path, ByteVec &result)
@@ -36,7 +44,7 @@ namespace megatree
 
   void VizStorage::getAsync(const boost::filesystem::path &path, GetCallback callback)
   {
-    if (path == "metadata.ini" || path == "views.ini")
+    if (path == "metadata.ini" || path == "views.ini" || path == "working_set.txt")
       storage->getAsync(path, callback); 
     else
       storage->getAsync(path, boost::bind(&VizStorage::convertCb, this, path, callback, _1));
@@ -55,8 +63,12 @@ void VizStorage::convertCb(const boost::filesystem::path &path, GetCallback cb,
 
   void VizStorage::convert(const ByteVec& data, ByteVec& res)
   {
-    const static size_t STRIDE = 3 + 3;
-    
+    if (version >= 12)
+    {
+      convertV12(data, res);
+      return;
+    }
+
     uint64_t num_nodes = (data.size()-1)/NODE_SIZE;
     res.resize(1+num_nodes*STRIDE);  // max possible size
 
@@ -75,61 +87,79 @@ void VizStorage::convertCb(const boost::filesystem::path &path, GetCallback cb,
       uint32_t short_id;
       memcpy(&short_id, &data[data_offset + POINT_SIZE + COLOR_SIZE + COUNT_SIZE + CHILDREN_SIZE], SHORT_ID_SIZE);
 
-      // read point
-      Point pnt[3];
-      for (unsigned i=0; i<3; i++)
-      {      
-        //TODO: We're checking out how rendering from the center of a cell looks
-        pnt[i] = 32768;
-        //pnt[i] = 0;
-        //memcpy(&pnt[i], &data[data_offset], POINT_SIZE / 3);
-        data_offset += POINT_SIZE / 3;
-      }
-
-      // convert point from local node frame to frame of node file
-      for (unsigned i=0; i<subtree_width; i++)
-      {
-        int which = (short_id >> (i*3)) & 07;
-        pnt[0] = (pnt[0] >> 1) | ((which & (1<<X_BIT)) ? 1<<(8*POINT_SIZE/3-1) : 0);
-        pnt[1] = (pnt[1] >> 1) | ((which & (1<<Y_BIT)) ? 1<<(8*POINT_SIZE/3-1) : 0);
-        pnt[2] = (pnt[2] >> 1) | ((which & (1<<Z_BIT)) ? 1<<(8*POINT_SIZE/3-1) : 0);
-      }
-
-      // one byte per point component
-      for (unsigned i=0; i<3; i++)
-      {      
-        res[res_offset] = pnt[i] >> 8*(POINT_SIZE / 3 - 1);
-        res_offset  += 1;
-      }
-    
-      // one byte per color component
-      for (unsigned i=0; i<3; i++)
-      {      
-        memcpy(&res[res_offset], &data[data_offset], 1);
-        data_offset += COLOR_SIZE / 3;
-        res_offset += 1;
-      }
-
-      // Extracts the count
-      Count count;
-      memcpy(&count, &data[data_offset], COUNT_SIZE);
-      data_offset += COUNT_SIZE;
-
-      // skip children of node
+      // read children of node
       uint8_t children;
-      memcpy(&children, &data[data_offset], 1);
-      data_offset += CHILDREN_SIZE;
-    
-      // Stashes whether the node is a leaf or not into the color
-      if (children == 0) {
-        res[res_offset-1] &= (~1);
-      }
-      else {
-        res[res_offset-1] |= 1;
-      }
-
-      // skip short id
-      data_offset += SHORT_ID_SIZE;
-    }    
+      memcpy(&children, &data[data_offset + POINT_SIZE + COLOR_SIZE + COUNT_SIZE], 1);
+
+      convertNode(short_id, subtree_width, &data[data_offset + POINT_SIZE], children, &res[res_offset]);
+      res_offset += STRIDE;
+      data_offset += NODE_SIZE;
+    }
+  }
+
+
+  void VizStorage::convertV12(const ByteVec& data, ByteVec& res)
+  {
+    uint8_t child_files;
+    std::vector<ShortId> short_ids;
+    std::vector<NodeRecord> records;
+    if (!decodeNodeFile(&data[0], data.size(), child_files, short_ids, records))
+    {
+      fprintf(stderr, "VizStorage received a corrupt node file\n");
+      abort();
+    }
+    res.resize(1+short_ids.size()*STRIDE);
+
+    // children of file
+    res[0] = child_files;
+    unsigned res_offset = 1;
+
+    // node data.  The nodes of the root file are on different levels.
+    bool root_file = data[2] & NODE_FILE_ROOT;
+    for (size_t i = 0; i < short_ids.size(); i++)
+    {
+      unsigned levels = root_file ? rootFileDepth(short_ids[i]) : subtree_width;
+      convertNode(short_ids[i], levels, records[i].color, records[i].children, &res[res_offset]);
+      res_offset += STRIDE;
+    }
+  }
+
+
+  void VizStorage::convertNode(ShortId short_id, unsigned levels, const uint8_t* color, uint8_t children, uint8_t* res)
+  {
+    // read point
+    Point pnt[3];
+    for (unsigned i=0; i<3; i++)
+    {
+      //TODO: We're checking out how rendering from the center of a cell looks
+      pnt[i] = 32768;
+      //pnt[i] = 0;
+      //memcpy(&pnt[i], &data[data_offset], POINT_SIZE / 3);
+    }
+
+    // convert point from local node frame to frame of node file
+    for (unsigned i=0; i<levels; i++)
+    {
+      int which = (short_id >> (i*3)) & 07;
+      pnt[0] = (pnt[0] >> 1) | ((which & (1<<X_BIT)) ? 1<<(8*POINT_SIZE/3-1) : 0);
+      pnt[1] = (pnt[1] >> 1) | ((which & (1<<Y_BIT)) ? 1<<(8*POINT_SIZE/3-1) : 0);
+      pnt[2] = (pnt[2] >> 1) | ((which & (1<<Z_BIT)) ? 1<<(8*POINT_SIZE/3-1) : 0);
+    }
+
+    // one byte per point component
+    for (unsigned i=0; i<3; i++)
+      res[i] = pnt[i] >> 8*(POINT_SIZE / 3 - 1);
+
+    // one byte per color component
+    for (unsigned i=0; i<3; i++)
+      res[3 + i] = color[i * COLOR_SIZE / 3];
+
+    // Stashes whether the node is a leaf or not into the color
+    if (children == 0) {
+      res[5] &= (~1);
+    }
+    else {
+      res[5] |= 1;
+    }
   }
 }